@@ -129,8 +129,10 @@ namespace Eval {
         {
             if (directory != "<internal>")
             {
-                ifstream stream(directory + eval_file, ios::binary);
-                if (load_eval(eval_file, stream))
+                string path = directory + eval_file;
+                ifstream stream(path, ios::binary);
+                if (is_mapped_eval(stream) ? load_mapped_eval(eval_file, path)
+                                           : load_eval(eval_file, stream))
                     eval_file_loaded = eval_file;
             }
 
@@ -1621,7 +1623,7 @@ make_v:
 
 Value Eval::evaluate(const Position& pos) {
 
-  pos.this_thread()->on_eval();
+  pos.this_thread()->evalSampler.on_eval(pos);
 
   Value v;
 
@@ -1687,6 +1689,79 @@ Value Eval::evaluate(const Position& pos) {
   return v;
 }
 
+/// evaluate_batch() evaluates many unrelated positions, with the same results
+/// as evaluate(). With pure NNUE the network is run for all of them together,
+/// which is faster than evaluating them one by one.
+
+void Eval::evaluate_batch(const Position* const* positions, std::size_t count, Value* values) {
+
+  if (NNUE::useNNUE != NNUE::UseNNUEMode::Pure)
+  {
+      for (std::size_t i = 0; i < count; ++i)
+          values[i] = evaluate(*positions[i]);
+      return;
+  }
+
+  std::vector<const Position*> nnuePositions;
+  std::vector<std::size_t> nnueIndices;
+  nnuePositions.reserve(count);
+  nnueIndices.reserve(count);
+
+  for (std::size_t i = 0; i < count; ++i)
+      if (positions[i]->nnue_applicable())
+      {
+          positions[i]->this_thread()->evalSampler.on_eval(*positions[i]);
+          nnuePositions.push_back(positions[i]);
+          nnueIndices.push_back(i);
+      }
+      else
+          values[i] = evaluate(*positions[i]);
+
+  std::vector<Value> nnueValues(nnuePositions.size());
+  NNUE::evaluate_batch(nnuePositions.data(), nnuePositions.size(), nnueValues.data());
+
+  // Guarantee evaluation does not hit the tablebase range
+  for (std::size_t k = 0; k < nnueIndices.size(); ++k)
+      values[nnueIndices[k]] = std::clamp(nnueValues[k], VALUE_TB_LOSS_IN_MAX_PLY + 1, VALUE_TB_WIN_IN_MAX_PLY - 1);
+}
+
+/// This overload decodes packed sfens for the current variant, each into its
+/// own StateInfo, and evaluates them in chunks. Positions that can't be decoded
+/// get VALUE_NONE.
+
+void Eval::evaluate_batch(const Tools::PackedSfen* sfens, std::size_t count, Value* values, Thread* th) {
+
+  constexpr std::size_t ChunkSize = 64;
+
+  std::vector<Position> positions(std::min(count, ChunkSize));
+  std::vector<StateInfo, AlignedAllocator<StateInfo>> states(positions.size());
+  std::vector<const Position*> decoded;
+  std::vector<std::size_t> indices;
+  std::vector<Value> decodedValues;
+
+  for (std::size_t first = 0; first < count; first += ChunkSize)
+  {
+      const std::size_t n = std::min(ChunkSize, count - first);
+
+      decoded.clear();
+      indices.clear();
+      for (std::size_t i = 0; i < n; ++i)
+          if (positions[i].set_from_packed_sfen(sfens[first + i], &states[i], th) == 0)
+          {
+              decoded.push_back(&positions[i]);
+              indices.push_back(first + i);
+          }
+          else
+              values[first + i] = VALUE_NONE;
+
+      decodedValues.resize(decoded.size());
+      evaluate_batch(decoded.data(), decoded.size(), decodedValues.data());
+
+      for (std::size_t k = 0; k < indices.size(); ++k)
+          values[indices[k]] = decodedValues[k];
+  }
+}
+
 /// trace() is like evaluate(), but instead of returning a value, it returns
 /// a string (suitable for outputting to stdout) that contains the detailed
 /// descriptions and values of each evaluation term. Useful for debugging.
@@ -19,6 +19,7 @@
 #ifndef EVALUATE_H_INCLUDED
 #define EVALUATE_H_INCLUDED
 
+#include <cstddef>
 #include <string>
 #include <optional>
 
@@ -29,11 +30,18 @@
 namespace Stockfish {
 
 class Position;
+class Thread;
+
+namespace Tools {
+  struct PackedSfen;
+}
 
 namespace Eval {
 
   std::string trace(Position& pos);
   Value evaluate(const Position& pos);
+  void evaluate_batch(const Position* const* positions, std::size_t count, Value* values);
+  void evaluate_batch(const Tools::PackedSfen* sfens, std::size_t count, Value* values, Thread* th);
 
   // The default net name MUST follow the format nn-[SHA256 first 12 digits].nnue
   // for the build process (profile-build and fishtest) to work. Do not change the
@@ -53,6 +61,7 @@ namespace Eval {
 
     std::string trace(Position& pos);
     Value evaluate(const Position& pos, bool adjusted = false);
+    void evaluate_batch(const Position* const* positions, std::size_t count, Value* values, bool adjusted = false);
 
     void init();
     void verify();
@@ -61,6 +70,10 @@ namespace Eval {
     bool save_eval(std::ostream& stream);
     bool save_eval(const std::optional<std::string>& filename);
 
+    bool is_mapped_eval(std::istream& stream);
+    bool load_mapped_eval(std::string name, const std::string& path);
+    bool save_mapped_eval(const std::string& filename);
+
   } // namespace NNUE
 
 } // namespace Eval
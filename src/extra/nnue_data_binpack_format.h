@@ -6730,10 +6730,21 @@ namespace binpack
             m_file.seekg(0);
         }
 
-        void append(const char* data, std::uint32_t size)
+        // Returns the offset of the chunk in the file.
+        std::uint64_t append(const char* data, std::uint32_t size)
         {
+            m_file.seekp(0, std::ios_base::end);
+            const std::uint64_t offset = static_cast<std::uint64_t>(m_file.tellp());
             writeChunkHeader({size});
             m_file.write(data, size);
+            return offset;
+        }
+
+        // Positions the reading head at the chunk starting at the given offset.
+        void seekChunk(std::uint64_t offset)
+        {
+            m_file.clear();
+            m_file.seekg(offset);
         }
 
         [[nodiscard]] bool hasNextChunk()
@@ -6799,6 +6810,172 @@ namespace binpack
         }
     };
 
+    // Location and summary of a chunk, as stored in the sidecar index.
+    struct CompressedTrainingDataChunkInfo
+    {
+        std::uint64_t offset;      // offset of the chunk header in the data file
+        std::uint32_t size;        // size of the chunk without the header
+        std::uint32_t numEntries;  // 0 if unknown
+        std::uint16_t firstPly;    // ply of the first entry in the chunk
+    };
+
+    // A chunk that was encoded in memory, to be appended to a file later.
+    struct EncodedChunk
+    {
+        std::vector<char> data;    // without the header
+        std::uint32_t numEntries;
+        std::uint16_t firstPly;
+    };
+
+    // The sidecar index is stored next to the data file as <path>.index
+    // It is the magic 'BIDX' followed by one 20 byte record per chunk:
+    //   offset (8 bytes), size (4 bytes), numEntries (4 bytes),
+    //   firstPly (2 bytes), reserved (2 bytes), all little endian.
+    // The index is only used if it describes exactly all chunks of the data file.
+    [[nodiscard]] inline std::string compressedTrainingDataIndexPath(const std::string& path)
+    {
+        return path + ".index";
+    }
+
+    namespace detail
+    {
+        constexpr std::size_t indexRecordSize = 20;
+
+        inline void writeIndexRecord(std::ostream& out, const CompressedTrainingDataChunkInfo& info)
+        {
+            unsigned char record[indexRecordSize] = {};
+            for (int i = 0; i < 8; ++i) record[i] = static_cast<unsigned char>(info.offset >> (8 * i));
+            for (int i = 0; i < 4; ++i) record[8 + i] = static_cast<unsigned char>(info.size >> (8 * i));
+            for (int i = 0; i < 4; ++i) record[12 + i] = static_cast<unsigned char>(info.numEntries >> (8 * i));
+            for (int i = 0; i < 2; ++i) record[16 + i] = static_cast<unsigned char>(info.firstPly >> (8 * i));
+            out.write(reinterpret_cast<const char*>(record), indexRecordSize);
+        }
+
+        [[nodiscard]] inline std::uint64_t fileSize(const std::string& path)
+        {
+            std::ifstream file(path, std::ios_base::binary | std::ios_base::ate);
+            return file ? static_cast<std::uint64_t>(file.tellg()) : 0;
+        }
+
+        // The chunks must be contiguous and cover the whole file.
+        [[nodiscard]] inline bool coversFile(const std::vector<CompressedTrainingDataChunkInfo>& chunks, std::uint64_t fileSize)
+        {
+            std::uint64_t expectedOffset = 0;
+            for (const auto& chunk : chunks)
+            {
+                if (chunk.offset != expectedOffset)
+                    return false;
+
+                expectedOffset += 8 + chunk.size;
+            }
+
+            return expectedOffset == fileSize;
+        }
+    }
+
+    // Returns the chunks described by the sidecar index if it is valid for the file.
+    [[nodiscard]] inline std::optional<std::vector<CompressedTrainingDataChunkInfo>> tryLoadCompressedTrainingDataIndex(const std::string& path)
+    {
+        std::ifstream indexFile(compressedTrainingDataIndexPath(path), std::ios_base::binary);
+        if (!indexFile)
+            return std::nullopt;
+
+        char magic[4];
+        if (!indexFile.read(magic, 4) || std::memcmp(magic, "BIDX", 4) != 0)
+            return std::nullopt;
+
+        std::vector<CompressedTrainingDataChunkInfo> chunks;
+        unsigned char record[detail::indexRecordSize];
+        while (indexFile.read(reinterpret_cast<char*>(record), detail::indexRecordSize))
+        {
+            CompressedTrainingDataChunkInfo info{};
+            for (int i = 0; i < 8; ++i) info.offset |= static_cast<std::uint64_t>(record[i]) << (8 * i);
+            for (int i = 0; i < 4; ++i) info.size |= static_cast<std::uint32_t>(record[8 + i]) << (8 * i);
+            for (int i = 0; i < 4; ++i) info.numEntries |= static_cast<std::uint32_t>(record[12 + i]) << (8 * i);
+            for (int i = 0; i < 2; ++i) info.firstPly |= static_cast<std::uint16_t>(record[16 + i] << (8 * i));
+            chunks.emplace_back(info);
+        }
+
+        if (!detail::coversFile(chunks, detail::fileSize(path)))
+            return std::nullopt;
+
+        return chunks;
+    }
+
+    // Finds the chunks by seeking from one chunk header to the next.
+    // Only the offsets and sizes are known.
+    [[nodiscard]] inline std::vector<CompressedTrainingDataChunkInfo> scanCompressedTrainingDataChunks(const std::string& path)
+    {
+        std::vector<CompressedTrainingDataChunkInfo> chunks;
+
+        std::ifstream file(path, std::ios_base::binary);
+        const std::uint64_t size = detail::fileSize(path);
+
+        std::uint64_t offset = 0;
+        unsigned char header[8];
+        while (offset + 8 <= size && file.seekg(offset) && file.read(reinterpret_cast<char*>(header), 8))
+        {
+            if (header[0] != 'B' || header[1] != 'I' || header[2] != 'N' || header[3] != 'P')
+                break;
+
+            const std::uint32_t chunkSize =
+                header[4]
+                | (header[5] << 8)
+                | (header[6] << 16)
+                | (header[7] << 24);
+
+            chunks.push_back({ offset, chunkSize, 0, 0 });
+            offset += 8 + std::uint64_t(chunkSize);
+        }
+
+        return chunks;
+    }
+
+    // Chunks of the file, from the sidecar index if available.
+    [[nodiscard]] inline std::vector<CompressedTrainingDataChunkInfo> loadCompressedTrainingDataChunks(const std::string& path)
+    {
+        auto chunks = tryLoadCompressedTrainingDataIndex(path);
+        if (chunks.has_value())
+            return std::move(*chunks);
+
+        return scanCompressedTrainingDataChunks(path);
+    }
+
+    // Appends the chunks written to the data file to the sidecar index.
+    // When appending to a data file that has chunks not covered by
+    // the index no index is written, it would be incomplete.
+    struct CompressedTrainingDataIndexWriter
+    {
+        CompressedTrainingDataIndexWriter(const std::string& path, std::ios_base::openmode om)
+        {
+            const std::string indexPath = compressedTrainingDataIndexPath(path);
+            const bool append = (om & std::ios_base::app) && detail::fileSize(path) > 0;
+
+            if (append)
+            {
+                if (tryLoadCompressedTrainingDataIndex(path).has_value())
+                    m_file.open(indexPath, std::ios_base::binary | std::ios_base::app);
+            }
+            else
+            {
+                m_file.open(indexPath, std::ios_base::binary | std::ios_base::trunc | std::ios_base::out);
+                m_file.write("BIDX", 4);
+            }
+        }
+
+        void add(const CompressedTrainingDataChunkInfo& info)
+        {
+            if (m_file.is_open())
+            {
+                detail::writeIndexRecord(m_file, info);
+                m_file.flush();
+            }
+        }
+
+    private:
+        std::ofstream m_file;
+    };
+
     [[nodiscard]] inline std::uint16_t signedToUnsigned(std::int16_t a)
     {
         std::uint16_t r;
@@ -7326,18 +7503,56 @@ namespace binpack
     {
         static constexpr std::size_t chunkSize = suggestedChunkSize;
 
-        CompressedTrainingDataEntryWriter(std::string path, std::ios_base::openmode om = std::ios_base::app) :
-            m_outputFile(path, om),
+        CompressedTrainingDataEntryWriter(std::string path, std::ios_base::openmode om = std::ios_base::app, bool writeIndex = false) :
+            m_outputFile(std::in_place, path, om),
+            m_index(writeIndex ? std::make_unique<CompressedTrainingDataIndexWriter>(path, om) : nullptr),
+            m_encodedChunks(nullptr),
+            m_lastEntry{},
+            m_movelist{},
+            m_packedSize(0),
+            m_packedEntries(chunkSize + maxMovelistSize),
+            m_isFirst(true),
+            m_numChunkEntries(0),
+            m_chunkFirstPly(0)
+        {
+            m_lastEntry.ply = 0xFFFF; // so it's never a continuation
+            m_lastEntry.result = 0x7FFF;
+        }
+
+        // Collects the chunks in memory instead of writing them to a file.
+        // They can be written later with addEncodedChunk().
+        explicit CompressedTrainingDataEntryWriter(std::vector<EncodedChunk>& out) :
+            m_outputFile(std::nullopt),
+            m_index(nullptr),
+            m_encodedChunks(&out),
             m_lastEntry{},
             m_movelist{},
             m_packedSize(0),
             m_packedEntries(chunkSize + maxMovelistSize),
-            m_isFirst(true)
+            m_isFirst(true),
+            m_numChunkEntries(0),
+            m_chunkFirstPly(0)
         {
             m_lastEntry.ply = 0xFFFF; // so it's never a continuation
             m_lastEntry.result = 0x7FFF;
         }
 
+        // Appends a chunk encoded by another writer. The current chunk is
+        // written out first, and the next entry will not continue a chain.
+        void addEncodedChunk(const EncodedChunk& chunk)
+        {
+            assert(m_outputFile.has_value());
+
+            finishChunk();
+
+            const auto size = static_cast<std::uint32_t>(chunk.data.size());
+            const auto offset = m_outputFile->append(chunk.data.data(), size);
+            if (m_index)
+            {
+                m_index->add({ offset, size, chunk.numEntries, chunk.firstPly });
+            }
+        }
+
         void addTrainingDataEntry(const TrainingDataEntry& e)
         {
             bool isCont = isContinuation(m_lastEntry, e);
@@ -7355,8 +7570,12 @@ namespace binpack
 
                 if (m_packedSize >= chunkSize)
                 {
-                    m_outputFile.append(m_packedEntries.data(), m_packedSize);
-                    m_packedSize = 0;
+                    writeChunk();
+                }
+
+                if (m_packedSize == 0)
+                {
+                    m_chunkFirstPly = e.ply;
                 }
 
                 auto packed = packEntry(e);
@@ -7369,9 +7588,28 @@ namespace binpack
             }
 
             m_lastEntry = e;
+            ++m_numChunkEntries;
         }
 
         ~CompressedTrainingDataEntryWriter()
+        {
+            finishChunk();
+        }
+
+    private:
+        std::optional<CompressedTrainingDataFile> m_outputFile;
+        std::unique_ptr<CompressedTrainingDataIndexWriter> m_index;
+        std::vector<EncodedChunk>* m_encodedChunks;
+        TrainingDataEntry m_lastEntry;
+        PackedMoveScoreList m_movelist;
+        std::size_t m_packedSize;
+        std::vector<char> m_packedEntries;
+        bool m_isFirst;
+        std::uint32_t m_numChunkEntries;
+        std::uint16_t m_chunkFirstPly;
+
+        // Writes out the current chunk, if any, ending the last chain.
+        void finishChunk()
         {
             if (m_packedSize > 0)
             {
@@ -7380,18 +7618,36 @@ namespace binpack
                     writeMovelist();
                 }
 
-                m_outputFile.append(m_packedEntries.data(), m_packedSize);
-                m_packedSize = 0;
+                writeChunk();
             }
+
+            m_isFirst = true;
+            m_lastEntry.ply = 0xFFFF;
+            m_lastEntry.result = 0x7FFF;
         }
 
-    private:
-        CompressedTrainingDataFile m_outputFile;
-        TrainingDataEntry m_lastEntry;
-        PackedMoveScoreList m_movelist;
-        std::size_t m_packedSize;
-        std::vector<char> m_packedEntries;
-        bool m_isFirst;
+        // The movelist of the last chain must already be written.
+        void writeChunk()
+        {
+            if (m_encodedChunks)
+            {
+                m_encodedChunks->push_back({
+                    std::vector<char>(m_packedEntries.data(), m_packedEntries.data() + m_packedSize),
+                    m_numChunkEntries,
+                    m_chunkFirstPly });
+            }
+            else
+            {
+                const auto offset = m_outputFile->append(m_packedEntries.data(), m_packedSize);
+                if (m_index)
+                {
+                    m_index->add({ offset, static_cast<std::uint32_t>(m_packedSize), m_numChunkEntries, m_chunkFirstPly });
+                }
+            }
+
+            m_packedSize = 0;
+            m_numChunkEntries = 0;
+        }
 
         void writeMovelist()
         {
@@ -7431,6 +7687,32 @@ namespace binpack
             return !m_isEnd;
         }
 
+        // Continues reading from the chunk at the given offset,
+        // as found in the sidecar index.
+        void seekToChunk(std::uint64_t offset)
+        {
+            m_movelistReader.reset();
+            m_offset = 0;
+            m_inputFile.seekChunk(offset);
+
+            if (!m_inputFile.hasNextChunk())
+            {
+                m_isEnd = true;
+            }
+            else
+            {
+                m_chunk = m_inputFile.readNextChunk();
+                m_isEnd = false;
+            }
+            ++m_numChunksRead;
+        }
+
+        // Changes every time reading moves on to another chunk.
+        [[nodiscard]] std::size_t numChunksRead() const
+        {
+            return m_numChunksRead;
+        }
+
         [[nodiscard]] TrainingDataEntry next()
         {
             if (m_movelistReader.has_value())
@@ -7475,6 +7757,7 @@ namespace binpack
         std::optional<PackedMoveScoreListReader> m_movelistReader;
         std::size_t m_offset;
         bool m_isEnd;
+        std::size_t m_numChunksRead = 0;
 
         void fetchNextChunkIfNeeded()
         {
@@ -7484,6 +7767,7 @@ namespace binpack
                 {
                     m_chunk = m_inputFile.readNextChunk();
                     m_offset = 0;
+                    ++m_numChunksRead;
                 }
                 else
                 {
@@ -561,8 +561,8 @@ void sleep(int ms);
 
 namespace Algo {
     // Fisher-Yates
-    template <typename Rng, typename T>
-    void shuffle(std::vector<T>& buf, Rng&& prng)
+    template <typename Rng, typename T, typename Alloc>
+    void shuffle(std::vector<T, Alloc>& buf, Rng&& prng)
     {
         const auto size = buf.size();
         for (uint64_t i = 0; i < size; ++i)
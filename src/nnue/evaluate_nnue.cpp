@@ -19,10 +19,19 @@
 // Code for calculating NNUE evaluation function
 
 #include <iostream>
+#include <new>
 #include <set>
 #include <sstream>
 #include <iomanip>
 #include <fstream>
+#include <vector>
+
+#if !defined(_WIN32)
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
 
 #include "../evaluate.h"
 #include "../position.h"
@@ -44,6 +53,52 @@ namespace Stockfish::Eval::NNUE {
   std::string fileName;
   std::string netDescription;
 
+  // Read-only mapping of a network file written by save_mapped_eval()
+  struct MappedNet {
+    void* address = nullptr;
+    std::size_t size = 0;
+
+    ~MappedNet() {
+#if !defined(_WIN32)
+      if (address)
+        ::munmap(address, size);
+#endif
+    }
+  };
+
+  // Holds the feature transformer weights if the network is mapped
+  std::unique_ptr<MappedNet> mappedNet;
+
+  // Header of a mapped network file. It is followed by the network in the
+  // usual format but without the feature transformer weights, which are
+  // stored as they are laid out in memory, in sections aligned to large
+  // pages. Those sections are mapped instead of read, so processes that
+  // load the same file share one copy of the weights.
+  struct MappedNetHeader {
+    static constexpr std::uint64_t Magic = 0x50414d4d45554e4eULL; // "NNUEMMAP"
+    static constexpr std::uint32_t Version = 1;
+    static constexpr std::uint64_t SectionAlignment = 2 * 1024 * 1024;
+
+    std::uint64_t magic;
+    std::uint32_t version;
+    std::uint32_t hashValue;
+
+    // Layout of the weight sections. Columns of HalfDimensions int16
+    // weights and of PSQTBuckets int32 weights, one per input feature,
+    // in native little endian byte order without any permutation.
+    std::uint32_t inputDimensions;
+    std::uint32_t halfDimensions;
+    std::uint32_t psqtBuckets;
+    std::uint32_t sectionAlignment;
+
+    std::uint64_t paramsOffset;
+    std::uint64_t paramsSize;
+    std::uint64_t weightsOffset;
+    std::uint64_t psqtWeightsOffset;
+  };
+
+  static_assert(sizeof(MappedNetHeader) == 64);
+
   namespace Detail {
 
   // Initialize the evaluation function parameters
@@ -58,8 +113,8 @@ namespace Stockfish::Eval::NNUE {
   void initialize(LargePagePtr<T>& pointer) {
 
     static_assert(alignof(T) <= 4096, "aligned_large_pages_alloc() may fail for such a big alignment requirement of T");
-    pointer.reset(reinterpret_cast<T*>(aligned_large_pages_alloc(sizeof(T))));
-    std::memset(pointer.get(), 0, sizeof(T));
+    void* memory = aligned_large_pages_alloc(sizeof(T));
+    pointer.reset(new (memory) T());
   }
 
   // Read evaluation function parameters
@@ -136,6 +191,26 @@ namespace Stockfish::Eval::NNUE {
     return (bool)stream;
   }
 
+  // Index of the layer stack and PSQT bucket used for the position
+  static std::size_t bucket_of(const Position& pos) {
+
+    return std::min((pos.count<ALL_PIECES>() - 1) * 8 / currentNnueVariant->nnueMaxPieces, 7);
+  }
+
+  // Combines the PSQT and the network output into the evaluation
+  static Value combine(const Position& pos, int materialist, int positional, bool adjusted) {
+
+    int delta_npm = abs(pos.non_pawn_material(WHITE) - pos.non_pawn_material(BLACK));
+    int entertainment = (adjusted && delta_npm <= BishopValueMg - KnightValueMg ? 7 : 0);
+
+    int A = 128 - entertainment;
+    int B = 128 + entertainment;
+
+    int sum = (A * materialist + B * positional) / 128;
+
+    return static_cast<Value>( sum / OutputScale );
+  }
+
   // Evaluation function. Perform differential calculation.
   Value evaluate(const Position& pos, bool adjusted) {
 
@@ -160,33 +235,84 @@ namespace Stockfish::Eval::NNUE {
     ASSERT_ALIGNED(transformedFeatures, alignment);
     ASSERT_ALIGNED(buffer, alignment);
 
-    const std::size_t bucket = std::min((pos.count<ALL_PIECES>() - 1) * 8 / currentNnueVariant->nnueMaxPieces, 7);
+    const std::size_t bucket = bucket_of(pos);
     const auto psqt = featureTransformer->transform(pos, transformedFeatures, bucket);
     const auto output = network[bucket]->propagate(transformedFeatures, buffer);
 
-    int materialist = psqt;
-    int positional  = output[0];
+    return combine(pos, psqt, output[0], adjusted);
+  }
 
-    int delta_npm = abs(pos.non_pawn_material(WHITE) - pos.non_pawn_material(BLACK));
-    int entertainment = (adjusted && delta_npm <= BishopValueMg - KnightValueMg ? 7 : 0);
+  // Evaluates many unrelated positions, with the same results as evaluate().
+  // The positions are grouped by layer stack and each group is propagated
+  // through the network together, so that the weights are loaded into
+  // the cache once per group instead of once per position.
+  void evaluate_batch(const Position* const* positions, std::size_t count, Value* values, bool adjusted) {
 
-    int A = 128 - entertainment;
-    int B = 128 + entertainment;
+    constexpr IndexType BatchSize = 16;
+    constexpr uint64_t alignment = CacheLineSize;
 
-    int sum = (A * materialist + B * positional) / 128;
+    static_assert(Layers::InputLayer::OutputStride * sizeof(TransformedFeatureType)
+                  == FeatureTransformer::BufferSize);
 
-    return static_cast<Value>( sum / OutputScale );
-  }
+#if defined(ALIGNAS_ON_STACK_VARIABLES_BROKEN)
+    TransformedFeatureType transformedFeaturesUnaligned[
+      FeatureTransformer::BufferSize * BatchSize + alignment / sizeof(TransformedFeatureType)];
+    char bufferUnaligned[Network::BufferSize * BatchSize + alignment];
+
+    auto* transformedFeatures = align_ptr_up<alignment>(&transformedFeaturesUnaligned[0]);
+    auto* buffer = align_ptr_up<alignment>(&bufferUnaligned[0]);
+#else
+    alignas(alignment)
+      TransformedFeatureType transformedFeatures[FeatureTransformer::BufferSize * BatchSize];
+    alignas(alignment) char buffer[Network::BufferSize * BatchSize];
+#endif
 
-  struct NnueEvalTrace {
-    static_assert(LayerStacks == PSQTBuckets);
+    ASSERT_ALIGNED(transformedFeatures, alignment);
+    ASSERT_ALIGNED(buffer, alignment);
 
-    Value psqt[LayerStacks];
-    Value positional[LayerStacks];
-    std::size_t correctBucket;
-  };
+    // Order the positions by bucket with a counting sort
+    std::vector<std::uint8_t> buckets(count);
+    std::size_t bucketStart[LayerStacks + 1] = {};
+    for (std::size_t i = 0; i < count; ++i)
+    {
+      buckets[i] = static_cast<std::uint8_t>(bucket_of(*positions[i]));
+      ++bucketStart[buckets[i] + 1];
+    }
+
+    for (std::size_t b = 0; b < LayerStacks; ++b)
+      bucketStart[b + 1] += bucketStart[b];
+
+    std::vector<std::size_t> order(count);
+    std::size_t next[LayerStacks];
+    std::copy(bucketStart, bucketStart + LayerStacks, next);
+    for (std::size_t i = 0; i < count; ++i)
+      order[next[buckets[i]]++] = i;
+
+    std::int32_t psqt[BatchSize];
+
+    for (std::size_t bucket = 0; bucket < LayerStacks; ++bucket)
+      for (std::size_t first = bucketStart[bucket]; first < bucketStart[bucket + 1]; first += BatchSize)
+      {
+        const IndexType n = static_cast<IndexType>(std::min<std::size_t>(BatchSize, bucketStart[bucket + 1] - first));
+
+        for (IndexType k = 0; k < n; ++k)
+          psqt[k] = featureTransformer->transform(
+              *positions[order[first + k]], transformedFeatures + FeatureTransformer::BufferSize * k, bucket);
+
+        const auto output = network[bucket]->propagate_batch(transformedFeatures, n, buffer);
+
+        for (IndexType k = 0; k < n; ++k)
+        {
+          const std::size_t i = order[first + k];
+          values[i] = combine(*positions[i], psqt[k], output[k * Network::OutputStride], adjusted);
+        }
+      }
+  }
 
-  static NnueEvalTrace trace_evaluate(const Position& pos) {
+  // Evaluates the position with every bucket, or only with the bucket used
+  // by evaluate() if allBuckets is false. The features are transformed once
+  // for all buckets.
+  NnueEvalTrace trace_evaluate(const Position& pos, bool allBuckets) {
 
     // We manually align the arrays on the stack because with gcc < 9.3
     // overaligning stack variables with alignas() doesn't work correctly.
@@ -210,16 +336,20 @@ namespace Stockfish::Eval::NNUE {
     ASSERT_ALIGNED(buffer, alignment);
 
     NnueEvalTrace t{};
-    t.correctBucket = std::min((pos.count<ALL_PIECES>() - 1) * 8 / currentNnueVariant->nnueMaxPieces, 7);
+    t.correctBucket = bucket_of(pos);
+    featureTransformer->transform(pos, transformedFeatures, t.correctBucket);
     for (std::size_t bucket = 0; bucket < LayerStacks; ++bucket) {
-      const auto psqt = featureTransformer->transform(pos, transformedFeatures, bucket);
-      const auto output = network[bucket]->propagate(transformedFeatures, buffer);
-
-      int materialist = psqt;
-      int positional  = output[0];
-
+      int materialist = featureTransformer->psqt_value(pos, bucket);
       t.psqt[bucket] = static_cast<Value>( materialist / OutputScale );
-      t.positional[bucket] = static_cast<Value>( positional / OutputScale );
+
+      if (allBuckets || bucket == t.correctBucket)
+      {
+        const auto output = network[bucket]->propagate(transformedFeatures, buffer);
+        int positional = output[0];
+        t.positional[bucket] = static_cast<Value>( positional / OutputScale );
+      }
+      else
+        t.positional[bucket] = VALUE_NONE;
     }
 
     return t;
@@ -396,6 +526,7 @@ namespace Stockfish::Eval::NNUE {
   bool load_eval(std::string name, std::istream& stream) {
 
     initialize();
+    mappedNet.reset();
     fileName = name;
     return read_parameters(stream);
   }
@@ -440,4 +571,179 @@ namespace Stockfish::Eval::NNUE {
   }
 
 
+  // Returns whether the stream holds a file written by save_mapped_eval().
+  // The stream is left at its beginning.
+  bool is_mapped_eval(std::istream& stream) {
+
+    std::uint64_t magic = 0;
+    stream.read(reinterpret_cast<char*>(&magic), sizeof(magic));
+    const bool mapped = stream && magic == MappedNetHeader::Magic;
+
+    stream.clear();
+    stream.seekg(0);
+    return mapped;
+  }
+
+#if !defined(_WIN32)
+
+  static constexpr std::uint64_t align_up(std::uint64_t n, std::uint64_t alignment) {
+    return (n + alignment - 1) / alignment * alignment;
+  }
+
+  // Load eval, mapping the weights of a file written by save_mapped_eval()
+  bool load_mapped_eval(std::string name, const std::string& path) {
+
+    initialize();
+    mappedNet.reset();
+
+    const int fd = ::open(path.c_str(), O_RDONLY);
+    if (fd == -1)
+      return false;
+
+    struct stat st;
+    void* address = MAP_FAILED;
+    if (::fstat(fd, &st) == 0 && std::size_t(st.st_size) >= sizeof(MappedNetHeader))
+      address = ::mmap(nullptr, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+
+    // The mapping stays valid after the descriptor is closed
+    ::close(fd);
+
+    if (address == MAP_FAILED)
+      return false;
+
+    auto net = std::make_unique<MappedNet>();
+    net->address = address;
+    net->size = st.st_size;
+
+    const char* data = static_cast<const char*>(address);
+    MappedNetHeader header;
+    std::memcpy(&header, data, sizeof(header));
+
+    const std::uint64_t dimensions = FeatureSet::get_dimensions();
+    const std::uint64_t weightsSize = sizeof(WeightType) * TransformedFeatureDimensions * dimensions;
+    const std::uint64_t psqtWeightsSize = sizeof(PSQTWeightType) * PSQTBuckets * dimensions;
+
+    if (   !IsLittleEndian
+        || header.magic != MappedNetHeader::Magic
+        || header.version != MappedNetHeader::Version
+        || header.hashValue != HashValue
+        || header.inputDimensions != dimensions
+        || header.halfDimensions != TransformedFeatureDimensions
+        || header.psqtBuckets != PSQTBuckets
+        || header.weightsOffset % CacheLineSize != 0
+        || header.psqtWeightsOffset % CacheLineSize != 0
+        || header.paramsOffset + header.paramsSize > net->size
+        || header.weightsOffset + weightsSize > net->size
+        || header.psqtWeightsOffset + psqtWeightsSize > net->size)
+      return false;
+
+#if defined(MADV_HUGEPAGE)
+    ::madvise(address, net->size, MADV_HUGEPAGE);
+#endif
+
+    // C++ way to prepare a buffer for a memory stream
+    class MemoryBuffer : public std::basic_streambuf<char> {
+      public: MemoryBuffer(char* p, std::size_t n) { setg(p, p, p + n); setp(p, p + n); }
+    };
+
+    MemoryBuffer buffer(const_cast<char*>(data + header.paramsOffset), header.paramsSize);
+    std::istream stream(&buffer);
+
+    std::uint32_t hashValue;
+    if (!read_header(stream, &hashValue, &netDescription) || hashValue != HashValue)
+      return false;
+
+    if (   read_little_endian<std::uint32_t>(stream) != FeatureTransformer::get_hash_value()
+        || !featureTransformer->read_mapped_parameters(
+               stream,
+               reinterpret_cast<const WeightType*>(data + header.weightsOffset),
+               reinterpret_cast<const PSQTWeightType*>(data + header.psqtWeightsOffset),
+               dimensions))
+    {
+      // The transformer may point into the mapping, which goes with net
+      initialize();
+      return false;
+    }
+
+    bool ok = true;
+    for (std::size_t i = 0; i < LayerStacks && ok; ++i)
+      ok = Detail::read_parameters(stream, *(network[i]));
+
+    if (!ok || !stream || stream.peek() != std::ios::traits_type::eof())
+    {
+      initialize();
+      return false;
+    }
+
+    mappedNet = std::move(net);
+    fileName = name;
+    return true;
+  }
+
+  // Save eval in the format of load_mapped_eval(), to a file given by its name
+  bool save_mapped_eval(const std::string& filename) {
+
+    if (fileName.empty() || !IsLittleEndian)
+    {
+        sync_cout << "Failed to export a mapped net" << sync_endl;
+        return false;
+    }
+
+    std::stringstream params;
+    bool saved = write_header(params, HashValue, netDescription);
+    write_little_endian<std::uint32_t>(params, FeatureTransformer::get_hash_value());
+    saved = saved && featureTransformer->write_mapped_parameters(params);
+    for (std::size_t i = 0; i < LayerStacks; ++i)
+      saved = saved && Detail::write_parameters(params, *(network[i]));
+
+    const std::string paramsData = params.str();
+    const std::uint64_t dimensions = featureTransformer->get_input_dimensions();
+    const std::uint64_t weightsSize = sizeof(WeightType) * TransformedFeatureDimensions * dimensions;
+    const std::uint64_t psqtWeightsSize = sizeof(PSQTWeightType) * PSQTBuckets * dimensions;
+
+    MappedNetHeader header{};
+    header.magic = MappedNetHeader::Magic;
+    header.version = MappedNetHeader::Version;
+    header.hashValue = HashValue;
+    header.inputDimensions = dimensions;
+    header.halfDimensions = TransformedFeatureDimensions;
+    header.psqtBuckets = PSQTBuckets;
+    header.sectionAlignment = MappedNetHeader::SectionAlignment;
+    header.paramsOffset = sizeof(MappedNetHeader);
+    header.paramsSize = paramsData.size();
+    header.weightsOffset = align_up(header.paramsOffset + header.paramsSize, MappedNetHeader::SectionAlignment);
+    header.psqtWeightsOffset = align_up(header.weightsOffset + weightsSize, MappedNetHeader::SectionAlignment);
+
+    // The padding between the sections reads as zeros
+    std::ofstream stream(filename, std::ios_base::binary | std::ios_base::trunc);
+    stream.write(reinterpret_cast<const char*>(&header), sizeof(header));
+    stream.write(paramsData.data(), paramsData.size());
+    stream.seekp(header.weightsOffset);
+    stream.write(reinterpret_cast<const char*>(featureTransformer->get_weights()), weightsSize);
+    stream.seekp(header.psqtWeightsOffset);
+    stream.write(reinterpret_cast<const char*>(featureTransformer->get_psqt_weights()), psqtWeightsSize);
+    saved = saved && stream;
+
+    sync_cout << (saved ? "Mapped network saved successfully to " + filename
+                        : "Failed to export a mapped net") << sync_endl;
+    return saved;
+  }
+
+#else
+
+  bool load_mapped_eval(std::string, const std::string&) {
+
+    sync_cout << "info string ERROR: Mapped networks are not supported on this platform" << sync_endl;
+    return false;
+  }
+
+  bool save_mapped_eval(const std::string&) {
+
+    sync_cout << "Mapped networks are not supported on this platform" << sync_endl;
+    return false;
+  }
+
+#endif
+
+
 } // namespace Stockfish::Eval::NNUE
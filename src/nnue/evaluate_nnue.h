@@ -54,6 +54,19 @@ namespace Stockfish::Eval::NNUE {
   template <typename T>
   using LargePagePtr = std::unique_ptr<T, LargePageDeleter<T>>;
 
+  // Contributions of the network to the evaluation of a position, bucket
+  // by bucket, from the point of view of the side to move
+  struct NnueEvalTrace {
+    static_assert(LayerStacks == PSQTBuckets);
+
+    Value psqt[LayerStacks];
+    Value positional[LayerStacks];
+    std::size_t correctBucket;
+  };
+
+  // Positional values that were not computed are VALUE_NONE
+  NnueEvalTrace trace_evaluate(const Position& pos, bool allBuckets = true);
+
 }  // namespace Stockfish::Eval::NNUE
 
 #endif // #ifndef NNUE_EVALUATE_NNUE_H_INCLUDED
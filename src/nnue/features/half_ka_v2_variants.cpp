@@ -25,25 +25,25 @@
 namespace Stockfish::Eval::NNUE::Features {
 
   // Map square to numbering on variant board
-  inline Square to_variant_square(Square s, const Position& pos) {
-    return Square(s - rank_of(s) * (FILE_MAX - pos.max_file()));
+  inline Square to_variant_square(Square s, const Variant* v) {
+    return Square(s - rank_of(s) * (FILE_MAX - v->maxFile));
   }
 
   // Orient a square according to perspective (rotates by 180 for black)
   // Missing kings map to index 0 (SQ_A1)
-  inline Square HalfKAv2Variants::orient(Color perspective, Square s, const Position& pos) {
-    return s != SQ_NONE ? to_variant_square(  perspective == WHITE || (pos.flag_region(BLACK) & Rank8BB) ? s
-                                            : flip_rank(s, pos.max_rank()), pos) : SQ_A1;
+  inline Square HalfKAv2Variants::orient(Color perspective, Square s, const Variant* v) {
+    return s != SQ_NONE ? to_variant_square(  perspective == WHITE || (v->flagRegion[BLACK] & Rank8BB) ? s
+                                            : flip_rank(s, v->maxRank), v) : SQ_A1;
   }
 
   // Index of a feature for a given king position and another piece on some square
-  inline IndexType HalfKAv2Variants::make_index(Color perspective, Square s, Piece pc, Square ksq, const Position& pos) {
-    return IndexType(orient(perspective, s, pos) + pos.variant()->pieceSquareIndex[perspective][pc] + pos.variant()->kingSquareIndex[ksq]);
+  inline IndexType HalfKAv2Variants::make_index(Color perspective, Square s, Piece pc, Square ksq, const Variant* v) {
+    return IndexType(orient(perspective, s, v) + v->pieceSquareIndex[perspective][pc] + v->kingSquareIndex[ksq]);
   }
 
   // Index of a feature for a given king position and another piece on some square
-  inline IndexType HalfKAv2Variants::make_index(Color perspective, int handCount, Piece pc, Square ksq, const Position& pos) {
-    return IndexType(handCount + pos.variant()->pieceHandIndex[perspective][pc] + pos.variant()->kingSquareIndex[ksq]);
+  inline IndexType HalfKAv2Variants::make_index(Color perspective, int handCount, Piece pc, Square ksq, const Variant* v) {
+    return IndexType(handCount + v->pieceHandIndex[perspective][pc] + v->kingSquareIndex[ksq]);
   }
 
   // Get a list of indices for active features
@@ -52,12 +52,13 @@ namespace Stockfish::Eval::NNUE::Features {
     Color perspective,
     ValueListInserter<IndexType> active
   ) {
-    Square oriented_ksq = orient(perspective, pos.nnue_king_square(perspective), pos);
+    const Variant* v = pos.variant();
+    Square oriented_ksq = orient(perspective, pos.nnue_king_square(perspective), v);
     Bitboard bb = pos.pieces(WHITE) | pos.pieces(BLACK);
     while (bb)
     {
       Square s = pop_lsb(bb);
-      active.push_back(make_index(perspective, s, pos.piece_on(s), oriented_ksq, pos));
+      active.push_back(make_index(perspective, s, pos.piece_on(s), oriented_ksq, v));
     }
 
     // Indices for pieces in hand
@@ -67,11 +68,37 @@ namespace Stockfish::Eval::NNUE::Features {
           {
               PieceType pt = pop_lsb(ps);
               for (int i = 0; i < pos.count_in_hand(c, pt); i++)
-                  active.push_back(make_index(perspective, i, make_piece(c, pt), oriented_ksq, pos));
+                  active.push_back(make_index(perspective, i, make_piece(c, pt), oriented_ksq, v));
           }
 
   }
 
+  // Get a list of indices for active features of a piece list
+  void HalfKAv2Variants::append_active_indices(
+    const Variant* v,
+    Color perspective,
+    Square ksq,
+    const Square* squares,
+    const Piece* pieces,
+    int numPieces,
+    const int handCount[COLOR_NB][PIECE_TYPE_NB],
+    ValueListInserter<IndexType> active
+  ) {
+    Square oriented_ksq = orient(perspective, ksq, v);
+    for (int i = 0; i < numPieces; ++i)
+      active.push_back(make_index(perspective, squares[i], pieces[i], oriented_ksq, v));
+
+    // Indices for pieces in hand
+    if (v->nnueUsePockets)
+      for (Color c : {WHITE, BLACK})
+          for (PieceSet ps = v->pieceTypes; ps;)
+          {
+              PieceType pt = pop_lsb(ps);
+              for (int i = 0; i < handCount[c][pt]; i++)
+                  active.push_back(make_index(perspective, i, make_piece(c, pt), oriented_ksq, v));
+          }
+  }
+
   // append_changed_indices() : get a list of indices for recently changed features
 
   void HalfKAv2Variants::append_changed_indices(
@@ -82,21 +109,84 @@ namespace Stockfish::Eval::NNUE::Features {
     ValueListInserter<IndexType> added,
     const Position& pos
   ) {
+    const Variant* v = pos.variant();
     const auto& dp = st->dirtyPiece;
-    Square oriented_ksq = orient(perspective, ksq, pos);
+    Square oriented_ksq = orient(perspective, ksq, v);
     for (int i = 0; i < dp.dirty_num; ++i) {
       Piece pc = dp.piece[i];
       if (dp.from[i] != SQ_NONE)
-        removed.push_back(make_index(perspective, dp.from[i], pc, oriented_ksq, pos));
+        removed.push_back(make_index(perspective, dp.from[i], pc, oriented_ksq, v));
       else if (dp.handPiece[i] != NO_PIECE)
-        removed.push_back(make_index(perspective, dp.handCount[i] - 1, dp.handPiece[i], oriented_ksq, pos));
+        removed.push_back(make_index(perspective, dp.handCount[i] - 1, dp.handPiece[i], oriented_ksq, v));
       if (dp.to[i] != SQ_NONE)
-        added.push_back(make_index(perspective, dp.to[i], pc, oriented_ksq, pos));
+        added.push_back(make_index(perspective, dp.to[i], pc, oriented_ksq, v));
       else if (dp.handPiece[i] != NO_PIECE)
-        added.push_back(make_index(perspective, dp.handCount[i] - 1, dp.handPiece[i], oriented_ksq, pos));
+        added.push_back(make_index(perspective, dp.handCount[i] - 1, dp.handPiece[i], oriented_ksq, v));
     }
   }
 
+  IndexType HalfKAv2Variants::king_bucket(const Position& pos, Color perspective) {
+    return IndexType(orient(perspective, pos.nnue_king_square(perspective), pos.variant()));
+  }
+
+  // append_changed_indices() : get a list of indices for features that
+  // changed since a cached board
+
+  void HalfKAv2Variants::append_changed_indices(
+    const Position& pos,
+    Color perspective,
+    const CachedBoard& cached,
+    ValueListInserter<IndexType> removed,
+    ValueListInserter<IndexType> added
+  ) {
+    const Variant* v = pos.variant();
+    Square oriented_ksq = orient(perspective, pos.nnue_king_square(perspective), v);
+    Bitboard occupied = pos.pieces(WHITE) | pos.pieces(BLACK);
+    Bitboard bb = occupied | cached.occupied;
+    while (bb)
+    {
+      Square s = pop_lsb(bb);
+      Piece oldPc = cached.occupied & s ? cached.board[s] : NO_PIECE;
+      Piece newPc = occupied & s ? pos.piece_on(s) : NO_PIECE;
+      if (oldPc == newPc)
+        continue;
+      if (oldPc != NO_PIECE)
+        removed.push_back(make_index(perspective, s, oldPc, oriented_ksq, v));
+      if (newPc != NO_PIECE)
+        added.push_back(make_index(perspective, s, newPc, oriented_ksq, v));
+    }
+
+    // Indices for pieces in hand
+    if (pos.nnue_use_pockets())
+      for (Color c : {WHITE, BLACK})
+          for (PieceSet ps = pos.piece_types(); ps;)
+          {
+              PieceType pt = pop_lsb(ps);
+              int oldCount = cached.handCount[c][pt];
+              int newCount = std::max(pos.count_in_hand(c, pt), 0);
+              for (int i = newCount; i < oldCount; i++)
+                  removed.push_back(make_index(perspective, i, make_piece(c, pt), oriented_ksq, v));
+              for (int i = oldCount; i < newCount; i++)
+                  added.push_back(make_index(perspective, i, make_piece(c, pt), oriented_ksq, v));
+          }
+  }
+
+  void HalfKAv2Variants::update_cached_board(const Position& pos, CachedBoard& cached) {
+    cached.occupied = pos.pieces(WHITE) | pos.pieces(BLACK);
+    for (Bitboard bb = cached.occupied; bb; )
+    {
+      Square s = pop_lsb(bb);
+      cached.board[s] = pos.piece_on(s);
+    }
+
+    for (Color c : {WHITE, BLACK})
+        for (PieceSet ps = pos.piece_types(); ps;)
+        {
+            PieceType pt = pop_lsb(ps);
+            cached.handCount[c][pt] = std::max(pos.count_in_hand(c, pt), 0);
+        }
+  }
+
   int HalfKAv2Variants::update_cost(StateInfo* st) {
     return st->dirtyPiece.dirty_num;
   }
@@ -30,6 +30,7 @@
 
 namespace Stockfish {
   struct StateInfo;
+  struct Variant;
 }
 
 namespace Stockfish::Eval::NNUE::Features {
@@ -39,13 +40,13 @@ namespace Stockfish::Eval::NNUE::Features {
   class HalfKAv2Variants {
 
     // Orient a square according to perspective (rotates by 180 for black)
-    static Square orient(Color perspective, Square s, const Position& pos);
+    static Square orient(Color perspective, Square s, const Variant* v);
 
     // Index of a feature for a given king position and another piece on some square
-    static IndexType make_index(Color perspective, Square s, Piece pc, Square ksq, const Position& pos);
+    static IndexType make_index(Color perspective, Square s, Piece pc, Square ksq, const Variant* v);
 
     // Index of a feature for a given king position and another piece in hand
-    static IndexType make_index(Color perspective, int handCount, Piece pc, Square ksq, const Position& pos);
+    static IndexType make_index(Color perspective, int handCount, Piece pc, Square ksq, const Variant* v);
 
    public:
     // Feature name
@@ -64,12 +65,41 @@ namespace Stockfish::Eval::NNUE::Features {
     // Maximum number of simultaneously active features.
     static constexpr IndexType MaxActiveDimensions = 128;
 
+    // Number of oriented king squares, the buckets of the accumulator cache
+    static constexpr IndexType KingBuckets = static_cast<IndexType>(SQUARE_NB);
+
+    // Board that a cached accumulator was computed for
+    struct CachedBoard {
+      Bitboard occupied;
+      Piece board[SQUARE_NB];
+      int handCount[COLOR_NB][PIECE_TYPE_NB];
+    };
+
+    // Bucket of the accumulator cache, all features of a perspective
+    // depend on it
+    static IndexType king_bucket(const Position& pos, Color perspective);
+
     // Get a list of indices for active features
     static void append_active_indices(
       const Position& pos,
       Color perspective,
       ValueListInserter<IndexType> active);
 
+    // Get a list of indices for active features of a board that is given
+    // as a piece list instead of a Position, e.g. when decoded from
+    // training data. ksq is the king square of the perspective, SQ_NONE
+    // if there is none. The hand counts are only used if the variant
+    // uses pockets.
+    static void append_active_indices(
+      const Variant* v,
+      Color perspective,
+      Square ksq,
+      const Square* squares,
+      const Piece* pieces,
+      int numPieces,
+      const int handCount[COLOR_NB][PIECE_TYPE_NB],
+      ValueListInserter<IndexType> active);
+
     // Get a list of indices for recently changed features
     static void append_changed_indices(
       Square ksq,
@@ -79,6 +109,18 @@ namespace Stockfish::Eval::NNUE::Features {
       ValueListInserter<IndexType> added,
       const Position& pos);
 
+    // Get a list of indices for the features that differ between a cached
+    // board of the same king bucket and the position
+    static void append_changed_indices(
+      const Position& pos,
+      Color perspective,
+      const CachedBoard& cached,
+      ValueListInserter<IndexType> removed,
+      ValueListInserter<IndexType> added);
+
+    // Store the board of the position
+    static void update_cached_board(const Position& pos, CachedBoard& cached);
+
     // Returns the cost of updating one perspective, the most costly one.
     // Assumes no refresh needed.
     static int update_cost(StateInfo* st);
@@ -55,6 +55,12 @@ namespace Stockfish::Eval::NNUE::Layers {
     static constexpr std::size_t BufferSize =
         PreviousLayer::BufferSize + SelfBufferSize;
 
+    // Distance between the outputs of consecutive positions in propagate_batch()
+    static constexpr IndexType OutputStride = SelfBufferSize / sizeof(OutputType);
+
+    // Number of positions propagate_batch() processes together
+    static constexpr IndexType BatchTileSize = 4;
+
     // Hash value embedded in the evaluation file
     static constexpr std::uint32_t get_hash_value() {
       std::uint32_t hashValue = 0xCC03DAE4u;
@@ -114,6 +120,36 @@ namespace Stockfish::Eval::NNUE::Layers {
         const TransformedFeatureType* transformedFeatures, char* buffer) const {
       const auto input = previousLayer.propagate(
           transformedFeatures, buffer + SelfBufferSize);
+      const auto output = reinterpret_cast<OutputType*>(buffer);
+
+      forward(input, output, 1);
+
+      return output;
+    }
+
+    // Forward propagation of count positions, which needs count times
+    // BufferSize bytes of buffer. Each column of weights is used for
+    // several positions while it is in the cache.
+    const OutputType* propagate_batch(
+        const TransformedFeatureType* transformedFeatures, IndexType count, char* buffer) const {
+      const auto input = previousLayer.propagate_batch(
+          transformedFeatures, count, buffer + SelfBufferSize * count);
+      const auto output = reinterpret_cast<OutputType*>(buffer);
+
+      forward(input, output, count);
+
+      return output;
+    }
+
+   protected:
+    using BiasType = OutputType;
+    using WeightType = std::int8_t;
+
+    // Computes the outputs of count positions, whose inputs are
+    // PreviousLayer::OutputStride apart.
+    void forward(const InputType* inputs, OutputType* outputs, IndexType count) const {
+
+      constexpr IndexType InputStride = PreviousLayer::OutputStride;
 
 #if defined (USE_AVX512)
 
@@ -254,9 +290,6 @@ namespace Stockfish::Eval::NNUE::Layers {
       // Different layout, we process 4 inputs at a time, always.
       static_assert(InputDimensions % 4 == 0);
 
-      const auto output = reinterpret_cast<OutputType*>(buffer);
-      const auto inputVector = reinterpret_cast<const vec_t*>(input);
-
       static_assert(OutputDimensions % OutputSimdWidth == 0 || OutputDimensions == 1);
 
       // OutputDimensions is either 1 or a multiple of SimdWidth
@@ -264,60 +297,97 @@ namespace Stockfish::Eval::NNUE::Layers {
       if constexpr (OutputDimensions % OutputSimdWidth == 0)
       {
           constexpr IndexType NumChunks = InputDimensions / 4;
+          constexpr IndexType NumOutputRegs = OutputDimensions / OutputSimdWidth;
 
-          const auto input32 = reinterpret_cast<const std::int32_t*>(input);
-          vec_t* outptr = reinterpret_cast<vec_t*>(output);
-          std::memcpy(output, biases, OutputDimensions * sizeof(OutputType));
+          const auto biasVector = reinterpret_cast<const vec_t*>(biases);
 
-          for (int i = 0; i < (int)NumChunks - 3; i += 4)
-          {
-              const vec_t in0 = vec_set_32(input32[i + 0]);
-              const vec_t in1 = vec_set_32(input32[i + 1]);
-              const vec_t in2 = vec_set_32(input32[i + 2]);
-              const vec_t in3 = vec_set_32(input32[i + 3]);
-              const auto col0 = reinterpret_cast<const vec_t*>(&weights[(i + 0) * OutputDimensions * 4]);
-              const auto col1 = reinterpret_cast<const vec_t*>(&weights[(i + 1) * OutputDimensions * 4]);
-              const auto col2 = reinterpret_cast<const vec_t*>(&weights[(i + 2) * OutputDimensions * 4]);
-              const auto col3 = reinterpret_cast<const vec_t*>(&weights[(i + 3) * OutputDimensions * 4]);
-              for (int j = 0; j * OutputSimdWidth < OutputDimensions; ++j)
-                  vec_add_dpbusd_32x4(outptr[j], in0, col0[j], in1, col1[j], in2, col2[j], in3, col3[j]);
-          }
+          // Computes TileSize positions with one pass over the weights
+          auto forward_tile = [&](auto tileSizeTag, IndexType first) {
+              constexpr IndexType TileSize = decltype(tileSizeTag)::value;
+
+              const std::int32_t* input32[TileSize];
+              for (IndexType t = 0; t < TileSize; ++t)
+                  input32[t] = reinterpret_cast<const std::int32_t*>(inputs + (first + t) * InputStride);
+
+              vec_t acc[TileSize][NumOutputRegs];
+              for (IndexType t = 0; t < TileSize; ++t)
+                  for (IndexType j = 0; j < NumOutputRegs; ++j)
+                      acc[t][j] = biasVector[j];
+
+              for (int i = 0; i < (int)NumChunks - 3; i += 4)
+              {
+                  const auto col0 = reinterpret_cast<const vec_t*>(&weights[(i + 0) * OutputDimensions * 4]);
+                  const auto col1 = reinterpret_cast<const vec_t*>(&weights[(i + 1) * OutputDimensions * 4]);
+                  const auto col2 = reinterpret_cast<const vec_t*>(&weights[(i + 2) * OutputDimensions * 4]);
+                  const auto col3 = reinterpret_cast<const vec_t*>(&weights[(i + 3) * OutputDimensions * 4]);
+                  for (IndexType t = 0; t < TileSize; ++t)
+                  {
+                      const vec_t in0 = vec_set_32(input32[t][i + 0]);
+                      const vec_t in1 = vec_set_32(input32[t][i + 1]);
+                      const vec_t in2 = vec_set_32(input32[t][i + 2]);
+                      const vec_t in3 = vec_set_32(input32[t][i + 3]);
+                      for (IndexType j = 0; j < NumOutputRegs; ++j)
+                          vec_add_dpbusd_32x4(acc[t][j], in0, col0[j], in1, col1[j], in2, col2[j], in3, col3[j]);
+                  }
+              }
+
+              for (IndexType t = 0; t < TileSize; ++t)
+              {
+                  vec_t* outptr = reinterpret_cast<vec_t*>(outputs + (first + t) * OutputStride);
+                  for (IndexType j = 0; j < NumOutputRegs; ++j)
+                      outptr[j] = acc[t][j];
+              }
+          };
+
+          // Full tiles, then the remaining positions one by one
+          IndexType first = 0;
+          for ( ; first + BatchTileSize <= count; first += BatchTileSize)
+              forward_tile(std::integral_constant<IndexType, BatchTileSize>{}, first);
+          for ( ; first < count; ++first)
+              forward_tile(std::integral_constant<IndexType, 1>{}, first);
       }
       else if constexpr (OutputDimensions == 1)
       {
-#if defined (USE_AVX512)
-          if constexpr (PaddedInputDimensions % (SimdWidth * 2) != 0)
+          for (IndexType p = 0; p < count; ++p)
           {
-              constexpr IndexType NumChunks = PaddedInputDimensions / SimdWidth;
-              const auto inputVector256 = reinterpret_cast<const __m256i*>(input);
-
-              __m256i sum0 = _mm256_setzero_si256();
-              const auto row0 = reinterpret_cast<const __m256i*>(&weights[0]);
+              const auto input = inputs + p * InputStride;
+              const auto output = outputs + p * OutputStride;
+              const auto inputVector = reinterpret_cast<const vec_t*>(input);
 
-              for (int j = 0; j < (int)NumChunks; ++j)
+#if defined (USE_AVX512)
+              if constexpr (PaddedInputDimensions % (SimdWidth * 2) != 0)
               {
-                  const __m256i in = inputVector256[j];
-                  m256_add_dpbusd_epi32(sum0, in, row0[j]);
+                  constexpr IndexType NumChunks = PaddedInputDimensions / SimdWidth;
+                  const auto inputVector256 = reinterpret_cast<const __m256i*>(input);
+
+                  __m256i sum0 = _mm256_setzero_si256();
+                  const auto row0 = reinterpret_cast<const __m256i*>(&weights[0]);
+
+                  for (int j = 0; j < (int)NumChunks; ++j)
+                  {
+                      const __m256i in = inputVector256[j];
+                      m256_add_dpbusd_epi32(sum0, in, row0[j]);
+                  }
+                  output[0] = m256_hadd(sum0, biases[0]);
               }
-              output[0] = m256_hadd(sum0, biases[0]);
-          }
-          else
+              else
 #endif
-          {
+              {
 #if defined (USE_AVX512)
-              constexpr IndexType NumChunks = PaddedInputDimensions / (SimdWidth * 2);
+                  constexpr IndexType NumChunks = PaddedInputDimensions / (SimdWidth * 2);
 #else
-              constexpr IndexType NumChunks = PaddedInputDimensions / SimdWidth;
+                  constexpr IndexType NumChunks = PaddedInputDimensions / SimdWidth;
 #endif
-              vec_t sum0 = vec_setzero();
-              const auto row0 = reinterpret_cast<const vec_t*>(&weights[0]);
-
-              for (int j = 0; j < (int)NumChunks; ++j)
-              {
-                  const vec_t in = inputVector[j];
-                  vec_add_dpbusd_32(sum0, in, row0[j]);
+                  vec_t sum0 = vec_setzero();
+                  const auto row0 = reinterpret_cast<const vec_t*>(&weights[0]);
+
+                  for (int j = 0; j < (int)NumChunks; ++j)
+                  {
+                      const vec_t in = inputVector[j];
+                      vec_add_dpbusd_32(sum0, in, row0[j]);
+                  }
+                  output[0] = vec_hadd(sum0, biases[0]);
               }
-              output[0] = vec_hadd(sum0, biases[0]);
           }
       }
 
@@ -325,105 +395,107 @@ namespace Stockfish::Eval::NNUE::Layers {
 
 // Use old implementation for the other architectures.
 
-      auto output = reinterpret_cast<OutputType*>(buffer);
-
 #if defined(USE_SSE2)
       // At least a multiple of 16, with SSE2.
       static_assert(InputDimensions % SimdWidth == 0);
       constexpr IndexType NumChunks = InputDimensions / SimdWidth;
       const __m128i Zeros = _mm_setzero_si128();
-      const auto inputVector = reinterpret_cast<const __m128i*>(input);
 
 #elif defined(USE_MMX)
       static_assert(InputDimensions % SimdWidth == 0);
       constexpr IndexType NumChunks = InputDimensions / SimdWidth;
       const __m64 Zeros = _mm_setzero_si64();
-      const auto inputVector = reinterpret_cast<const __m64*>(input);
 
 #elif defined(USE_NEON)
       static_assert(InputDimensions % SimdWidth == 0);
       constexpr IndexType NumChunks = InputDimensions / SimdWidth;
-      const auto inputVector = reinterpret_cast<const int8x8_t*>(input);
 #endif
 
-      for (IndexType i = 0; i < OutputDimensions; ++i) {
-        const IndexType offset = i * PaddedInputDimensions;
+      for (IndexType p = 0; p < count; ++p) {
+        const auto input = inputs + p * InputStride;
+        const auto output = outputs + p * OutputStride;
 
 #if defined(USE_SSE2)
-        __m128i sumLo = _mm_cvtsi32_si128(biases[i]);
-        __m128i sumHi = Zeros;
-        const auto row = reinterpret_cast<const __m128i*>(&weights[offset]);
-        for (IndexType j = 0; j < NumChunks; ++j) {
-          __m128i row_j = _mm_load_si128(&row[j]);
-          __m128i input_j = _mm_load_si128(&inputVector[j]);
-          __m128i extendedRowLo = _mm_srai_epi16(_mm_unpacklo_epi8(row_j, row_j), 8);
-          __m128i extendedRowHi = _mm_srai_epi16(_mm_unpackhi_epi8(row_j, row_j), 8);
-          __m128i extendedInputLo = _mm_unpacklo_epi8(input_j, Zeros);
-          __m128i extendedInputHi = _mm_unpackhi_epi8(input_j, Zeros);
-          __m128i productLo = _mm_madd_epi16(extendedRowLo, extendedInputLo);
-          __m128i productHi = _mm_madd_epi16(extendedRowHi, extendedInputHi);
-          sumLo = _mm_add_epi32(sumLo, productLo);
-          sumHi = _mm_add_epi32(sumHi, productHi);
-        }
-        __m128i sum = _mm_add_epi32(sumLo, sumHi);
-        __m128i sumHigh_64 = _mm_shuffle_epi32(sum, _MM_SHUFFLE(1, 0, 3, 2));
-        sum = _mm_add_epi32(sum, sumHigh_64);
-        __m128i sum_second_32 = _mm_shufflelo_epi16(sum, _MM_SHUFFLE(1, 0, 3, 2));
-        sum = _mm_add_epi32(sum, sum_second_32);
-        output[i] = _mm_cvtsi128_si32(sum);
+        const auto inputVector = reinterpret_cast<const __m128i*>(input);
+#elif defined(USE_MMX)
+        const auto inputVector = reinterpret_cast<const __m64*>(input);
+#elif defined(USE_NEON)
+        const auto inputVector = reinterpret_cast<const int8x8_t*>(input);
+#endif
+
+        for (IndexType i = 0; i < OutputDimensions; ++i) {
+          const IndexType offset = i * PaddedInputDimensions;
+
+#if defined(USE_SSE2)
+          __m128i sumLo = _mm_cvtsi32_si128(biases[i]);
+          __m128i sumHi = Zeros;
+          const auto row = reinterpret_cast<const __m128i*>(&weights[offset]);
+          for (IndexType j = 0; j < NumChunks; ++j) {
+            __m128i row_j = _mm_load_si128(&row[j]);
+            __m128i input_j = _mm_load_si128(&inputVector[j]);
+            __m128i extendedRowLo = _mm_srai_epi16(_mm_unpacklo_epi8(row_j, row_j), 8);
+            __m128i extendedRowHi = _mm_srai_epi16(_mm_unpackhi_epi8(row_j, row_j), 8);
+            __m128i extendedInputLo = _mm_unpacklo_epi8(input_j, Zeros);
+            __m128i extendedInputHi = _mm_unpackhi_epi8(input_j, Zeros);
+            __m128i productLo = _mm_madd_epi16(extendedRowLo, extendedInputLo);
+            __m128i productHi = _mm_madd_epi16(extendedRowHi, extendedInputHi);
+            sumLo = _mm_add_epi32(sumLo, productLo);
+            sumHi = _mm_add_epi32(sumHi, productHi);
+          }
+          __m128i sum = _mm_add_epi32(sumLo, sumHi);
+          __m128i sumHigh_64 = _mm_shuffle_epi32(sum, _MM_SHUFFLE(1, 0, 3, 2));
+          sum = _mm_add_epi32(sum, sumHigh_64);
+          __m128i sum_second_32 = _mm_shufflelo_epi16(sum, _MM_SHUFFLE(1, 0, 3, 2));
+          sum = _mm_add_epi32(sum, sum_second_32);
+          output[i] = _mm_cvtsi128_si32(sum);
 
 #elif defined(USE_MMX)
-        __m64 sumLo = _mm_cvtsi32_si64(biases[i]);
-        __m64 sumHi = Zeros;
-        const auto row = reinterpret_cast<const __m64*>(&weights[offset]);
-        for (IndexType j = 0; j < NumChunks; ++j) {
-          __m64 row_j = row[j];
-          __m64 input_j = inputVector[j];
-          __m64 extendedRowLo = _mm_srai_pi16(_mm_unpacklo_pi8(row_j, row_j), 8);
-          __m64 extendedRowHi = _mm_srai_pi16(_mm_unpackhi_pi8(row_j, row_j), 8);
-          __m64 extendedInputLo = _mm_unpacklo_pi8(input_j, Zeros);
-          __m64 extendedInputHi = _mm_unpackhi_pi8(input_j, Zeros);
-          __m64 productLo = _mm_madd_pi16(extendedRowLo, extendedInputLo);
-          __m64 productHi = _mm_madd_pi16(extendedRowHi, extendedInputHi);
-          sumLo = _mm_add_pi32(sumLo, productLo);
-          sumHi = _mm_add_pi32(sumHi, productHi);
-        }
-        __m64 sum = _mm_add_pi32(sumLo, sumHi);
-        sum = _mm_add_pi32(sum, _mm_unpackhi_pi32(sum, sum));
-        output[i] = _mm_cvtsi64_si32(sum);
+          __m64 sumLo = _mm_cvtsi32_si64(biases[i]);
+          __m64 sumHi = Zeros;
+          const auto row = reinterpret_cast<const __m64*>(&weights[offset]);
+          for (IndexType j = 0; j < NumChunks; ++j) {
+            __m64 row_j = row[j];
+            __m64 input_j = inputVector[j];
+            __m64 extendedRowLo = _mm_srai_pi16(_mm_unpacklo_pi8(row_j, row_j), 8);
+            __m64 extendedRowHi = _mm_srai_pi16(_mm_unpackhi_pi8(row_j, row_j), 8);
+            __m64 extendedInputLo = _mm_unpacklo_pi8(input_j, Zeros);
+            __m64 extendedInputHi = _mm_unpackhi_pi8(input_j, Zeros);
+            __m64 productLo = _mm_madd_pi16(extendedRowLo, extendedInputLo);
+            __m64 productHi = _mm_madd_pi16(extendedRowHi, extendedInputHi);
+            sumLo = _mm_add_pi32(sumLo, productLo);
+            sumHi = _mm_add_pi32(sumHi, productHi);
+          }
+          __m64 sum = _mm_add_pi32(sumLo, sumHi);
+          sum = _mm_add_pi32(sum, _mm_unpackhi_pi32(sum, sum));
+          output[i] = _mm_cvtsi64_si32(sum);
 
 #elif defined(USE_NEON)
-        int32x4_t sum = {biases[i]};
-        const auto row = reinterpret_cast<const int8x8_t*>(&weights[offset]);
-        for (IndexType j = 0; j < NumChunks; ++j) {
-          int16x8_t product = vmull_s8(inputVector[j * 2], row[j * 2]);
-          product = vmlal_s8(product, inputVector[j * 2 + 1], row[j * 2 + 1]);
-          sum = vpadalq_s16(sum, product);
-        }
-        output[i] = sum[0] + sum[1] + sum[2] + sum[3];
+          int32x4_t sum = {biases[i]};
+          const auto row = reinterpret_cast<const int8x8_t*>(&weights[offset]);
+          for (IndexType j = 0; j < NumChunks; ++j) {
+            int16x8_t product = vmull_s8(inputVector[j * 2], row[j * 2]);
+            product = vmlal_s8(product, inputVector[j * 2 + 1], row[j * 2 + 1]);
+            sum = vpadalq_s16(sum, product);
+          }
+          output[i] = sum[0] + sum[1] + sum[2] + sum[3];
 
 #else
-        OutputType sum = biases[i];
-        for (IndexType j = 0; j < InputDimensions; ++j) {
-          sum += weights[offset + j] * input[j];
-        }
-        output[i] = sum;
+          OutputType sum = biases[i];
+          for (IndexType j = 0; j < InputDimensions; ++j) {
+            sum += weights[offset + j] * input[j];
+          }
+          output[i] = sum;
 #endif
 
+        }
       }
 #if defined(USE_MMX)
       _mm_empty();
 #endif
 
 #endif
-
-      return output;
     }
 
-   private:
-    using BiasType = OutputType;
-    using WeightType = std::int8_t;
-
     PreviousLayer previousLayer;
 
     alignas(CacheLineSize) BiasType biases[OutputDimensions];
@@ -0,0 +1,196 @@
+/*
+  Stockfish, a UCI chess playing engine derived from Glaurung 2.1
+  Copyright (C) 2004-2022 The Stockfish developers (see AUTHORS file)
+
+  Stockfish is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  Stockfish is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+// Definition of layer AffineTransformSparseInput of NNUE evaluation function
+
+#ifndef NNUE_LAYERS_AFFINE_TRANSFORM_SPARSE_INPUT_H_INCLUDED
+#define NNUE_LAYERS_AFFINE_TRANSFORM_SPARSE_INPUT_H_INCLUDED
+
+#include <array>
+#include "../nnue_common.h"
+#include "../../bitboard.h"
+#include "affine_transform.h"
+
+namespace Stockfish::Eval::NNUE::Layers {
+
+#if defined (USE_SSSE3)
+  // Positions of the set bits of every byte value
+  alignas(CacheLineSize) inline const std::array<std::array<std::uint16_t, 8>, 256> NnzLookupIndices = [](){
+    std::array<std::array<std::uint16_t, 8>, 256> v{};
+    for (unsigned i = 0; i < 256; ++i)
+    {
+      unsigned k = 0;
+      for (unsigned b = 0; b < 8; ++b)
+        if (i & (1 << b))
+          v[i][k++] = b;
+    }
+    return v;
+  }();
+#endif
+
+  // Affine transformation layer for inputs that are mostly zero, like the
+  // clipped output of the feature transformer. Only the weight columns of
+  // the non-zero blocks of 4 inputs are accumulated. The parameters and
+  // their layout in memory are those of AffineTransform, so both layers
+  // read the same networks. Without SSSE3 all inputs are used.
+  template <typename PreviousLayer, IndexType OutDims>
+  class AffineTransformSparseInput : public AffineTransform<PreviousLayer, OutDims> {
+
+    using Base = AffineTransform<PreviousLayer, OutDims>;
+
+   public:
+    using InputType = typename Base::InputType;
+    using OutputType = typename Base::OutputType;
+
+    static constexpr IndexType InputDimensions = Base::InputDimensions;
+    static constexpr IndexType OutputDimensions = Base::OutputDimensions;
+    static constexpr std::size_t SelfBufferSize = Base::SelfBufferSize;
+    static constexpr IndexType OutputStride = Base::OutputStride;
+
+#if defined (USE_SSSE3)
+    // Forward propagation
+    const OutputType* propagate(
+        const TransformedFeatureType* transformedFeatures, char* buffer) const {
+      const auto input = this->previousLayer.propagate(
+          transformedFeatures, buffer + SelfBufferSize);
+      const auto output = reinterpret_cast<OutputType*>(buffer);
+
+      forward_sparse(input, output);
+
+      return output;
+    }
+
+    // Forward propagation of count positions, see AffineTransform. The
+    // non-zero inputs differ between the positions, so they are
+    // processed one by one.
+    const OutputType* propagate_batch(
+        const TransformedFeatureType* transformedFeatures, IndexType count, char* buffer) const {
+      const auto input = this->previousLayer.propagate_batch(
+          transformedFeatures, count, buffer + SelfBufferSize * count);
+      const auto output = reinterpret_cast<OutputType*>(buffer);
+
+      for (IndexType p = 0; p < count; ++p)
+        forward_sparse(input + p * PreviousLayer::OutputStride, output + p * OutputStride);
+
+      return output;
+    }
+
+   private:
+    void forward_sparse(const InputType* input, OutputType* output) const {
+
+#if defined (USE_AVX512)
+      using vec_t = __m512i;
+      auto set_32 = [](std::int32_t a) { return _mm512_set1_epi32(a); };
+      auto nnz_mask = [](vec_t a) {
+        return unsigned(_mm512_cmpgt_epi32_mask(a, _mm512_setzero_si512()));
+      };
+      auto add_dpbusd_32 = [](vec_t& acc, vec_t a, vec_t b) {
+#if defined (USE_VNNI)
+        acc = _mm512_dpbusd_epi32(acc, a, b);
+#else
+        acc = _mm512_add_epi32(acc, _mm512_madd_epi16(_mm512_maddubs_epi16(a, b), _mm512_set1_epi16(1)));
+#endif
+      };
+#elif defined (USE_AVX2)
+      using vec_t = __m256i;
+      auto set_32 = [](std::int32_t a) { return _mm256_set1_epi32(a); };
+      auto nnz_mask = [](vec_t a) {
+        return unsigned(_mm256_movemask_ps(_mm256_castsi256_ps(_mm256_cmpgt_epi32(a, _mm256_setzero_si256()))));
+      };
+      auto add_dpbusd_32 = [](vec_t& acc, vec_t a, vec_t b) {
+#if defined (USE_VNNI)
+        acc = _mm256_dpbusd_epi32(acc, a, b);
+#else
+        acc = _mm256_add_epi32(acc, _mm256_madd_epi16(_mm256_maddubs_epi16(a, b), _mm256_set1_epi16(1)));
+#endif
+      };
+#else
+      using vec_t = __m128i;
+      auto set_32 = [](std::int32_t a) { return _mm_set1_epi32(a); };
+      auto nnz_mask = [](vec_t a) {
+        return unsigned(_mm_movemask_ps(_mm_castsi128_ps(_mm_cmpgt_epi32(a, _mm_setzero_si128()))));
+      };
+      auto add_dpbusd_32 = [](vec_t& acc, vec_t a, vec_t b) {
+        acc = _mm_add_epi32(acc, _mm_madd_epi16(_mm_maddubs_epi16(a, b), _mm_set1_epi16(1)));
+      };
+#endif
+
+      // The inputs are clipped to [0, 127], so a block of 4 of them read
+      // as an int32 is non-zero if and only if it is positive.
+      constexpr IndexType NumBlocks = InputDimensions / 4;
+      constexpr IndexType BlocksPerVector = sizeof(vec_t) / sizeof(std::int32_t);
+      constexpr IndexType BlocksPerChunk = std::max<IndexType>(BlocksPerVector, 8);
+      constexpr IndexType VectorsPerChunk = BlocksPerChunk / BlocksPerVector;
+      constexpr IndexType BytesPerChunk = BlocksPerChunk / 8;
+      constexpr IndexType OutputsPerVector = sizeof(vec_t) / sizeof(OutputType);
+      constexpr IndexType NumOutputRegs = OutputDimensions / OutputsPerVector;
+      static_assert(NumBlocks % BlocksPerChunk == 0);
+      static_assert(OutputDimensions % OutputsPerVector == 0);
+
+      // List the indices of the non-zero blocks. Every store writes 8
+      // indices, of which only as many as there are non-zero blocks are
+      // kept, so the list never needs more than NumBlocks entries.
+      alignas(CacheLineSize) std::uint16_t nnz[NumBlocks];
+      IndexType count = 0;
+
+      const auto inputVector = reinterpret_cast<const vec_t*>(input);
+      __m128i base = _mm_setzero_si128();
+      const __m128i increment = _mm_set1_epi16(8);
+      for (IndexType i = 0; i < NumBlocks / BlocksPerChunk; ++i)
+      {
+          unsigned mask = 0;
+          for (IndexType j = 0; j < VectorsPerChunk; ++j)
+              mask |= nnz_mask(inputVector[i * VectorsPerChunk + j]) << (j * BlocksPerVector);
+
+          for (IndexType j = 0; j < BytesPerChunk; ++j)
+          {
+              const unsigned lookup = (mask >> (j * 8)) & 0xFF;
+              const __m128i offsets = _mm_load_si128(reinterpret_cast<const __m128i*>(&NnzLookupIndices[lookup]));
+              _mm_storeu_si128(reinterpret_cast<__m128i*>(nnz + count), _mm_add_epi16(base, offsets));
+              count += popcount(Bitboard(lookup));
+              base = _mm_add_epi16(base, increment);
+          }
+      }
+
+      // Accumulate the weight columns of the non-zero blocks, which are
+      // OutputDimensions * 4 bytes each in the layout of AffineTransform.
+      const auto input32 = reinterpret_cast<const std::int32_t*>(input);
+      const auto biasVector = reinterpret_cast<const vec_t*>(this->biases);
+      vec_t acc[NumOutputRegs];
+      for (IndexType k = 0; k < NumOutputRegs; ++k)
+          acc[k] = biasVector[k];
+
+      for (IndexType j = 0; j < count; ++j)
+      {
+          const IndexType i = nnz[j];
+          const vec_t in = set_32(input32[i]);
+          const auto col = reinterpret_cast<const vec_t*>(&this->weights[i * OutputDimensions * 4]);
+          for (IndexType k = 0; k < NumOutputRegs; ++k)
+              add_dpbusd_32(acc[k], in, col[k]);
+      }
+
+      const auto outputVector = reinterpret_cast<vec_t*>(output);
+      for (IndexType k = 0; k < NumOutputRegs; ++k)
+          outputVector[k] = acc[k];
+    }
+#endif
+  };
+
+}  // namespace Stockfish::Eval::NNUE::Layers
+
+#endif // #ifndef NNUE_LAYERS_AFFINE_TRANSFORM_SPARSE_INPUT_H_INCLUDED
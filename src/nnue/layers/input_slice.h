@@ -41,6 +41,10 @@ class InputSlice {
   // Size of forward propagation buffer used from the input layer to this layer
   static constexpr std::size_t BufferSize = 0;
 
+  // Distance between the transformed features of consecutive positions
+  // passed to propagate_batch()
+  static constexpr IndexType OutputStride = OutDims + Offset;
+
   // Hash value embedded in the evaluation file
   static constexpr std::uint32_t get_hash_value() {
     std::uint32_t hashValue = 0xEC42E90Du;
@@ -64,6 +68,13 @@ class InputSlice {
     return transformedFeatures + Offset;
   }
 
+  // Forward propagation of count positions
+  const OutputType* propagate_batch(
+      const TransformedFeatureType* transformedFeatures,
+      IndexType /*count*/, char* /*buffer*/) const {
+    return transformedFeatures + Offset;
+  }
+
  private:
 };
 
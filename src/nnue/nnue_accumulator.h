@@ -32,6 +32,25 @@ namespace Stockfish::Eval::NNUE {
     bool computed[2];
   };
 
+  // Accumulators of the last refresh for each king bucket and perspective,
+  // with the board they were computed for. A refresh then only needs the
+  // features that changed since, which for drop variants is much less
+  // than all pieces on the board and in hand.
+  struct AccumulatorCache {
+
+    struct alignas(CacheLineSize) Entry {
+      std::int16_t accumulation[TransformedFeatureDimensions];
+      std::int32_t psqtAccumulation[PSQTBuckets];
+      FeatureSet::CachedBoard board;
+
+      // Parameters and variant the entry was computed with, 0 if unused
+      std::uint32_t generation = 0;
+      const Variant* variant = nullptr;
+    };
+
+    Entry entries[FeatureSet::KingBuckets][COLOR_NB];
+  };
+
 }  // namespace Stockfish::Eval::NNUE
 
 #endif // NNUE_ACCUMULATOR_H_INCLUDED
@@ -27,6 +27,7 @@
 
 #include "layers/input_slice.h"
 #include "layers/affine_transform.h"
+#include "layers/affine_transform_sparse_input.h"
 #include "layers/clipped_relu.h"
 
 namespace Stockfish::Eval::NNUE {
@@ -41,9 +42,22 @@ namespace Stockfish::Eval::NNUE {
 
   namespace Layers {
 
+    // Layer type of the first affine transform. AffineTransformSparseInput
+    // skips the zero blocks of its input, the clipped output of the feature
+    // transformer. That only pays off for nets where most of it is zero, and
+    // is slower for dense ones, so it is enabled with sparseinput=yes. Both
+    // read the same networks.
+#if defined(NNUE_SPARSE_INPUT)
+    template <typename PreviousLayer, IndexType OutDims>
+    using FirstAffineTransform = AffineTransformSparseInput<PreviousLayer, OutDims>;
+#else
+    template <typename PreviousLayer, IndexType OutDims>
+    using FirstAffineTransform = AffineTransform<PreviousLayer, OutDims>;
+#endif
+
     // Define network structure
     using InputLayer = InputSlice<TransformedFeatureDimensions * 2>;
-    using HiddenLayer1 = ClippedReLU<AffineTransform<InputLayer, 16>>;
+    using HiddenLayer1 = ClippedReLU<FirstAffineTransform<InputLayer, 16>>;
     using HiddenLayer2 = ClippedReLU<AffineTransform<HiddenLayer1, 32>>;
     using OutputLayer = AffineTransform<HiddenLayer2, 1>;
 
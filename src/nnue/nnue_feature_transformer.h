@@ -26,6 +26,7 @@
 
 #include "../misc.h"
 #include "../position.h"
+#include "../thread.h"
 
 #include <cstring> // std::memset()
 
@@ -184,8 +185,8 @@ namespace Stockfish::Eval::NNUE {
     // Output type
     using OutputType = TransformedFeatureType;
 
-    // Number of input/output dimensions
-    static constexpr IndexType InputDimensions = FeatureSet::Dimensions;
+    // Number of output dimensions, the number of input dimensions
+    // depends on the variant of the loaded network
     static constexpr IndexType OutputDimensions = HalfDimensions * 2;
 
     // Size of forward propagation buffer
@@ -197,12 +198,23 @@ namespace Stockfish::Eval::NNUE {
       return FeatureSet::HashValue ^ OutputDimensions;
     }
 
+    ~FeatureTransformer() {
+      aligned_large_pages_free(ownedWeights);
+      aligned_large_pages_free(ownedPsqtWeights);
+    }
+
     // Read network parameters
     bool read_parameters(std::istream& stream) {
 
+      if (!allocate(FeatureSet::get_dimensions()))
+        return false;
+
       read_little_endian<BiasType      >(stream, biases     , HalfDimensions                  );
-      read_little_endian<WeightType    >(stream, weights    , HalfDimensions * FeatureSet::get_dimensions());
-      read_little_endian<PSQTWeightType>(stream, psqtWeights, PSQTBuckets    * FeatureSet::get_dimensions());
+      read_little_endian<WeightType    >(stream, ownedWeights    , HalfDimensions * inputDimensions);
+      read_little_endian<PSQTWeightType>(stream, ownedPsqtWeights, PSQTBuckets    * inputDimensions);
+
+      // Accumulators cached for the old parameters are no longer valid
+      generation = ++generations;
 
       return !stream.fail();
     }
@@ -211,12 +223,58 @@ namespace Stockfish::Eval::NNUE {
     bool write_parameters(std::ostream& stream) const {
 
       write_little_endian<BiasType      >(stream, biases     , HalfDimensions                  );
-      write_little_endian<WeightType    >(stream, weights    , HalfDimensions * FeatureSet::get_dimensions());
-      write_little_endian<PSQTWeightType>(stream, psqtWeights, PSQTBuckets    * FeatureSet::get_dimensions());
+      write_little_endian<WeightType    >(stream, weights    , HalfDimensions * inputDimensions);
+      write_little_endian<PSQTWeightType>(stream, psqtWeights, PSQTBuckets    * inputDimensions);
 
       return !stream.fail();
     }
 
+    // Read the biases of a network whose weights are mapped from a file,
+    // see save_mapped_eval(). The mapping must outlive the transformer.
+    bool read_mapped_parameters(std::istream& stream,
+                                const WeightType* mappedWeights,
+                                const PSQTWeightType* mappedPsqtWeights,
+                                IndexType dimensions) {
+
+      aligned_large_pages_free(ownedWeights);
+      aligned_large_pages_free(ownedPsqtWeights);
+      ownedWeights = nullptr;
+      ownedPsqtWeights = nullptr;
+
+      weights = mappedWeights;
+      psqtWeights = mappedPsqtWeights;
+      inputDimensions = dimensions;
+
+      read_little_endian<BiasType>(stream, biases, HalfDimensions);
+
+      generation = ++generations;
+
+      return !stream.fail();
+    }
+
+    // Write the biases, the weights are written separately to a mapped file
+    bool write_mapped_parameters(std::ostream& stream) const {
+
+      write_little_endian<BiasType>(stream, biases, HalfDimensions);
+
+      return !stream.fail();
+    }
+
+    IndexType get_input_dimensions() const { return inputDimensions; }
+    const WeightType* get_weights() const { return weights; }
+    const PSQTWeightType* get_psqt_weights() const { return psqtWeights; }
+
+    // Psqt value of a bucket for the side to move. The accumulator must be
+    // up to date, e.g. after a call of transform(), whose output is the same
+    // for every bucket.
+    std::int32_t psqt_value(const Position& pos, int bucket) const {
+      const auto& psqtAccumulation = pos.state()->accumulator.psqtAccumulation;
+      return (
+            psqtAccumulation[pos.side_to_move()][bucket]
+          - psqtAccumulation[~pos.side_to_move()][bucket]
+        ) / 2;
+    }
+
     // Convert input features
     std::int32_t transform(const Position& pos, OutputType* output, int bucket) const {
       update_accumulator(pos, WHITE);
@@ -224,12 +282,8 @@ namespace Stockfish::Eval::NNUE {
 
       const Color perspectives[2] = {pos.side_to_move(), ~pos.side_to_move()};
       const auto& accumulation = pos.state()->accumulator.accumulation;
-      const auto& psqtAccumulation = pos.state()->accumulator.psqtAccumulation;
 
-      const auto psqt = (
-            psqtAccumulation[perspectives[0]][bucket]
-          - psqtAccumulation[perspectives[1]][bucket]
-        ) / 2;
+      const auto psqt = psqt_value(pos, bucket);
 
 
   #if defined(USE_AVX512)
@@ -367,6 +421,29 @@ namespace Stockfish::Eval::NNUE {
 
 
    private:
+    // Allocate the weights for the number of input features of the
+    // variant, instead of the largest number any variant could need
+    bool allocate(IndexType dimensions) {
+
+      assert(dimensions <= FeatureSet::Dimensions);
+
+      if (dimensions == inputDimensions && ownedWeights)
+        return true;
+
+      aligned_large_pages_free(ownedWeights);
+      aligned_large_pages_free(ownedPsqtWeights);
+
+      ownedWeights = static_cast<WeightType*>(
+        aligned_large_pages_alloc(sizeof(WeightType) * HalfDimensions * dimensions));
+      ownedPsqtWeights = static_cast<PSQTWeightType*>(
+        aligned_large_pages_alloc(sizeof(PSQTWeightType) * PSQTBuckets * dimensions));
+      weights = ownedWeights;
+      psqtWeights = ownedPsqtWeights;
+      inputDimensions = dimensions;
+
+      return ownedWeights && ownedPsqtWeights;
+    }
+
     void update_accumulator(const Position& pos, const Color perspective) const {
 
       // The size must be enough to contain the largest possible update.
@@ -534,21 +611,49 @@ namespace Stockfish::Eval::NNUE {
       }
       else
       {
-        // Refresh the accumulator
+        // Refresh the accumulator. With a thread, start from the cached
+        // accumulator of the king bucket if that needs fewer features.
         auto& accumulator = pos.state()->accumulator;
         accumulator.computed[perspective] = true;
-        IndexList active;
-        FeatureSet::append_active_indices(pos, perspective, active);
+        IndexList removed, added;
+
+        Thread* thread = pos.this_thread();
+        AccumulatorCache::Entry* entry = thread ? &thread->accumulatorCache.entries
+                                                   [FeatureSet::king_bucket(pos, perspective)][perspective]
+                                                : nullptr;
+        bool fromCache = entry && entry->generation == generation && entry->variant == pos.variant();
+        if (fromCache)
+        {
+          FeatureSet::append_changed_indices(pos, perspective, entry->board, removed, added);
+          fromCache = int(removed.size() + added.size()) <= FeatureSet::refresh_cost(pos);
+        }
+        if (!fromCache)
+        {
+          removed.resize(0);
+          added.resize(0);
+          FeatureSet::append_active_indices(pos, perspective, added);
+        }
+
+        const BiasType* base = fromCache ? entry->accumulation : biases;
 
   #ifdef VECTOR
         for (IndexType j = 0; j < HalfDimensions / TileHeight; ++j)
         {
-          auto biasesTile = reinterpret_cast<const vec_t*>(
-              &biases[j * TileHeight]);
+          auto baseTile = reinterpret_cast<const vec_t*>(
+              &base[j * TileHeight]);
           for (IndexType k = 0; k < NumRegs; ++k)
-            acc[k] = biasesTile[k];
+            acc[k] = baseTile[k];
 
-          for (const auto index : active)
+          for (const auto index : removed)
+          {
+            const IndexType offset = HalfDimensions * index + j * TileHeight;
+            auto column = reinterpret_cast<const vec_t*>(&weights[offset]);
+
+            for (unsigned k = 0; k < NumRegs; ++k)
+              acc[k] = vec_sub_16(acc[k], column[k]);
+          }
+
+          for (const auto index : added)
           {
             const IndexType offset = HalfDimensions * index + j * TileHeight;
             auto column = reinterpret_cast<const vec_t*>(&weights[offset]);
@@ -561,14 +666,38 @@ namespace Stockfish::Eval::NNUE {
               &accumulator.accumulation[perspective][j * TileHeight]);
           for (unsigned k = 0; k < NumRegs; k++)
             vec_store(&accTile[k], acc[k]);
+
+          if (entry)
+          {
+            accTile = reinterpret_cast<vec_t*>(&entry->accumulation[j * TileHeight]);
+            for (unsigned k = 0; k < NumRegs; k++)
+              vec_store(&accTile[k], acc[k]);
+          }
         }
 
         for (IndexType j = 0; j < PSQTBuckets / PsqtTileHeight; ++j)
         {
-          for (std::size_t k = 0; k < NumPsqtRegs; ++k)
-            psqt[k] = vec_zero_psqt();
+          if (fromCache)
+          {
+            auto baseTilePsqt = reinterpret_cast<const psqt_vec_t*>(
+              &entry->psqtAccumulation[j * PsqtTileHeight]);
+            for (std::size_t k = 0; k < NumPsqtRegs; ++k)
+              psqt[k] = vec_load_psqt(&baseTilePsqt[k]);
+          }
+          else
+            for (std::size_t k = 0; k < NumPsqtRegs; ++k)
+              psqt[k] = vec_zero_psqt();
+
+          for (const auto index : removed)
+          {
+            const IndexType offset = PSQTBuckets * index + j * PsqtTileHeight;
+            auto columnPsqt = reinterpret_cast<const psqt_vec_t*>(&psqtWeights[offset]);
 
-          for (const auto index : active)
+            for (std::size_t k = 0; k < NumPsqtRegs; ++k)
+              psqt[k] = vec_sub_psqt_32(psqt[k], columnPsqt[k]);
+          }
+
+          for (const auto index : added)
           {
             const IndexType offset = PSQTBuckets * index + j * PsqtTileHeight;
             auto columnPsqt = reinterpret_cast<const psqt_vec_t*>(&psqtWeights[offset]);
@@ -581,16 +710,34 @@ namespace Stockfish::Eval::NNUE {
             &accumulator.psqtAccumulation[perspective][j * PsqtTileHeight]);
           for (std::size_t k = 0; k < NumPsqtRegs; ++k)
             vec_store_psqt(&accTilePsqt[k], psqt[k]);
+
+          if (entry)
+          {
+            accTilePsqt = reinterpret_cast<psqt_vec_t*>(&entry->psqtAccumulation[j * PsqtTileHeight]);
+            for (std::size_t k = 0; k < NumPsqtRegs; ++k)
+              vec_store_psqt(&accTilePsqt[k], psqt[k]);
+          }
         }
 
   #else
-        std::memcpy(accumulator.accumulation[perspective], biases,
+        std::memcpy(accumulator.accumulation[perspective], base,
             HalfDimensions * sizeof(BiasType));
 
         for (std::size_t k = 0; k < PSQTBuckets; ++k)
-          accumulator.psqtAccumulation[perspective][k] = 0;
+          accumulator.psqtAccumulation[perspective][k] = fromCache ? entry->psqtAccumulation[k] : 0;
+
+        for (const auto index : removed)
+        {
+          const IndexType offset = HalfDimensions * index;
+
+          for (IndexType j = 0; j < HalfDimensions; ++j)
+            accumulator.accumulation[perspective][j] -= weights[offset + j];
+
+          for (std::size_t k = 0; k < PSQTBuckets; ++k)
+            accumulator.psqtAccumulation[perspective][k] -= psqtWeights[index * PSQTBuckets + k];
+        }
 
-        for (const auto index : active)
+        for (const auto index : added)
         {
           const IndexType offset = HalfDimensions * index;
 
@@ -600,7 +747,22 @@ namespace Stockfish::Eval::NNUE {
           for (std::size_t k = 0; k < PSQTBuckets; ++k)
             accumulator.psqtAccumulation[perspective][k] += psqtWeights[index * PSQTBuckets + k];
         }
+
+        if (entry)
+        {
+          std::memcpy(entry->accumulation, accumulator.accumulation[perspective],
+              HalfDimensions * sizeof(BiasType));
+          std::memcpy(entry->psqtAccumulation, accumulator.psqtAccumulation[perspective],
+              PSQTBuckets * sizeof(PSQTWeightType));
+        }
   #endif
+
+        if (entry)
+        {
+          FeatureSet::update_cached_board(pos, entry->board);
+          entry->generation = generation;
+          entry->variant = pos.variant();
+        }
       }
 
   #if defined(USE_MMX)
@@ -609,8 +771,17 @@ namespace Stockfish::Eval::NNUE {
     }
 
     alignas(CacheLineSize) BiasType biases[HalfDimensions];
-    alignas(CacheLineSize) WeightType weights[HalfDimensions * InputDimensions];
-    alignas(CacheLineSize) PSQTWeightType psqtWeights[InputDimensions * PSQTBuckets];
+    const WeightType* weights = nullptr;
+    const PSQTWeightType* psqtWeights = nullptr;
+    IndexType inputDimensions = 0;
+
+    // Memory of the weights unless they are mapped from a file
+    WeightType* ownedWeights = nullptr;
+    PSQTWeightType* ownedPsqtWeights = nullptr;
+
+    // Identifies the loaded parameters in the accumulator caches
+    std::uint32_t generation = 0;
+    inline static std::uint32_t generations = 0;
   };
 
 }  // namespace Stockfish::Eval::NNUE
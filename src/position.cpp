@@ -2311,7 +2311,7 @@ void Position::do_null_move(StateInfo& newSt) {
       st->key ^= Zobrist::enpassant[file_of(pop_lsb(st->epSquares))];
 
   st->key ^= Zobrist::side;
-  prefetch(TT.first_entry(key()));
+  prefetch(thisThread->tt->first_entry(key()));
 
   ++st->rule50;
   st->pliesFromNull = 0;
@@ -3295,7 +3295,7 @@ int Position::set_from_packed_sfen(const Tools::PackedSfen& sfen , StateInfo* si
 }
 
 // Get the packed sfen. Returns to the buffer specified in the argument.
-void Position::sfen_pack(Tools::PackedSfen& sfen)
+void Position::sfen_pack(Tools::PackedSfen& sfen) const
 {
   sfen = Tools::sfen_pack(*this);
 }
@@ -345,7 +345,7 @@ public:
 
   // Get the packed sfen. Returns to the buffer specified in the argument.
   // Do not include gamePly in pack.
-  void sfen_pack(Tools::PackedSfen& sfen);
+  void sfen_pack(Tools::PackedSfen& sfen) const;
 
   // It is slow to go through sfen, so I made a function to set packed sfen directly.
   // Equivalent to pos.set(sfen_unpack(data),si,th);.
@@ -5,6 +5,7 @@
 
 #include <Python.h>
 #include <sstream>
+#include <vector>
 
 #include "misc.h"
 #include "types.h"
@@ -383,6 +384,45 @@ extern "C" PyObject* pyffish_validateFen(PyObject* self, PyObject *args) {
     return Py_BuildValue("i", FEN::validate_fen(std::string(fen), variants.find(std::string(variant))->second, chess960));
 }
 
+// INPUT variant, fen list
+extern "C" PyObject* pyffish_evaluateBatch(PyObject* self, PyObject *args) {
+    PyObject *fenList;
+    const char *variant;
+    int chess960 = false;
+    if (!PyArg_ParseTuple(args, "sO!|p", &variant, &PyList_Type, &fenList, &chess960)) {
+        return NULL;
+    }
+
+    const Variant* v = variants.find(std::string(variant))->second;
+    UCI::init_variant(v);
+
+    const Py_ssize_t numFens = PyList_Size(fenList);
+    std::vector<Position> positions(numFens);
+    std::vector<StateInfo, AlignedAllocator<StateInfo>> states(numFens);
+    std::vector<const Position*> positionPtrs;
+    for (Py_ssize_t i = 0; i < numFens; i++)
+    {
+        const char *fen = PyUnicode_AsUTF8(PyList_GetItem(fenList, i));
+        if (fen == NULL)
+            return NULL;
+        if (FEN::validate_fen(std::string(fen), v, chess960) != FEN::FEN_OK)
+        {
+            PyErr_SetString(PyExc_ValueError, (std::string("Invalid FEN '") + fen + "'").c_str());
+            return NULL;
+        }
+        positions[i].set(v, std::string(fen), chess960, &states[i], Threads.main());
+        positionPtrs.push_back(&positions[i]);
+    }
+
+    std::vector<Value> values(numFens);
+    Eval::evaluate_batch(positionPtrs.data(), positionPtrs.size(), values.data());
+
+    PyObject* valueList = PyList_New(numFens);
+    for (Py_ssize_t i = 0; i < numFens; i++)
+        PyList_SET_ITEM(valueList, i, PyLong_FromLong(values[i]));
+
+    return valueList;
+}
 
 static PyMethodDef PyFFishMethods[] = {
     {"version", (PyCFunction)pyffish_version, METH_NOARGS, "Get package version."},
@@ -405,6 +445,7 @@ static PyMethodDef PyFFishMethods[] = {
     {"is_optional_game_end", (PyCFunction)pyffish_isOptionalGameEnd, METH_VARARGS, "Get result from given FEN it rules enable game end by player."},
     {"has_insufficient_material", (PyCFunction)pyffish_hasInsufficientMaterial, METH_VARARGS, "Checks for insufficient material."},
     {"validate_fen", (PyCFunction)pyffish_validateFen, METH_VARARGS, "Validate an input FEN."},
+    {"evaluate_batch", (PyCFunction)pyffish_evaluateBatch, METH_VARARGS, "Get static evaluations of given FENs from the side to move's point of view."},
     {NULL, NULL, 0, NULL},  // sentinel
 };
 
@@ -22,6 +22,8 @@
 #include "movegen.h"
 #include "partner.h"
 #include "search.h"
+#include <cmath>
+
 #include "thread.h"
 #include "uci.h"
 #include "syzygy/tbprobe.h"
@@ -33,6 +35,64 @@ namespace Stockfish {
 ThreadPool Threads; // Global object
 
 
+/// EvalSampler::start() starts sampling. Every evaluation is sampled with
+/// probability sampleRate, the packed positions are appended to samples.
+
+void EvalSampler::start(double sampleRate, uint64_t seed, Tools::PSVector& samples) {
+
+  rate = sampleRate;
+  prng.set_seed(seed ? seed : 1);
+  sink = &samples;
+  countdown = next_gap();
+}
+
+
+/// EvalSampler::stop() stops sampling. The sink is not used any more.
+
+void EvalSampler::stop() {
+
+  sink = nullptr;
+  countdown = std::numeric_limits<uint64_t>::max();
+}
+
+
+/// EvalSampler::sample() is called when the countdown reaches zero, it packs
+/// the position and starts the countdown to the next sample.
+
+void EvalSampler::sample(const Position& pos) {
+
+  if (!sink)
+  {
+      countdown = std::numeric_limits<uint64_t>::max();
+      return;
+  }
+
+  pos.sfen_pack(sink->emplace_back().sfen);
+  countdown = next_gap();
+}
+
+
+/// EvalSampler::next_gap() returns the number of evaluations up to and
+/// including the next sampled one. When each evaluation is sampled with
+/// probability p, it follows the geometric distribution with parameter p.
+
+uint64_t EvalSampler::next_gap() {
+
+  constexpr double MaxGap = double(std::numeric_limits<uint64_t>::max() / 2);
+
+  if (rate >= 1.0)
+      return 1;
+
+  if (rate <= 0.0)
+      return std::numeric_limits<uint64_t>::max();
+
+  // Uniform in [0, 1)
+  const double u = double(prng.rand<uint64_t>() >> 11) / double(1ULL << 53);
+
+  return 1 + uint64_t(std::min(std::log1p(-u) / std::log1p(-rate), MaxGap));
+}
+
+
 /// Thread constructor launches the thread and waits until it goes to sleep
 /// in idle_loop(). Note that 'searching' and 'exit' should be already set.
 
@@ -74,6 +134,28 @@ void Thread::clear() {
                       h->fill(0);
           continuationHistory[inCheck][c][NO_PIECE][0]->fill(Search::CounterMovePruneThreshold - 1);
       }
+
+  if (privateTT)
+      privateTT->clear_local();
+}
+
+
+/// Thread::resize_private_tt() gives the thread a private transposition table
+/// of the given size, or removes it if the size is 0. It should be called from
+/// the thread itself, so that the table is in memory local to it.
+
+void Thread::resize_private_tt(size_t mbSize) {
+
+  if (mbSize == 0)
+  {
+      privateTT.reset();
+      return;
+  }
+
+  if (!privateTT)
+      privateTT = std::make_unique<TranspositionTable>();
+
+  privateTT->resize_local(mbSize);
 }
 
 
@@ -147,7 +229,9 @@ void Thread::idle_loop() {
 
       if (wrk)
       {
+        tt = privateTT ? privateTT.get() : &TT;
         wrk(*this);
+        tt = &TT;
       }
       else
       {
@@ -180,6 +264,7 @@ void ThreadPool::set(size_t requested) {
 
       // Reallocate the hash with the new threadpool size
       TT.resize(size_t(Options["Hash"]));
+      set_thread_hash(size_t(Options["Thread Hash"]));
 
       // Init thread number dependent search params.
       Search::init();
@@ -199,6 +284,18 @@ void ThreadPool::clear() {
   main()->previousTimeReduction = 1.0;
 }
 
+/// ThreadPool::set_thread_hash() gives every thread a private transposition
+/// table of the given size, used by execute_with_workers(). The tables are
+/// allocated by their threads. A size of 0 removes them.
+
+void ThreadPool::set_thread_hash(size_t mbSize) {
+
+  main()->wait_for_search_finished();
+
+  execute_with_workers([mbSize](Thread& th) { th.resize_private_tt(mbSize); });
+  wait_for_workers_finished();
+}
+
 void ThreadPool::execute_with_workers(const std::function<void(Thread&)>& worker)
 {
   for(Thread* th : *this)
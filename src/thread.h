@@ -21,17 +21,21 @@
 
 #include <atomic>
 #include <condition_variable>
+#include <limits>
+#include <memory>
 #include <mutex>
 #include <thread>
 #include <vector>
 #include <functional>
 
 #include "material.h"
+#include "misc.h"
 #include "movepick.h"
 #include "pawns.h"
 #include "position.h"
 #include "search.h"
 #include "thread_win32_osx.h"
+#include "tt.h"
 
 namespace Stockfish {
 
@@ -49,6 +53,34 @@ namespace Detail {
 
 }
 
+/// EvalSampler packs a random sample of the positions that are evaluated by
+/// the searches of a thread. Instead of drawing a random number for every
+/// evaluation it counts down the evaluations until the next sample, so an
+/// evaluation only pays for a decrement and a branch that is rarely taken,
+/// and never while the sampler is stopped.
+
+class EvalSampler {
+
+  void sample(const Position& pos);
+  uint64_t next_gap();
+
+  uint64_t countdown = std::numeric_limits<uint64_t>::max();
+  double rate = 0.0;
+  PRNG prng{1};
+  Tools::PSVector* sink = nullptr;
+
+public:
+  // Samples every evaluation with the given probability into sink
+  void start(double sampleRate, uint64_t seed, Tools::PSVector& samples);
+  void stop();
+
+  void on_eval(const Position& pos) {
+    if (--countdown == 0)
+        sample(pos);
+  }
+};
+
+
 class Thread {
 
   std::mutex mutex;
@@ -56,7 +88,6 @@ class Thread {
   size_t idx;
   bool exit = false, searching = true; // Set before starting std::thread
   std::function<void(Thread&)> worker;
-  std::function<void(Position&)> on_eval_callback;
   NativeThread stdThread;
 
 public:
@@ -77,16 +108,20 @@ public:
   size_t id() const { return idx; }
 
   void wait_for_worker_finished();
+  void resize_private_tt(size_t mbSize);
 
-  template <typename FuncT>
-  void set_eval_callback(FuncT&& f) { on_eval_callback = std::forward<FuncT>(f); }
+  Pawns::Table pawnsTable;
+  Material::Table materialTable;
+  Eval::NNUE::AccumulatorCache accumulatorCache;
 
-  void clear_eval_callback() { on_eval_callback = nullptr; }
+  // The table probed by the searches of the thread. The tasks run by
+  // execute_with_worker() are independent of each other, so they use
+  // the private table of the thread if it has one.
+  TranspositionTable* tt = &TT;
+  std::unique_ptr<TranspositionTable> privateTT;
 
-  void on_eval() { if (on_eval_callback) on_eval_callback(rootPos); }
+  EvalSampler evalSampler;
 
-  Pawns::Table pawnsTable;
-  Material::Table materialTable;
   size_t pvIdx, pvLast;
   uint64_t ttHitAverage;
   int selDepth, nmpMinPly;
@@ -195,6 +230,7 @@ struct ThreadPool : public std::vector<Thread*> {
   void start_thinking(Position&, StateListPtr&, const Search::LimitsType&, bool = false);
   void clear();
   void set(size_t);
+  void set_thread_hash(size_t mbSize);
 
   MainThread* main()        const { return static_cast<MainThread*>(front()); }
   uint64_t nodes_searched() const { return accumulate(&Thread::nodes); }
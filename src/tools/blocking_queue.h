@@ -0,0 +1,173 @@
+#ifndef _BLOCKING_QUEUE_H_
+#define _BLOCKING_QUEUE_H_
+
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <mutex>
+#include <optional>
+
+namespace Stockfish::Tools {
+
+    // Bounded multi-producer multi-consumer queue used to hand over
+    // buffers between threads.
+    //
+    // push() blocks while the queue is full (back-pressure) and pop()
+    // blocks while the queue is empty. After close() is called
+    // push() fails immediately and pop() drains the remaining
+    // elements before failing, which allows for a clean shutdown
+    // of both sides.
+    //
+    // The time spent blocked on either side is accumulated so that
+    // the users can tell which side of the pipeline is the bottleneck.
+    template <typename T>
+    struct BoundedBlockingQueue
+    {
+        struct WaitStats
+        {
+            // Number of calls that had to block.
+            std::uint64_t num_waits = 0;
+
+            // Total time spent blocked, in microseconds.
+            std::uint64_t wait_time_us = 0;
+        };
+
+        explicit BoundedBlockingQueue(std::size_t capacity) :
+            max_size(capacity > 0 ? capacity : 1),
+            closed(false)
+        {
+        }
+
+        BoundedBlockingQueue(const BoundedBlockingQueue&) = delete;
+        BoundedBlockingQueue& operator=(const BoundedBlockingQueue&) = delete;
+
+        // Returns false if the queue was closed, in which case
+        // the value is not consumed.
+        bool push(T&& value)
+        {
+            std::unique_lock lock(mutex);
+
+            if (!closed && queue.size() >= max_size)
+            {
+                const auto start = Clock::now();
+                not_full.wait(lock, [this] { return closed || queue.size() < max_size; });
+                add_wait(push_stats, start);
+            }
+
+            if (closed)
+                return false;
+
+            queue.emplace_back(std::move(value));
+            lock.unlock();
+
+            not_empty.notify_one();
+            return true;
+        }
+
+        // Returns std::nullopt only when the queue is closed and empty.
+        std::optional<T> pop()
+        {
+            std::unique_lock lock(mutex);
+
+            if (!closed && queue.empty())
+            {
+                const auto start = Clock::now();
+                not_empty.wait(lock, [this] { return closed || !queue.empty(); });
+                add_wait(pop_stats, start);
+            }
+
+            if (queue.empty())
+                return std::nullopt;
+
+            std::optional<T> value(std::move(queue.front()));
+            queue.pop_front();
+            lock.unlock();
+
+            not_full.notify_one();
+            return value;
+        }
+
+        // Non-blocking variant of pop().
+        std::optional<T> try_pop()
+        {
+            std::unique_lock lock(mutex);
+
+            if (queue.empty())
+                return std::nullopt;
+
+            std::optional<T> value(std::move(queue.front()));
+            queue.pop_front();
+            lock.unlock();
+
+            not_full.notify_one();
+            return value;
+        }
+
+        // Wakes up all waiting threads. No more elements can be pushed
+        // but the ones already in the queue can still be popped.
+        void close()
+        {
+            {
+                std::lock_guard lock(mutex);
+                closed = true;
+            }
+
+            not_full.notify_all();
+            not_empty.notify_all();
+        }
+
+        bool is_closed() const
+        {
+            std::lock_guard lock(mutex);
+            return closed;
+        }
+
+        std::size_t size() const
+        {
+            std::lock_guard lock(mutex);
+            return queue.size();
+        }
+
+        std::size_t capacity() const { return max_size; }
+
+        // Time spent by producers waiting for free space.
+        WaitStats get_push_wait_stats() const
+        {
+            std::lock_guard lock(mutex);
+            return push_stats;
+        }
+
+        // Time spent by consumers waiting for elements.
+        WaitStats get_pop_wait_stats() const
+        {
+            std::lock_guard lock(mutex);
+            return pop_stats;
+        }
+
+    private:
+        using Clock = std::chrono::steady_clock;
+
+        // Must be called with the mutex held.
+        static void add_wait(WaitStats& stats, Clock::time_point start)
+        {
+            stats.num_waits += 1;
+            stats.wait_time_us += std::chrono::duration_cast<std::chrono::microseconds>(
+                Clock::now() - start).count();
+        }
+
+        const std::size_t max_size;
+
+        mutable std::mutex mutex;
+        std::condition_variable not_full;
+        std::condition_variable not_empty;
+
+        std::deque<T> queue;
+        bool closed;
+
+        WaitStats push_stats;
+        WaitStats pop_stats;
+    };
+}
+
+#endif
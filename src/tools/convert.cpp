@@ -1,5 +1,7 @@
 #include "convert.h"
 
+#include "sfen_stream.h"
+
 #include "uci.h"
 #include "misc.h"
 #include "thread.h"
@@ -472,12 +474,24 @@ namespace Stockfish::Tools
             std::cout << "convert " << filename << " ... ";
 
             // Just convert packedsfenvalue to text
-            std::fstream fs;
-            fs.open(filename, ios::in | ios::binary);
-            PackedSfenValue p;
+            auto in = open_sfen_input_file(filename);
+            if (in == nullptr)
+            {
+                std::cout << "invalid input file type" << std::endl;
+                continue;
+            }
+
+            PSVector batch(64 * 1024);
             while (true)
             {
-                if (fs.read((char*)&p, sizeof(PackedSfenValue))) {
+                const auto num_read = in->read_batch(batch.data(), batch.size());
+                if (num_read == 0)
+                    break;
+
+                for (std::size_t i = 0; i < num_read; ++i)
+                {
+                    const auto& p = batch[i];
+
                     StateInfo si;
                     tpos.set_from_packed_sfen(p.sfen, &si, th);
 
@@ -489,11 +503,7 @@ namespace Stockfish::Tools
                     ofs << "result " << int(p.game_result) << std::endl;
                     ofs << "e" << std::endl;
                 }
-                else {
-                    break;
-                }
             }
-            fs.close();
             std::cout << "done" << std::endl;
         }
         ofs.close();
@@ -503,6 +513,7 @@ namespace Stockfish::Tools
     static inline const std::string plain_extension = ".plain";
     static inline const std::string bin_extension = ".bin";
     static inline const std::string binpack_extension = ".binpack";
+    static inline const std::string vbinpack_extension = ".vbinpack";
 
     static bool file_exists(const std::string& name)
     {
@@ -510,13 +521,6 @@ namespace Stockfish::Tools
         return f.good();
     }
 
-    static bool ends_with(const std::string& lhs, const std::string& end)
-    {
-        if (end.size() > lhs.size()) return false;
-
-        return std::equal(end.rbegin(), end.rend(), lhs.rbegin());
-    }
-
     static bool is_convert_of_type(
         const std::string& input_path,
         const std::string& output_path,
@@ -529,6 +533,65 @@ namespace Stockfish::Tools
 
     using ConvertFunctionType = void(std::string inputPath, std::string outputPath, std::ios_base::openmode om, bool validate);
 
+    // Conversion between the formats that have a sfen stream.
+    // Used for the variant aware formats, the library functions
+    // only understand chess.
+    static void convert_sfen_stream(std::string input_path, std::string output_path, std::ios_base::openmode om, bool validate)
+    {
+        constexpr std::size_t batch_size = 64 * 1024;
+
+        std::cout << "Converting " << input_path << " to " << output_path << '\n';
+
+        if (om == std::ios_base::trunc)
+        {
+            // The streams always append.
+            std::ofstream(output_path, std::ios_base::binary | std::ios_base::trunc);
+        }
+
+        auto in = open_sfen_input_file(input_path);
+        auto out = create_new_sfen_output(output_path);
+
+        if (in == nullptr || out == nullptr)
+        {
+            std::cerr << "Invalid file type.\n";
+            return;
+        }
+
+        Position pos;
+        StateInfo si;
+        auto th = Threads.main();
+
+        PSVector batch(batch_size);
+        std::size_t num_processed_positions = 0;
+        for (;;)
+        {
+            const auto num_read = in->read_batch(batch.data(), batch_size);
+            if (num_read == 0)
+                break;
+
+            if (validate)
+            {
+                for (std::size_t i = 0; i < num_read; ++i)
+                {
+                    pos.set_from_packed_sfen(batch[i].sfen, &si, th);
+                    if (!pos.pos_is_ok())
+                    {
+                        std::cerr << "Invalid entry " << num_processed_positions + i
+                                  << " with position " << pos.fen() << '\n';
+                        return;
+                    }
+                }
+            }
+
+            out->write_batch(batch.data(), num_read);
+
+            num_processed_positions += num_read;
+            std::cout << "Processed " << num_processed_positions << " positions.\n";
+        }
+
+        std::cout << "Finished. Converted " << num_processed_positions << " positions.\n";
+    }
+
     static ConvertFunctionType* get_convert_function(const std::string& input_path, const std::string& output_path)
     {
         if (is_convert_of_type(input_path, output_path, plain_extension, bin_extension))
@@ -546,6 +609,13 @@ namespace Stockfish::Tools
         if (is_convert_of_type(input_path, output_path, binpack_extension, bin_extension))
             return binpack::convertBinpackToBin;
 
+        if (is_convert_of_type(input_path, output_path, bin_extension, vbinpack_extension))
+            return convert_sfen_stream;
+        if (is_convert_of_type(input_path, output_path, vbinpack_extension, bin_extension))
+            return convert_sfen_stream;
+        if (is_convert_of_type(input_path, output_path, vbinpack_extension, vbinpack_extension))
+            return convert_sfen_stream;
+
         return nullptr;
     }
 
@@ -0,0 +1,332 @@
+#include "dedup_filter.h"
+
+#include "misc.h"
+
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+#include <iostream>
+#include <sstream>
+
+#if !defined(_WIN32)
+#include <fcntl.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+namespace Stockfish::Tools {
+
+    static_assert(sizeof(std::atomic<std::uint64_t>) == sizeof(std::uint64_t));
+
+    // Array of 64 bit words that is either in private memory or
+    // mapped from a file, which can be shared between processes.
+    struct FilterStorage
+    {
+        // Written at the start of the file, so that processes sharing
+        // the file agree on the layout. Padded to a cache line, so that
+        // the blocks of the Bloom filter stay aligned.
+        struct FileHeader
+        {
+            static constexpr std::uint64_t MAGIC = 0x544C465055444544ULL; // "DEDUPFLT"
+            static constexpr std::uint64_t VERSION = 1;
+
+            std::uint64_t magic;
+            std::uint64_t version;
+            std::uint64_t type;
+            std::uint64_t num_words;
+            std::uint64_t num_hashes;
+            std::uint64_t padding[3];
+        };
+
+        static_assert(sizeof(FileHeader) == 64);
+
+        FilterStorage() = default;
+        FilterStorage(const FilterStorage&) = delete;
+        FilterStorage& operator=(const FilterStorage&) = delete;
+
+        ~FilterStorage()
+        {
+#if !defined(_WIN32)
+            if (m_mapping != nullptr)
+                ::munmap(m_mapping, m_mapped_size);
+#endif
+            aligned_large_pages_free(m_memory);
+        }
+
+        bool allocate(std::uint64_t num_words)
+        {
+            m_memory = aligned_large_pages_alloc(num_words * sizeof(std::uint64_t));
+            if (m_memory == nullptr)
+            {
+                std::cerr << "ERROR (dedup_filter): Failed to allocate " << num_words * 8 / (1024 * 1024) << " MiB.\n";
+                return false;
+            }
+
+            std::memset(m_memory, 0, num_words * sizeof(std::uint64_t));
+            m_words = static_cast<std::atomic<std::uint64_t>*>(m_memory);
+            m_size = num_words;
+
+            return true;
+        }
+
+#if !defined(_WIN32)
+        // Maps the file, creating it if it doesn't exist. An existing file
+        // must have been created with the same parameters.
+        bool map_file(const std::string& path, const FileHeader& expected)
+        {
+            const int fd = ::open(path.c_str(), O_RDWR | O_CREAT, 0644);
+            if (fd == -1)
+            {
+                std::cerr << "ERROR (dedup_filter): Failed to open " << path << ".\n";
+                return false;
+            }
+
+            // Only one process initializes a new file.
+            ::flock(fd, LOCK_EX);
+
+            const std::size_t size = sizeof(FileHeader) + expected.num_words * sizeof(std::uint64_t);
+
+            bool ok = true;
+            struct stat st;
+            if (::fstat(fd, &st) != 0)
+                ok = false;
+            else if (st.st_size == 0)
+            {
+                // The new space reads as zeros, which is an empty filter.
+                ok = ::ftruncate(fd, size) == 0
+                    && ::pwrite(fd, &expected, sizeof(FileHeader), 0) == (ssize_t)sizeof(FileHeader);
+            }
+            else
+            {
+                FileHeader header;
+                ok = (std::size_t)st.st_size == size
+                    && ::pread(fd, &header, sizeof(FileHeader), 0) == (ssize_t)sizeof(FileHeader)
+                    && std::memcmp(&header, &expected, sizeof(FileHeader)) == 0;
+
+                if (!ok)
+                    std::cerr << "ERROR (dedup_filter): " << path << " was created with different parameters.\n";
+            }
+
+            void* addr = MAP_FAILED;
+            if (ok)
+                addr = ::mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+
+            ::flock(fd, LOCK_UN);
+
+            // The mapping stays valid after the descriptor is closed.
+            ::close(fd);
+
+            if (addr == MAP_FAILED)
+            {
+                if (ok)
+                    std::cerr << "ERROR (dedup_filter): Failed to map " << path << ".\n";
+                return false;
+            }
+
+            m_mapping = addr;
+            m_mapped_size = size;
+            m_words = reinterpret_cast<std::atomic<std::uint64_t>*>(static_cast<char*>(addr) + sizeof(FileHeader));
+            m_size = expected.num_words;
+
+            return true;
+        }
+#else
+        bool map_file(const std::string&, const FileHeader&)
+        {
+            std::cerr << "ERROR (dedup_filter): Shared filters are not supported on this platform.\n";
+            return false;
+        }
+#endif
+
+        bool open(const std::string& path, const FileHeader& header)
+        {
+            return path.empty() ? allocate(header.num_words) : map_file(path, header);
+        }
+
+        bool is_shared() const { return m_mapping != nullptr; }
+
+        std::atomic<std::uint64_t>& operator[](std::uint64_t i) { return m_words[i]; }
+
+        std::uint64_t size() const { return m_size; }
+
+    private:
+        void* m_memory = nullptr;
+        void* m_mapping = nullptr;
+        std::size_t m_mapped_size = 0;
+        std::atomic<std::uint64_t>* m_words = nullptr;
+        std::uint64_t m_size = 0;
+    };
+
+    static FilterStorage::FileHeader make_header(DedupFilterType type, std::uint64_t num_words, std::uint64_t num_hashes)
+    {
+        FilterStorage::FileHeader header{};
+        header.magic = FilterStorage::FileHeader::MAGIC;
+        header.version = FilterStorage::FileHeader::VERSION;
+        header.type = static_cast<std::uint64_t>(type);
+        header.num_words = num_words;
+        header.num_hashes = num_hashes;
+        return header;
+    }
+
+    static std::string describe_storage(const FilterStorage& storage, const std::string& file)
+    {
+        std::stringstream ss;
+        ss << storage.size() * 8 / (1024 * 1024) << " MiB";
+        if (storage.is_shared())
+            ss << ", shared through " << file;
+        return ss.str();
+    }
+
+    // The hash table used by the generator from the beginning.
+    struct TableDedupFilter : DedupFilter
+    {
+        bool open(const DedupFilterParams& params)
+        {
+            std::uint64_t num_entries = 1;
+            while (num_entries * 2 <= params.capacity)
+                num_entries *= 2;
+
+            m_file = params.file;
+            return m_table.open(params.file, make_header(DedupFilterType::Table, num_entries, 0));
+        }
+
+        std::string describe() const override
+        {
+            return "table with " + std::to_string(m_table.size()) + " entries, " + describe_storage(m_table, m_file);
+        }
+
+    protected:
+        bool do_test_and_insert(Key key) override
+        {
+            auto& entry = m_table[key & (m_table.size() - 1)];
+            if (entry.load(std::memory_order_relaxed) == key)
+                return true;
+
+            // Replace with the current key.
+            entry.store(key, std::memory_order_relaxed);
+            return false;
+        }
+
+    private:
+        FilterStorage m_table;
+        std::string m_file;
+    };
+
+    // Bloom filter where all bits of a key are in one cache line,
+    // so a query touches only one cache line.
+    struct BloomDedupFilter : DedupFilter
+    {
+        static constexpr std::uint64_t WORDS_PER_BLOCK = 8;
+        static constexpr std::uint64_t BITS_PER_BLOCK = WORDS_PER_BLOCK * 64;
+        static constexpr std::uint64_t MAX_HASHES = 16;
+
+        bool open(const DedupFilterParams& params)
+        {
+            // Optimal sizing of a standard Bloom filter. Blocking increases
+            // the false positive rate a bit over the requested one.
+            const double fp_rate = std::clamp(params.fp_rate, 1e-12, 0.5);
+            const double bits_per_key = -std::log(fp_rate) / (std::log(2.0) * std::log(2.0));
+            const double num_bits = std::max<double>(params.capacity, 1) * bits_per_key;
+
+            m_num_blocks = std::max<std::uint64_t>(1, (std::uint64_t)std::ceil(num_bits / BITS_PER_BLOCK));
+            m_num_hashes = std::clamp<std::uint64_t>((std::uint64_t)std::lround(bits_per_key * std::log(2.0)), 1, MAX_HASHES);
+
+            m_file = params.file;
+            return m_bits.open(params.file, make_header(DedupFilterType::Bloom, m_num_blocks * WORDS_PER_BLOCK, m_num_hashes));
+        }
+
+        std::string describe() const override
+        {
+            return "bloom filter with " + std::to_string(m_num_blocks) + " blocks, "
+                + std::to_string(m_num_hashes) + " hashes, " + describe_storage(m_bits, m_file);
+        }
+
+    protected:
+        bool do_test_and_insert(Key key) override
+        {
+            // Zobrist keys are uniformly distributed, the high bits choose
+            // the block and a remix of the key chooses the bits in it.
+            const std::uint64_t block = mul_hi64(key, m_num_blocks) * WORDS_PER_BLOCK;
+            const std::uint64_t h = key * 0x9E3779B97F4A7C15ULL;
+            const std::uint32_t h1 = (std::uint32_t)h;
+            const std::uint32_t h2 = (std::uint32_t)(h >> 32) | 1;
+
+            std::uint64_t masks[WORDS_PER_BLOCK] = {};
+            for (std::uint64_t i = 0; i < m_num_hashes; ++i)
+            {
+                const std::uint32_t bit = (h1 + (std::uint32_t)i * h2) >> 23;
+                masks[bit / 64] |= 1ULL << (bit % 64);
+            }
+
+            bool seen = true;
+            for (std::uint64_t i = 0; i < WORDS_PER_BLOCK; ++i)
+                if ((m_bits[block + i].load(std::memory_order_relaxed) & masks[i]) != masks[i])
+                {
+                    seen = false;
+                    break;
+                }
+
+            if (seen)
+                return true;
+
+            for (std::uint64_t i = 0; i < WORDS_PER_BLOCK; ++i)
+                if (masks[i] != 0)
+                    m_bits[block + i].fetch_or(masks[i], std::memory_order_relaxed);
+
+            return false;
+        }
+
+    private:
+        FilterStorage m_bits;
+        std::string m_file;
+        std::uint64_t m_num_blocks = 0;
+        std::uint64_t m_num_hashes = 0;
+    };
+
+    struct NoDedupFilter : DedupFilter
+    {
+        std::string describe() const override { return "none"; }
+
+    protected:
+        bool do_test_and_insert(Key) override { return false; }
+    };
+
+    std::unique_ptr<DedupFilter> create_dedup_filter(const DedupFilterParams& params)
+    {
+        switch (params.type)
+        {
+            case DedupFilterType::Table:
+            {
+                auto filter = std::make_unique<TableDedupFilter>();
+                if (!filter->open(params))
+                    return nullptr;
+                return filter;
+            }
+            case DedupFilterType::Bloom:
+            {
+                auto filter = std::make_unique<BloomDedupFilter>();
+                if (!filter->open(params))
+                    return nullptr;
+                return filter;
+            }
+            case DedupFilterType::None:
+                return std::make_unique<NoDedupFilter>();
+        }
+
+        return nullptr;
+    }
+
+    std::optional<DedupFilterType> dedup_filter_type_from_string(const std::string& str)
+    {
+        if (str == "table")
+            return DedupFilterType::Table;
+        else if (str == "bloom")
+            return DedupFilterType::Bloom;
+        else if (str == "none")
+            return DedupFilterType::None;
+
+        return std::nullopt;
+    }
+}
@@ -0,0 +1,85 @@
+#ifndef _DEDUP_FILTER_H_
+#define _DEDUP_FILTER_H_
+
+#include "types.h"
+
+#include <atomic>
+#include <cstdint>
+#include <memory>
+#include <optional>
+#include <string>
+
+namespace Stockfish::Tools {
+
+    enum struct DedupFilterType
+    {
+        // Direct mapped table of keys. A key is replaced by the next key
+        // that maps to the same entry, so old duplicates can pass.
+        Table,
+
+        // Blocked Bloom filter. Never forgets a key, but reports keys
+        // that were never inserted as seen with a small probability.
+        Bloom,
+
+        // Every position passes.
+        None
+    };
+
+    struct DedupFilterParams
+    {
+        DedupFilterType type = DedupFilterType::Table;
+
+        // Number of entries of the table, rounded down to a power of 2.
+        // For the Bloom filter the number of keys it is sized for.
+        std::uint64_t capacity = 64 * 1024 * 1024;
+
+        // False positive rate of the Bloom filter at full capacity.
+        double fp_rate = 0.0001;
+
+        // If not empty then the filter is kept in this file instead of
+        // private memory. All processes that use the same file share
+        // the filter, so they don't generate each other's positions.
+        std::string file;
+    };
+
+    // Remembers position keys. All functions are thread safe and lock free.
+    // Two threads inserting the same key at the same time may both see it
+    // as new.
+    struct DedupFilter
+    {
+        virtual ~DedupFilter() = default;
+
+        // Returns true if the key was (probably) inserted before.
+        // Otherwise inserts it and returns false.
+        bool test_and_insert(Key key)
+        {
+            const bool seen = do_test_and_insert(key);
+
+            num_queries.fetch_add(1, std::memory_order_relaxed);
+            if (seen)
+                num_rejected.fetch_add(1, std::memory_order_relaxed);
+
+            return seen;
+        }
+
+        virtual std::string describe() const = 0;
+
+        std::uint64_t get_num_queries() const { return num_queries.load(std::memory_order_relaxed); }
+        std::uint64_t get_num_rejected() const { return num_rejected.load(std::memory_order_relaxed); }
+
+    protected:
+        virtual bool do_test_and_insert(Key key) = 0;
+
+    private:
+        std::atomic<std::uint64_t> num_queries{0};
+        std::atomic<std::uint64_t> num_rejected{0};
+    };
+
+    // Returns nullptr and prints an error if the filter can't be created,
+    // for example when an existing file was made with different parameters.
+    std::unique_ptr<DedupFilter> create_dedup_filter(const DedupFilterParams& params);
+
+    std::optional<DedupFilterType> dedup_filter_type_from_string(const std::string& str);
+}
+
+#endif
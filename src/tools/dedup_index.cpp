@@ -0,0 +1,364 @@
+#include "dedup_index.h"
+
+#include <algorithm>
+#include <cstdio>
+#include <filesystem>
+#include <fstream>
+#include <functional>
+#include <iostream>
+#include <memory>
+#include <queue>
+#include <utility>
+
+#if !defined(_WIN32)
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+namespace sys = std::filesystem;
+
+namespace Stockfish::Tools {
+
+    DedupIndex::~DedupIndex()
+    {
+#if !defined(_WIN32)
+        if (m_mapping != nullptr)
+            ::munmap(m_mapping, m_mapped_size);
+#endif
+    }
+
+    bool DedupIndex::open(const std::string& path)
+    {
+        std::error_code ec;
+        if (!sys::exists(path, ec))
+            return true;
+
+        Header header{};
+        {
+            std::ifstream in(path, std::ios::binary);
+            in.read(reinterpret_cast<char*>(&header), sizeof(Header));
+            if (!in || header.magic != MAGIC
+                || sys::file_size(path, ec) != sizeof(Header) + header.num_keys * sizeof(Key))
+            {
+                std::cerr << "ERROR (dedup_index): " << path << " is not a valid index.\n";
+                return false;
+            }
+
+#if defined(_WIN32)
+            // No mapping, the keys are read into memory instead.
+            m_storage.resize(header.num_keys);
+            in.read(reinterpret_cast<char*>(m_storage.data()), header.num_keys * sizeof(Key));
+            m_keys = m_storage.data();
+#endif
+        }
+
+        m_num_keys = header.num_keys;
+        if (m_num_keys == 0)
+            return true;
+
+#if !defined(_WIN32)
+        const int fd = ::open(path.c_str(), O_RDONLY);
+        if (fd == -1)
+            return false;
+
+        m_mapped_size = sizeof(Header) + m_num_keys * sizeof(Key);
+        void* addr = ::mmap(nullptr, m_mapped_size, PROT_READ, MAP_PRIVATE, fd, 0);
+
+        // The mapping stays valid after the descriptor is closed.
+        ::close(fd);
+
+        if (addr == MAP_FAILED)
+        {
+            std::cerr << "ERROR (dedup_index): Failed to map " << path << ".\n";
+            m_num_keys = 0;
+            return false;
+        }
+
+        ::madvise(addr, m_mapped_size, MADV_RANDOM);
+
+        m_mapping = addr;
+        m_keys = reinterpret_cast<const Key*>(static_cast<const char*>(addr) + sizeof(Header));
+#endif
+
+        m_fences.reserve(m_num_keys / KEYS_PER_BLOCK + 1);
+        for (std::uint64_t i = 0; i < m_num_keys; i += KEYS_PER_BLOCK)
+            m_fences.emplace_back(m_keys[i]);
+
+        return true;
+    }
+
+    bool DedupIndex::contains(Key key) const
+    {
+        // The last block whose first key is not greater than the key.
+        const auto fence = std::upper_bound(m_fences.begin(), m_fences.end(), key);
+        if (fence == m_fences.begin())
+            return false;
+
+        const std::uint64_t block = fence - m_fences.begin() - 1;
+        const Key* first = m_keys + block * KEYS_PER_BLOCK;
+        const Key* last = m_keys + std::min(m_num_keys, (block + 1) * KEYS_PER_BLOCK);
+
+        return std::binary_search(first, last, key);
+    }
+
+    // Reads the records of a run or the keys of an index sequentially.
+    template <typename T>
+    struct RunFileReader
+    {
+        static constexpr std::size_t BUFFER_SIZE = 64 * 1024;
+
+        RunFileReader(const std::string& path, std::uint64_t offset, std::uint64_t num_records) :
+            m_in(path, std::ios::binary),
+            m_remaining(num_records)
+        {
+            m_in.seekg(offset);
+            m_buffer.reserve(BUFFER_SIZE);
+            refill();
+        }
+
+        bool empty() const { return m_pos == m_buffer.size(); }
+
+        const T& peek() const { return m_buffer[m_pos]; }
+
+        void pop()
+        {
+            if (++m_pos == m_buffer.size())
+                refill();
+        }
+
+    private:
+        void refill()
+        {
+            const std::size_t n = std::min<std::uint64_t>(BUFFER_SIZE, m_remaining);
+            m_buffer.resize(n);
+            m_in.read(reinterpret_cast<char*>(m_buffer.data()), n * sizeof(T));
+            m_buffer.resize(m_in.gcount() / sizeof(T));
+            m_remaining -= n;
+            m_pos = 0;
+        }
+
+        std::ifstream m_in;
+        std::vector<T> m_buffer;
+        std::size_t m_pos = 0;
+        std::uint64_t m_remaining;
+    };
+
+    using KeyFileReader = RunFileReader<Key>;
+
+    DedupIndexBuilder::DedupIndexBuilder(const std::string& path, std::uint64_t memory_mb) :
+        m_path(path),
+        m_max_keys(std::max<std::uint64_t>(memory_mb * 1024 * 1024 / sizeof(Key), 1))
+    {
+    }
+
+    DedupIndexBuilder::~DedupIndexBuilder()
+    {
+        std::error_code ec;
+        for (const auto& run : m_runs)
+            sys::remove(run, ec);
+    }
+
+    void DedupIndexBuilder::add(Key key)
+    {
+        m_keys.emplace_back(key);
+
+        if (m_keys.size() >= m_max_keys)
+            write_run();
+    }
+
+    void DedupIndexBuilder::write_run()
+    {
+        std::sort(m_keys.begin(), m_keys.end());
+        m_keys.erase(std::unique(m_keys.begin(), m_keys.end()), m_keys.end());
+
+        const std::string run_path = m_path + ".run" + std::to_string(m_runs.size());
+        std::ofstream out(run_path, std::ios::binary | std::ios::trunc);
+        out.write(reinterpret_cast<const char*>(m_keys.data()), m_keys.size() * sizeof(Key));
+
+        m_runs.emplace_back(run_path);
+        m_keys.clear();
+    }
+
+    std::int64_t DedupIndexBuilder::finish()
+    {
+        if (!m_keys.empty())
+            write_run();
+
+        std::error_code ec;
+        std::vector<std::unique_ptr<KeyFileReader>> readers;
+
+        for (const auto& run : m_runs)
+            readers.emplace_back(std::make_unique<KeyFileReader>(run, 0, sys::file_size(run, ec) / sizeof(Key)));
+
+        if (sys::exists(m_path, ec))
+        {
+            DedupIndex::Header header{};
+            std::ifstream in(m_path, std::ios::binary);
+            in.read(reinterpret_cast<char*>(&header), sizeof(header));
+            if (!in || header.magic != DedupIndex::MAGIC)
+            {
+                std::cerr << "ERROR (dedup_index): " << m_path << " is not a valid index.\n";
+                return -1;
+            }
+
+            readers.emplace_back(std::make_unique<KeyFileReader>(m_path, sizeof(header), header.num_keys));
+        }
+
+        const std::string tmp_path = m_path + ".tmp";
+        std::ofstream out(tmp_path, std::ios::binary | std::ios::trunc);
+
+        DedupIndex::Header header{ DedupIndex::MAGIC, 0 };
+        out.write(reinterpret_cast<const char*>(&header), sizeof(header));
+
+        // K-way merge of the sorted inputs, dropping duplicates.
+        using Entry = std::pair<Key, std::size_t>;
+        std::priority_queue<Entry, std::vector<Entry>, std::greater<Entry>> queue;
+        for (std::size_t i = 0; i < readers.size(); ++i)
+            if (!readers[i]->empty())
+                queue.emplace(readers[i]->peek(), i);
+
+        std::vector<Key> buffer;
+        buffer.reserve(KeyFileReader::BUFFER_SIZE);
+        Key last = 0;
+
+        while (!queue.empty())
+        {
+            const auto [key, i] = queue.top();
+            queue.pop();
+
+            if (header.num_keys == 0 || key != last)
+            {
+                buffer.emplace_back(key);
+                header.num_keys += 1;
+                last = key;
+
+                if (buffer.size() == KeyFileReader::BUFFER_SIZE)
+                {
+                    out.write(reinterpret_cast<const char*>(buffer.data()), buffer.size() * sizeof(Key));
+                    buffer.clear();
+                }
+            }
+
+            readers[i]->pop();
+            if (!readers[i]->empty())
+                queue.emplace(readers[i]->peek(), i);
+        }
+
+        out.write(reinterpret_cast<const char*>(buffer.data()), buffer.size() * sizeof(Key));
+        out.seekp(0);
+        out.write(reinterpret_cast<const char*>(&header), sizeof(header));
+        out.close();
+
+        readers.clear();
+
+        if (!out)
+        {
+            std::cerr << "ERROR (dedup_index): Failed to write " << tmp_path << ".\n";
+            return -1;
+        }
+
+        sys::rename(tmp_path, m_path, ec);
+        if (ec)
+        {
+            std::cerr << "ERROR (dedup_index): Failed to replace " << m_path << ".\n";
+            return -1;
+        }
+
+        return header.num_keys;
+    }
+
+    FirstOccurrenceFinder::FirstOccurrenceFinder(const std::string& path, std::uint64_t memory_mb) :
+        m_path(path),
+        m_memory_mb(memory_mb),
+        m_max_entries(std::max<std::uint64_t>(memory_mb * 1024 * 1024 / sizeof(Entry), 1))
+    {
+    }
+
+    FirstOccurrenceFinder::~FirstOccurrenceFinder()
+    {
+        std::error_code ec;
+        for (const auto& run : m_runs)
+            sys::remove(run, ec);
+
+        sys::remove(m_path, ec);
+    }
+
+    void FirstOccurrenceFinder::add(Key key, std::uint64_t index)
+    {
+        m_entries.emplace_back(key, index);
+
+        if (m_entries.size() >= m_max_entries)
+            write_run();
+    }
+
+    void FirstOccurrenceFinder::write_run()
+    {
+        std::sort(m_entries.begin(), m_entries.end());
+
+        const std::string run_path = m_path + ".run" + std::to_string(m_runs.size());
+        std::ofstream out(run_path, std::ios::binary | std::ios::trunc);
+        out.write(reinterpret_cast<const char*>(m_entries.data()), m_entries.size() * sizeof(Entry));
+
+        m_runs.emplace_back(run_path);
+        m_entries.clear();
+    }
+
+    std::int64_t FirstOccurrenceFinder::finish(DedupIndexBuilder* keys)
+    {
+        if (!m_entries.empty())
+            write_run();
+
+        // The entries are on disk now, the memory goes to the builders.
+        std::vector<Entry>().swap(m_entries);
+
+        std::error_code ec;
+        sys::remove(m_path, ec);
+
+        std::vector<std::unique_ptr<RunFileReader<Entry>>> readers;
+        for (const auto& run : m_runs)
+            readers.emplace_back(std::make_unique<RunFileReader<Entry>>(run, 0, sys::file_size(run, ec) / sizeof(Entry)));
+
+        // The indices are unique, so an index of them is just their sorted list.
+        DedupIndexBuilder indices(m_path, keys != nullptr ? m_memory_mb / 2 : m_memory_mb);
+
+        // K-way merge of the runs. The entries of a key come out ordered
+        // by their index, so the first one is the first occurrence.
+        using QueueEntry = std::pair<Entry, std::size_t>;
+        std::priority_queue<QueueEntry, std::vector<QueueEntry>, std::greater<QueueEntry>> queue;
+        for (std::size_t i = 0; i < readers.size(); ++i)
+            if (!readers[i]->empty())
+                queue.emplace(readers[i]->peek(), i);
+
+        std::int64_t num_first = 0;
+        Key last = 0;
+
+        while (!queue.empty())
+        {
+            const auto [entry, i] = queue.top();
+            queue.pop();
+
+            if (num_first == 0 || entry.first != last)
+            {
+                indices.add(entry.second);
+                if (keys != nullptr)
+                    keys->add(entry.first);
+
+                num_first += 1;
+                last = entry.first;
+            }
+
+            readers[i]->pop();
+            if (!readers[i]->empty())
+                queue.emplace(readers[i]->peek(), i);
+        }
+
+        readers.clear();
+
+        if (indices.finish() < 0 || !m_first.open(m_path))
+            return -1;
+
+        return num_first;
+    }
+}
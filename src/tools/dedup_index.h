@@ -0,0 +1,108 @@
+#ifndef _DEDUP_INDEX_H_
+#define _DEDUP_INDEX_H_
+
+#include "types.h"
+
+#include <cstdint>
+#include <string>
+#include <utility>
+#include <vector>
+
+namespace Stockfish::Tools {
+
+    // On-disk set of position keys. The file holds a small header followed
+    // by the sorted, unique keys. Lookups map the file and keep only every
+    // KEYS_PER_BLOCK-th key in memory, so an index is usable no matter how
+    // large it gets.
+    struct DedupIndex
+    {
+        static constexpr std::uint64_t MAGIC = 0x5844495055444544ULL; // "DEDUPIDX"
+        static constexpr std::size_t KEYS_PER_BLOCK = 512; // one 4 KiB page
+
+        struct Header
+        {
+            std::uint64_t magic;
+            std::uint64_t num_keys;
+        };
+
+        DedupIndex() = default;
+        DedupIndex(const DedupIndex&) = delete;
+        DedupIndex& operator=(const DedupIndex&) = delete;
+        ~DedupIndex();
+
+        // Returns false if the file exists but is not a valid index.
+        // A missing file is opened as an empty index.
+        bool open(const std::string& path);
+
+        bool contains(Key key) const;
+
+        std::uint64_t size() const { return m_num_keys; }
+
+    private:
+        void* m_mapping = nullptr;
+        std::size_t m_mapped_size = 0;
+        const Key* m_keys = nullptr;
+        std::uint64_t m_num_keys = 0;
+
+        // Holds the keys where files can't be mapped.
+        std::vector<Key> m_storage;
+
+        // First key of each block.
+        std::vector<Key> m_fences;
+    };
+
+    // Adds keys to an index with an external merge sort. The keys are
+    // collected in memory, sorted and written to temporary run files, which
+    // are merged with the existing index by finish().
+    struct DedupIndexBuilder
+    {
+        DedupIndexBuilder(const std::string& path, std::uint64_t memory_mb);
+        ~DedupIndexBuilder();
+
+        void add(Key key);
+
+        // Returns the number of keys in the new index, or -1 on failure.
+        std::int64_t finish();
+
+    private:
+        void write_run();
+
+        std::string m_path;
+        std::size_t m_max_keys;
+        std::vector<Key> m_keys;
+        std::vector<std::string> m_runs;
+    };
+
+    // Finds the first occurrence of every key in a sequence with the same
+    // external merge sort. The keys are added with their index in the
+    // sequence, finish() stores the indices of the first occurrences in an
+    // index at path, which is removed again with the finder.
+    struct FirstOccurrenceFinder
+    {
+        FirstOccurrenceFinder(const std::string& path, std::uint64_t memory_mb);
+        ~FirstOccurrenceFinder();
+
+        void add(Key key, std::uint64_t index);
+
+        // Also adds the unique keys to the builder, if there is one. The
+        // finder then only uses half of its memory, the builder should get
+        // the other half. Returns the number of unique keys, or -1 on failure.
+        std::int64_t finish(DedupIndexBuilder* keys);
+
+        bool is_first(std::uint64_t index) const { return m_first.contains(index); }
+
+    private:
+        using Entry = std::pair<Key, std::uint64_t>;
+
+        void write_run();
+
+        std::string m_path;
+        std::uint64_t m_memory_mb;
+        std::size_t m_max_entries;
+        std::vector<Entry> m_entries;
+        std::vector<std::string> m_runs;
+        DedupIndex m_first;
+    };
+}
+
+#endif
@@ -0,0 +1,538 @@
+#include "interleave.h"
+
+#include "sfen_stream.h"
+#include "packed_sfen.h"
+
+#include "misc.h"
+#include "thread.h"
+
+#include "extra/nnue_data_binpack_format.h"
+
+#include <algorithm>
+#include <atomic>
+#include <cstdint>
+#include <filesystem>
+#include <fstream>
+#include <functional>
+#include <iostream>
+#include <memory>
+#include <string>
+#include <string_view>
+#include <unordered_set>
+#include <vector>
+
+#if !defined(_WIN32)
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+
+namespace sys = std::filesystem;
+
+namespace Stockfish::Tools
+{
+    struct InterleaveInput
+    {
+        std::string filename;
+        double weight = 1.0;
+    };
+
+    struct InterleaveParams
+    {
+        std::vector<InterleaveInput> inputs;
+        std::string output_filename = "interleaved.binpack";
+        std::string seed;
+        bool dedup = false;
+
+        void enforce_constraints()
+        {
+            for (auto& input : inputs)
+                input.weight = std::max(input.weight, 0.0);
+        }
+    };
+
+    // A range of an input file that is copied as a whole. For chunked
+    // formats it is one chunk including its header, for .bin a block
+    // of BIN_CHUNK_NUM_ENTRIES entries.
+    struct InterleaveSegment
+    {
+        std::size_t file_index;
+
+        // The index of the chunk, as used by BasicSfenInputStream::read_chunk.
+        std::size_t chunk_index;
+
+        std::uint64_t offset;
+        std::uint64_t size;
+        std::uint32_t num_entries;
+        std::uint16_t first_ply;
+    };
+
+    // Copies of segments are grouped to about this many bytes per work item.
+    constexpr std::uint64_t INTERLEAVE_GROUP_SIZE = 64 * 1024 * 1024;
+
+    static bool is_chunked_format(const std::string& filename)
+    {
+        return has_extension(filename, BinpackSfenInputStream::extension)
+            || has_extension(filename, VBinpackSfenInputStream::extension);
+    }
+
+    static std::vector<InterleaveSegment> load_segments(const std::string& filename, std::size_t file_index)
+    {
+        std::vector<InterleaveSegment> segments;
+
+        if (is_chunked_format(filename))
+        {
+            const auto chunks = binpack::loadCompressedTrainingDataChunks(filename);
+            for (std::size_t i = 0; i < chunks.size(); ++i)
+                segments.push_back({ file_index, i, chunks[i].offset, 8 + std::uint64_t(chunks[i].size), chunks[i].numEntries, chunks[i].firstPly });
+        }
+        else
+        {
+            std::error_code ec;
+            const std::uint64_t num_entries = sys::file_size(filename, ec) / sizeof(PackedSfenValue);
+            const std::uint64_t block_size = BIN_CHUNK_NUM_ENTRIES * sizeof(PackedSfenValue);
+
+            for (std::uint64_t i = 0; i * BIN_CHUNK_NUM_ENTRIES < num_entries; ++i)
+            {
+                const auto n = std::min<std::uint64_t>(BIN_CHUNK_NUM_ENTRIES, num_entries - i * BIN_CHUNK_NUM_ENTRIES);
+                segments.push_back({ file_index, i, i * block_size, n * sizeof(PackedSfenValue), static_cast<std::uint32_t>(n), 0 });
+            }
+        }
+
+        return segments;
+    }
+
+    // Chooses the segments of a file according to its weight. The whole
+    // file is taken floor(weight) times, the fractional part selects a
+    // random subset of the segments. The order of the file is kept.
+    static std::vector<InterleaveSegment> sample_segments(const std::vector<InterleaveSegment>& segments, double weight, PRNG& prng)
+    {
+        std::vector<InterleaveSegment> sampled;
+
+        const auto num_passes = static_cast<std::uint64_t>(weight);
+        for (std::uint64_t i = 0; i < num_passes; ++i)
+            sampled.insert(sampled.end(), segments.begin(), segments.end());
+
+        const double fraction = weight - num_passes;
+        if (fraction > 0.0)
+            for (const auto& segment : segments)
+                if (prng.rand(1000000) < fraction * 1000000)
+                    sampled.emplace_back(segment);
+
+        return sampled;
+    }
+
+    // Randomly alternates between the files, with the probability of each
+    // file proportional to the number of bytes it has left, so that the
+    // files are spread evenly over the output.
+    static std::vector<InterleaveSegment> interleave_segments(std::vector<std::vector<InterleaveSegment>> per_file, PRNG& prng)
+    {
+        std::vector<std::uint64_t> remaining(per_file.size(), 0);
+        std::vector<std::size_t> next(per_file.size(), 0);
+        std::uint64_t total_remaining = 0;
+
+        for (std::size_t i = 0; i < per_file.size(); ++i)
+        {
+            for (const auto& segment : per_file[i])
+                remaining[i] += segment.size;
+
+            total_remaining += remaining[i];
+        }
+
+        std::vector<InterleaveSegment> plan;
+        while (total_remaining > 0)
+        {
+            std::uint64_t where = prng.rand(total_remaining);
+            std::size_t i = 0;
+            while (where >= remaining[i])
+                where -= remaining[i++];
+
+            const auto& segment = per_file[i][next[i]++];
+            remaining[i] -= segment.size;
+            total_remaining -= segment.size;
+            plan.emplace_back(segment);
+        }
+
+        return plan;
+    }
+
+#if !defined(_WIN32)
+
+    // Copies a range of bytes between two files without changing the file offsets.
+    // copy_file_range lets the kernel do the copy without going through user space,
+    // when it is not supported the data is copied through the buffer.
+    static bool copy_range(int in_fd, std::uint64_t in_offset, int out_fd, std::uint64_t out_offset, std::uint64_t size, std::vector<char>& buffer)
+    {
+#if defined(__linux__)
+        while (size > 0)
+        {
+            loff_t in_off = in_offset;
+            loff_t out_off = out_offset;
+            const ssize_t n = copy_file_range(in_fd, &in_off, out_fd, &out_off, size, 0);
+            if (n <= 0)
+                break;
+
+            in_offset += n;
+            out_offset += n;
+            size -= n;
+        }
+#endif
+
+        while (size > 0)
+        {
+            const ssize_t n = pread(in_fd, buffer.data(), std::min<std::uint64_t>(size, buffer.size()), in_offset);
+            if (n <= 0)
+                return false;
+
+            for (ssize_t written = 0; written < n; )
+            {
+                const ssize_t w = pwrite(out_fd, buffer.data() + written, n - written, out_offset + written);
+                if (w <= 0)
+                    return false;
+
+                written += w;
+            }
+
+            in_offset += n;
+            out_offset += n;
+            size -= n;
+        }
+
+        return true;
+    }
+
+#endif
+
+    // Copies the segments in the order of the plan. Every thread copies groups
+    // of consecutive segments to their precomputed offsets in the output,
+    // segments that are also consecutive in the input are copied at once.
+    static bool copy_segments(const InterleaveParams& params, const std::vector<InterleaveSegment>& plan)
+    {
+        std::vector<std::uint64_t> out_offsets(plan.size() + 1, 0);
+        for (std::size_t i = 0; i < plan.size(); ++i)
+            out_offsets[i + 1] = out_offsets[i] + plan[i].size;
+
+        std::vector<std::size_t> group_begins;
+        for (std::size_t i = 0; i < plan.size(); ++i)
+            if (group_begins.empty() || out_offsets[i] - out_offsets[group_begins.back()] >= INTERLEAVE_GROUP_SIZE)
+                group_begins.emplace_back(i);
+        group_begins.emplace_back(plan.size());
+
+        std::atomic<std::size_t> next_group = 0;
+        std::atomic<std::uint64_t> num_bytes_copied = 0;
+        std::atomic<bool> failed = false;
+
+#if !defined(_WIN32)
+        const int out_fd = open(params.output_filename.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        if (out_fd < 0 || ftruncate(out_fd, out_offsets.back()) != 0)
+        {
+            std::cerr << "ERROR: Cannot create " << params.output_filename << ".\n";
+            if (out_fd >= 0)
+                close(out_fd);
+            return false;
+        }
+
+        std::vector<int> in_fds;
+        for (const auto& input : params.inputs)
+        {
+            in_fds.emplace_back(open(input.filename.c_str(), O_RDONLY));
+            if (in_fds.back() < 0)
+            {
+                std::cerr << "ERROR: Cannot open " << input.filename << ".\n";
+                failed = true;
+                break;
+            }
+        }
+
+        if (failed)
+        {
+            for (int fd : in_fds)
+                if (fd >= 0)
+                    close(fd);
+            close(out_fd);
+            return false;
+        }
+
+        Threads.execute_with_workers([&](Thread&) {
+            std::vector<char> buffer(1024 * 1024);
+
+            for (std::size_t g = next_group++; g + 1 < group_begins.size() && !failed; g = next_group++)
+            {
+                for (std::size_t i = group_begins[g]; i < group_begins[g + 1]; )
+                {
+                    std::size_t j = i + 1;
+                    while (   j < group_begins[g + 1]
+                           && plan[j].file_index == plan[i].file_index
+                           && plan[j].offset == plan[j - 1].offset + plan[j - 1].size)
+                        ++j;
+
+                    const std::uint64_t size = out_offsets[j] - out_offsets[i];
+                    if (!copy_range(in_fds[plan[i].file_index], plan[i].offset, out_fd, out_offsets[i], size, buffer))
+                        failed = true;
+
+                    i = j;
+                }
+
+                const std::uint64_t group_size = out_offsets[group_begins[g + 1]] - out_offsets[group_begins[g]];
+                const std::uint64_t copied = num_bytes_copied.fetch_add(group_size) + group_size;
+                if ((copied >> 30) != ((copied - group_size) >> 30))
+                    sync_region_cout.new_region() << "Copied " << (copied >> 20) << " MiB.\n";
+            }
+        });
+        Threads.wait_for_workers_finished();
+
+        for (int fd : in_fds)
+            if (fd >= 0)
+                close(fd);
+        close(out_fd);
+#else
+        // Sequential fallback.
+        std::ofstream out(params.output_filename, std::ios::out | std::ios::binary | std::ios::trunc);
+        std::vector<std::ifstream> ins;
+        for (const auto& input : params.inputs)
+        {
+            ins.emplace_back(input.filename, std::ios::in | std::ios::binary);
+            if (!ins.back())
+            {
+                std::cerr << "ERROR: Cannot open " << input.filename << ".\n";
+                return false;
+            }
+        }
+
+        std::vector<char> buffer;
+        for (const auto& segment : plan)
+        {
+            buffer.resize(segment.size);
+            auto& in = ins[segment.file_index];
+            in.seekg(segment.offset);
+            if (!in.read(buffer.data(), buffer.size()) || !out.write(buffer.data(), buffer.size()))
+            {
+                failed = true;
+                break;
+            }
+        }
+        num_bytes_copied = out_offsets.back();
+#endif
+
+        if (failed)
+        {
+            std::cerr << "ERROR: Copying the data failed.\n";
+            return false;
+        }
+
+        if (is_chunked_format(params.output_filename))
+        {
+            binpack::CompressedTrainingDataIndexWriter index(params.output_filename, std::ios_base::trunc);
+            for (std::size_t i = 0; i < plan.size(); ++i)
+                index.add({ out_offsets[i], static_cast<std::uint32_t>(plan[i].size - 8), plan[i].num_entries, plan[i].first_ply });
+        }
+
+        std::cout << "Copied " << num_bytes_copied << " bytes in " << plan.size() << " segments.\n";
+        return true;
+    }
+
+    // Decodes the segments in the order of the plan and writes only the first
+    // occurrence of every position. The segments are decoded by all threads,
+    // the output is written in order.
+    static bool copy_segments_dedup(const InterleaveParams& params, const std::vector<InterleaveSegment>& plan)
+    {
+        std::ofstream(params.output_filename, std::ios::out | std::ios::binary | std::ios::trunc);
+        std::error_code ec;
+        sys::remove(binpack::compressedTrainingDataIndexPath(params.output_filename), ec);
+
+        auto out = create_new_sfen_output(params.output_filename);
+
+        std::unordered_set<std::uint64_t> seen;
+        std::uint64_t num_read = 0;
+        std::uint64_t num_written = 0;
+
+        const std::size_t batch_size = Threads.size();
+        std::vector<PSVector> decoded(batch_size);
+        std::atomic<bool> failed = false;
+
+        for (std::size_t begin = 0; begin < plan.size(); begin += batch_size)
+        {
+            const std::size_t end = std::min(begin + batch_size, plan.size());
+            std::atomic<std::size_t> next_segment = begin;
+
+            Threads.execute_with_workers([&](Thread&) {
+                std::size_t file_index = params.inputs.size();
+                std::unique_ptr<BasicSfenInputStream> in;
+
+                for (std::size_t i = next_segment++; i < end; i = next_segment++)
+                {
+                    if (plan[i].file_index != file_index)
+                    {
+                        file_index = plan[i].file_index;
+                        in = open_sfen_input_file(params.inputs[file_index].filename);
+                    }
+
+                    auto& sfens = decoded[i - begin];
+                    sfens.clear();
+                    if (in == nullptr)
+                    {
+                        sync_region_cout.new_region() << "ERROR: Cannot open " << params.inputs[file_index].filename << ".\n";
+                        failed = true;
+                        break;
+                    }
+
+                    in->read_chunk(plan[i].chunk_index, sfens);
+                }
+            });
+            Threads.wait_for_workers_finished();
+
+            if (failed)
+                return false;
+
+            for (std::size_t i = begin; i < end; ++i)
+            {
+                auto& sfens = decoded[i - begin];
+                num_read += sfens.size();
+
+                auto last = std::remove_if(sfens.begin(), sfens.end(), [&seen](const PackedSfenValue& psv) {
+                    const std::string_view bytes(reinterpret_cast<const char*>(&psv.sfen), sizeof(psv.sfen));
+                    return !seen.insert(std::hash<std::string_view>{}(bytes)).second;
+                });
+                sfens.erase(last, sfens.end());
+
+                out->write(sfens);
+                num_written += sfens.size();
+            }
+
+            if ((begin / batch_size) % 64 == 63)
+                std::cout << "Processed " << num_read << " positions.\n";
+        }
+
+        std::cout << "Read " << num_read << " positions, wrote " << num_written << ". Removed "
+                  << num_read - num_written << " duplicates.\n";
+        return true;
+    }
+
+    static void do_interleave(const InterleaveParams& params)
+    {
+        PRNG prng(params.seed);
+        std::cout << "PRNG seed : " << prng.get_seed() << '\n';
+
+        std::vector<std::vector<InterleaveSegment>> per_file;
+        std::uint64_t num_input_bytes = 0;
+
+        for (std::size_t i = 0; i < params.inputs.size(); ++i)
+        {
+            const auto segments = load_segments(params.inputs[i].filename, i);
+
+            std::uint64_t size = 0;
+            for (const auto& segment : segments)
+                size += segment.size;
+            num_input_bytes += size;
+
+            per_file.emplace_back(sample_segments(segments, params.inputs[i].weight, prng));
+
+            std::cout << params.inputs[i].filename << " : " << segments.size() << " segments, "
+                      << size << " bytes, " << per_file.back().size() << " segments selected\n";
+        }
+
+        const auto plan = interleave_segments(std::move(per_file), prng);
+
+        std::cout << "Interleaving " << plan.size() << " segments from " << num_input_bytes << " bytes of input\n\n";
+
+        const auto start = now();
+        const bool ok = params.dedup
+            ? copy_segments_dedup(params, plan)
+            : copy_segments(params, plan);
+
+        if (ok)
+            std::cout << "Finished in " << (now() - start) / 1000.0 << "s.\n";
+    }
+
+    void interleave(std::istringstream& is)
+    {
+        InterleaveParams params{};
+
+        while(true)
+        {
+            std::string token;
+            is >> token;
+
+            if (token == "")
+                break;
+
+            if (token == "input_file")
+            {
+                InterleaveInput input;
+                is >> input.filename;
+                params.inputs.emplace_back(input);
+            }
+            else if (token == "weight")
+            {
+                if (params.inputs.empty())
+                {
+                    std::cout << "ERROR: weight must follow an input_file. Exiting...\n";
+                    return;
+                }
+
+                is >> params.inputs.back().weight;
+            }
+            else if (token == "output_file")
+                is >> params.output_filename;
+            else if (token == "seed")
+                is >> params.seed;
+            else if (token == "dedup")
+                params.dedup = true;
+            else
+            {
+                std::cout << "ERROR: Unknown option " << token << ". Exiting...\n";
+                return;
+            }
+        }
+
+        params.enforce_constraints();
+
+        std::cout << "Performing interleave with parameters:\n";
+        for (const auto& input : params.inputs)
+            std::cout << "input_file          : " << input.filename << " (weight " << input.weight << ")\n";
+        std::cout << "output_file         : " << params.output_filename << '\n';
+        std::cout << "dedup               : " << params.dedup << '\n';
+        std::cout << "threads             : " << Threads.size() << '\n';
+        std::cout << '\n';
+
+        if (params.inputs.empty())
+        {
+            std::cout << "ERROR: No input files. Exiting...\n";
+            return;
+        }
+
+        for (const auto& input : params.inputs)
+        {
+            std::error_code ec;
+            if (sys::equivalent(input.filename, params.output_filename, ec))
+            {
+                std::cout << "ERROR: The output file " << params.output_filename << " is also an input. Exiting...\n";
+                return;
+            }
+
+            // Without decoding, chunks can only be copied into a file of the same format.
+            const auto extension = sys::path(input.filename).extension();
+            if (!params.dedup && extension != sys::path(params.output_filename).extension())
+            {
+                std::cout << "ERROR: " << input.filename << " has a different format than the output file. "
+                          << "Use dedup to convert the data. Exiting...\n";
+                return;
+            }
+
+            if (open_sfen_input_file(input.filename) == nullptr)
+            {
+                std::cout << "ERROR: Unknown input file type " << input.filename << ". Exiting...\n";
+                return;
+            }
+        }
+
+        if (   !has_extension(params.output_filename, BinSfenOutputStream::extension)
+            && !has_extension(params.output_filename, BinpackSfenOutputStream::extension)
+            && !has_extension(params.output_filename, VBinpackSfenOutputStream::extension))
+        {
+            std::cout << "ERROR: Unknown output file type " << params.output_filename << ". Exiting...\n";
+            return;
+        }
+
+        do_interleave(params);
+    }
+}
@@ -0,0 +1,12 @@
+#ifndef _INTERLEAVE_H_
+#define _INTERLEAVE_H_
+
+#include <sstream>
+
+namespace Stockfish::Tools {
+
+    void interleave(std::istringstream& is);
+
+}
+
+#endif
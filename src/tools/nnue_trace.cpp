@@ -0,0 +1,191 @@
+#include "nnue_trace.h"
+
+#include "sfen_stream.h"
+
+#include "position.h"
+#include "thread.h"
+#include "uci.h"
+#include "evaluate.h"
+
+#include "nnue/evaluate_nnue.h"
+
+#include <atomic>
+#include <cstdint>
+#include <fstream>
+#include <iostream>
+#include <string>
+#include <vector>
+
+namespace Stockfish::Tools
+{
+    struct NnueTraceParams
+    {
+        std::string input_filename = "in.epd";
+        std::string output_filename = "trace.csv";
+        bool all_buckets = true;
+    };
+
+    // An entry of the binary output. Values are in internal units, from
+    // the point of view of the side to move.
+    struct NnueTraceRecord
+    {
+        std::int32_t bucket;
+        std::int32_t psqt[Eval::NNUE::LayerStacks];
+        std::int32_t positional[Eval::NNUE::LayerStacks];
+    };
+
+    static_assert(sizeof(NnueTraceRecord) == 68);
+
+    // The positions are read and written in batches, which are traced by
+    // all threads. This keeps the output in the order of the input.
+    static constexpr std::size_t NNUE_TRACE_BATCH_SIZE = 16384;
+
+    static void write_csv_header(std::ostream& out)
+    {
+        out << "fen,bucket";
+        for (std::size_t b = 0; b < Eval::NNUE::LayerStacks; ++b)
+            out << ",psqt_" << b;
+        for (std::size_t b = 0; b < Eval::NNUE::LayerStacks; ++b)
+            out << ",positional_" << b;
+        out << '\n';
+    }
+
+    static void write_csv(std::ostream& out, const std::string& fen, const Eval::NNUE::NnueEvalTrace& t)
+    {
+        out << '"' << fen << "\"," << t.correctBucket;
+        for (std::size_t b = 0; b < Eval::NNUE::LayerStacks; ++b)
+            out << ',' << t.psqt[b];
+        for (std::size_t b = 0; b < Eval::NNUE::LayerStacks; ++b)
+        {
+            out << ',';
+            if (t.positional[b] != VALUE_NONE)
+                out << t.positional[b];
+        }
+        out << '\n';
+    }
+
+    static void write_binary(std::ostream& out, const Eval::NNUE::NnueEvalTrace& t)
+    {
+        NnueTraceRecord record;
+        record.bucket = static_cast<std::int32_t>(t.correctBucket);
+        for (std::size_t b = 0; b < Eval::NNUE::LayerStacks; ++b)
+        {
+            record.psqt[b] = t.psqt[b];
+            record.positional[b] = t.positional[b];
+        }
+        out.write(reinterpret_cast<const char*>(&record), sizeof(record));
+    }
+
+    static void do_nnue_trace(NnueTraceParams& params)
+    {
+        std::ifstream in(params.input_filename);
+        if (!in)
+        {
+            std::cerr << "ERROR: Could not open " << params.input_filename << ". Exiting...\n";
+            return;
+        }
+
+        const bool csv = ends_with(params.output_filename, ".csv");
+        std::ofstream out(params.output_filename, csv ? std::ios::out : std::ios::binary);
+        if (!out)
+        {
+            std::cerr << "ERROR: Could not open " << params.output_filename << ". Exiting...\n";
+            return;
+        }
+
+        if (csv)
+            write_csv_header(out);
+
+        const Variant* variant = variants.find(Options["UCI_Variant"])->second;
+
+        std::vector<std::string> fens;
+        std::vector<Eval::NNUE::NnueEvalTrace> traces;
+        fens.reserve(NNUE_TRACE_BATCH_SIZE);
+        traces.resize(NNUE_TRACE_BATCH_SIZE);
+
+        std::uint64_t num_processed = 0;
+
+        for (;;)
+        {
+            fens.clear();
+
+            std::string fen;
+            while (fens.size() < NNUE_TRACE_BATCH_SIZE && std::getline(in, fen))
+                if (!fen.empty())
+                    fens.emplace_back(fen);
+
+            if (fens.empty())
+                break;
+
+            std::atomic<std::size_t> next = 0;
+
+            Threads.execute_with_workers([&](auto& th){
+                Position& pos = th.rootPos;
+                StateInfo si;
+
+                for (std::size_t i = next.fetch_add(1); i < fens.size(); i = next.fetch_add(1))
+                {
+                    pos.set(variant, fens[i], false, &si, &th);
+                    traces[i] = Eval::NNUE::trace_evaluate(pos, params.all_buckets);
+                }
+            });
+            Threads.wait_for_workers_finished();
+
+            for (std::size_t i = 0; i < fens.size(); ++i)
+            {
+                if (csv)
+                    write_csv(out, fens[i], traces[i]);
+                else
+                    write_binary(out, traces[i]);
+            }
+
+            num_processed += fens.size();
+            std::cout << "Processed " << num_processed << " positions.\n";
+        }
+
+        std::cout << "Finished.\n";
+    }
+
+    void nnue_trace(std::istringstream& is)
+    {
+        NnueTraceParams params{};
+
+        while(true)
+        {
+            std::string token;
+            is >> token;
+
+            if (token == "")
+                break;
+
+            if (token == "input_file")
+                is >> params.input_filename;
+            else if (token == "output_file")
+                is >> params.output_filename;
+            else if (token == "all_buckets")
+                is >> params.all_buckets;
+            else
+            {
+                std::cout << "ERROR: Unknown option " << token << ". Exiting...\n";
+                return;
+            }
+        }
+
+        Eval::NNUE::init();
+        if (Eval::NNUE::useNNUE == Eval::NNUE::UseNNUEMode::False)
+        {
+            std::cout << "ERROR: nnue_trace needs a network for the current variant. Exiting...\n";
+            return;
+        }
+        Eval::NNUE::verify();
+
+        std::cout << "Performing nnue_trace with parameters:\n";
+        std::cout << "input_file          : " << params.input_filename << '\n';
+        std::cout << "output_file         : " << params.output_filename << '\n';
+        std::cout << "all_buckets         : " << params.all_buckets << '\n';
+        std::cout << "threads             : " << Threads.size() << '\n';
+        std::cout << '\n';
+
+        do_nnue_trace(params);
+    }
+}
@@ -0,0 +1,12 @@
+#ifndef _NNUE_TRACE_H_
+#define _NNUE_TRACE_H_
+
+#include <sstream>
+
+namespace Stockfish::Tools {
+
+    void nnue_trace(std::istringstream& is);
+
+}
+
+#endif
@@ -1,28 +1,275 @@
 #include "opening_book.h"
 
+#include <cstring>
+#include <filesystem>
 #include <fstream>
+#include <iostream>
+
+#if !defined(_WIN32)
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+namespace sys = std::filesystem;
 
 namespace Stockfish::Tools {
 
+    IndexPermutation::IndexPermutation(std::uint64_t n, PRNG& prng) :
+        m_size(n)
+    {
+        m_half_bits = 1;
+        while (m_half_bits < 32 && (std::uint64_t(1) << (2 * m_half_bits)) < n)
+            m_half_bits += 1;
+
+        m_half_mask = (std::uint64_t(1) << m_half_bits) - 1;
+
+        for (auto& key : m_keys)
+            key = prng.rand<std::uint64_t>();
+    }
+
+    std::uint64_t IndexPermutation::encrypt(std::uint64_t x) const
+    {
+        std::uint64_t left = x >> m_half_bits;
+        std::uint64_t right = x & m_half_mask;
+
+        for (const auto key : m_keys)
+        {
+            // splitmix64 finalizer as the round function
+            std::uint64_t f = right ^ key;
+            f = (f ^ (f >> 30)) * 0xBF58476D1CE4E5B9ULL;
+            f = (f ^ (f >> 27)) * 0x94D049BB133111EBULL;
+            f ^= f >> 31;
+
+            const std::uint64_t next = left ^ (f & m_half_mask);
+            left = right;
+            right = next;
+        }
+
+        return (left << m_half_bits) | right;
+    }
+
+    std::uint64_t IndexPermutation::operator()(std::uint64_t index) const
+    {
+        if (m_size <= 1)
+            return index;
+
+        // The domain is less than 4 times larger than n, so this
+        // takes less than 4 rounds on average.
+        do
+            index = encrypt(index);
+        while (index >= m_size);
+
+        return index;
+    }
+
     EpdOpeningBook::EpdOpeningBook(const std::string& file, PRNG& prng) :
-        OpeningBook(file)
+        OpeningBook(file),
+        m_index_path(file + ".idx")
     {
-        std::ifstream in(file);
+        std::error_code ec;
+        const auto file_size = sys::file_size(file, ec);
+        if (ec)
+            return;
+
+        const auto file_time = sys::last_write_time(file, ec);
+        if (ec)
+            return;
+
+        const IndexHeader expected{
+            INDEX_MAGIC,
+            static_cast<std::uint64_t>(file_size),
+            static_cast<std::int64_t>(file_time.time_since_epoch().count()),
+            0
+        };
+
+        if (!map_book())
+            return;
+
+        if (!load_index(expected))
+            build_index(expected);
+
+        permutation = IndexPermutation(m_num_lines, prng);
+    }
+
+    EpdOpeningBook::~EpdOpeningBook()
+    {
+#if !defined(_WIN32)
+        if (m_book_mapping != nullptr)
+            ::munmap(m_book_mapping, m_data_size);
+
+        if (m_index_mapping != nullptr)
+            ::munmap(m_index_mapping, m_index_mapped_size);
+#endif
+    }
+
+    bool EpdOpeningBook::map_book()
+    {
+#if defined(_WIN32)
+        // No mapping, the book is read into memory instead.
+        std::ifstream in(filename, std::ios::binary);
         if (!in)
+            return false;
+
+        m_storage.assign(std::istreambuf_iterator<char>(in), std::istreambuf_iterator<char>());
+        m_data = m_storage.data();
+        m_data_size = m_storage.size();
+#else
+        const int fd = ::open(filename.c_str(), O_RDONLY);
+        if (fd == -1)
+            return false;
+
+        struct stat st;
+        if (::fstat(fd, &st) == -1)
         {
-            return;
+            ::close(fd);
+            return false;
         }
 
-        std::string line;
-        while (std::getline(in, line))
+        m_data_size = st.st_size;
+        if (m_data_size == 0)
         {
-            if (line.empty())
-                continue;
+            ::close(fd);
+            return true;
+        }
+
+        void* addr = ::mmap(nullptr, m_data_size, PROT_READ, MAP_PRIVATE, fd, 0);
+
+        // The mapping stays valid after the descriptor is closed.
+        ::close(fd);
 
-            fens.emplace_back(line);
+        if (addr == MAP_FAILED)
+        {
+            std::cerr << "ERROR (opening_book): Failed to map " << filename << ".\n";
+            m_data_size = 0;
+            return false;
         }
 
-        Algo::shuffle(fens, prng);
+        ::madvise(addr, m_data_size, MADV_RANDOM);
+
+        m_book_mapping = addr;
+        m_data = static_cast<const char*>(addr);
+#endif
+
+        return true;
+    }
+
+    bool EpdOpeningBook::load_index(const IndexHeader& expected)
+    {
+        std::error_code ec;
+        const auto index_size = sys::file_size(m_index_path, ec);
+        if (ec)
+            return false;
+
+        IndexHeader header{};
+        std::ifstream in(m_index_path, std::ios::binary);
+        in.read(reinterpret_cast<char*>(&header), sizeof(IndexHeader));
+
+        // A changed book invalidates the index.
+        if (!in
+            || header.magic != expected.magic
+            || header.file_size != expected.file_size
+            || header.file_time != expected.file_time
+            || index_size != sizeof(IndexHeader) + header.num_lines * sizeof(std::uint64_t))
+            return false;
+
+        m_num_lines = header.num_lines;
+        if (m_num_lines == 0)
+            return true;
+
+#if defined(_WIN32)
+        m_offsets_storage.resize(m_num_lines);
+        in.read(reinterpret_cast<char*>(m_offsets_storage.data()), m_num_lines * sizeof(std::uint64_t));
+        m_offsets = m_offsets_storage.data();
+#else
+        in.close();
+
+        const int fd = ::open(m_index_path.c_str(), O_RDONLY);
+        if (fd == -1)
+        {
+            m_num_lines = 0;
+            return false;
+        }
+
+        m_index_mapped_size = index_size;
+        void* addr = ::mmap(nullptr, m_index_mapped_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        ::close(fd);
+
+        if (addr == MAP_FAILED)
+        {
+            m_num_lines = 0;
+            m_index_mapped_size = 0;
+            return false;
+        }
+
+        ::madvise(addr, m_index_mapped_size, MADV_RANDOM);
+
+        m_index_mapping = addr;
+        m_offsets = reinterpret_cast<const std::uint64_t*>(static_cast<const char*>(addr) + sizeof(IndexHeader));
+#endif
+
+        return true;
+    }
+
+    void EpdOpeningBook::build_index(const IndexHeader& expected)
+    {
+        // Offsets of the lines that are not empty.
+        std::uint64_t start = 0;
+        while (start < m_data_size)
+        {
+            const void* newline = std::memchr(m_data + start, '\n', m_data_size - start);
+            const std::uint64_t end = newline != nullptr
+                ? static_cast<const char*>(newline) - m_data
+                : m_data_size;
+
+            if (end > start && !(end == start + 1 && m_data[start] == '\r'))
+                m_offsets_storage.emplace_back(start);
+
+            start = end + 1;
+        }
+
+        m_offsets = m_offsets_storage.data();
+        m_num_lines = m_offsets_storage.size();
+
+        IndexHeader header = expected;
+        header.num_lines = m_num_lines;
+
+        const std::string tmp_path = m_index_path + ".tmp";
+        std::ofstream out(tmp_path, std::ios::binary | std::ios::trunc);
+        out.write(reinterpret_cast<const char*>(&header), sizeof(IndexHeader));
+        out.write(reinterpret_cast<const char*>(m_offsets_storage.data()), m_num_lines * sizeof(std::uint64_t));
+        out.close();
+
+        std::error_code ec;
+        if (out)
+            sys::rename(tmp_path, m_index_path, ec);
+
+        if (!out || ec)
+        {
+            // The book is still usable, the lines are indexed again next time.
+            sys::remove(tmp_path, ec);
+            std::cout << "WARNING (opening_book): Failed to write " << m_index_path << ".\n";
+            return;
+        }
+
+        std::cout << "INFO (opening_book): Indexed " << m_num_lines << " fens in " << m_index_path << ".\n";
+    }
+
+    std::string EpdOpeningBook::get_fen(std::size_t index) const
+    {
+        assert(index < m_num_lines);
+
+        const std::uint64_t start = m_offsets[index];
+        const void* newline = std::memchr(m_data + start, '\n', m_data_size - start);
+        std::uint64_t end = newline != nullptr
+            ? static_cast<const char*>(newline) - m_data
+            : m_data_size;
+
+        if (end > start && m_data[end - 1] == '\r')
+            end -= 1;
+
+        return std::string(m_data + start, end - start);
     }
 
     static bool ends_with(const std::string& lhs, const std::string& end)
@@ -34,10 +281,15 @@ namespace Stockfish::Tools {
 
     std::unique_ptr<OpeningBook> open_opening_book(const std::string& filename, PRNG& prng)
     {
+        std::unique_ptr<OpeningBook> book;
+
         if (ends_with(filename, ".epd"))
-            return std::make_unique<EpdOpeningBook>(filename, prng);
+            book = std::make_unique<EpdOpeningBook>(filename, prng);
+
+        if (book == nullptr || book->size() == 0)
+            return nullptr;
 
-        return nullptr;
+        return book;
     }
 
 }
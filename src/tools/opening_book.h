@@ -5,54 +5,130 @@
 #include "position.h"
 #include "thread.h"
 
+#include <atomic>
 #include <vector>
 #include <random>
 #include <optional>
 #include <string>
 #include <cstdint>
 #include <memory>
-#include <mutex>
 
 namespace Stockfish::Tools {
 
+    // Pseudo-random permutation of [0, n). The index is encrypted by a
+    // small Feistel network over the smallest even number of bits that
+    // covers n, and encrypted again while it falls outside of [0, n).
+    // This shuffles a book of any size without storing the order.
+    struct IndexPermutation
+    {
+        IndexPermutation() = default;
+        IndexPermutation(std::uint64_t n, PRNG& prng);
+
+        std::uint64_t operator()(std::uint64_t index) const;
+
+    private:
+        static constexpr int NUM_ROUNDS = 4;
+
+        std::uint64_t encrypt(std::uint64_t x) const;
+
+        std::uint64_t m_size = 0;
+        int m_half_bits = 0;
+        std::uint64_t m_half_mask = 0;
+        std::uint64_t m_keys[NUM_ROUNDS] = {};
+    };
+
+    // The fens are handed out in a random order that is fixed by the
+    // prng passed on opening. next_fen() only increments an atomic
+    // cursor, so the threads don't contend for the book.
     struct OpeningBook {
 
-        const std::string& next_fen()
+        virtual ~OpeningBook() = default;
+
+        std::string next_fen()
         {
-            assert(fens.size() > 0);
+            assert(size() > 0);
 
-            std::unique_lock lock(mutex);
+            const std::uint64_t index = cursor.fetch_add(1, std::memory_order_relaxed);
+            return get_fen(permutation(index % size()));
+        }
 
-            auto& fen = fens[current_index++];
-            if (current_index >= fens.size())
-                current_index = 0;
+        virtual std::size_t size() const = 0;
 
-            return fen;
+        // Index of the fen next_fen() returns next.
+        std::size_t get_current_index() const
+        {
+            return size() == 0 ? 0 : cursor.load() % size();
         }
 
-        std::size_t size() const { return fens.size(); }
+        void set_current_index(std::size_t index)
+        {
+            cursor = size() == 0 ? 0 : index % size();
+        }
 
         const std::string& get_filename() const { return filename; }
 
     protected:
         OpeningBook(const std::string& file) :
             filename(file),
-            current_index(0)
+            cursor(0)
         {
         }
 
+        // The fen at the given position in the file order.
+        virtual std::string get_fen(std::size_t index) const = 0;
 
-        std::mutex mutex;
         std::string filename;
-        std::vector<std::string> fens;
-        std::size_t current_index;
+        IndexPermutation permutation;
+        std::atomic<std::uint64_t> cursor;
     };
 
+    // Book with one fen per line. The file is mapped instead of read, and
+    // the offsets of the lines are cached in <file>.idx, so opening a
+    // large book only costs a full scan the first time.
     struct EpdOpeningBook : OpeningBook {
 
+        static constexpr std::uint64_t INDEX_MAGIC = 0x5844494B4F4F4245ULL; // "EBOOKIDX"
+
+        struct IndexHeader
+        {
+            std::uint64_t magic;
+            std::uint64_t file_size;
+            std::int64_t file_time;
+            std::uint64_t num_lines;
+        };
+
         EpdOpeningBook(const std::string& file, PRNG& prng);
+        EpdOpeningBook(const EpdOpeningBook&) = delete;
+        EpdOpeningBook& operator=(const EpdOpeningBook&) = delete;
+        ~EpdOpeningBook() override;
+
+        std::size_t size() const override { return m_num_lines; }
+
+    protected:
+        std::string get_fen(std::size_t index) const override;
+
+    private:
+        bool map_book();
+        bool load_index(const IndexHeader& expected);
+        void build_index(const IndexHeader& expected);
+
+        std::string m_index_path;
+
+        const char* m_data = nullptr;
+        std::uint64_t m_data_size = 0;
+        const std::uint64_t* m_offsets = nullptr;
+        std::uint64_t m_num_lines = 0;
+
+        void* m_book_mapping = nullptr;
+        void* m_index_mapping = nullptr;
+        std::size_t m_index_mapped_size = 0;
+
+        // Hold the book and the offsets where they are not mapped.
+        std::string m_storage;
+        std::vector<std::uint64_t> m_offsets_storage;
     };
 
+    // Returns nullptr if the file is not a supported book or has no fens.
     std::unique_ptr<OpeningBook> open_opening_book(const std::string& filename, PRNG& prng);
 
 }
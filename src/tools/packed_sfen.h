@@ -3,6 +3,9 @@
 
 #include <vector>
 #include <cstdint>
+#include <new>
+#include <memory>
+#include <utility>
 
 namespace Stockfish::Tools {
 
@@ -40,7 +43,32 @@ namespace Stockfish::Tools {
         // 64 + 2 + 2 + 2 + 1 + 1 = 72bytes
     };
 
+    // Allocator that leaves elements constructed without arguments
+    // uninitialized, so that growing a vector that is about to be read
+    // into doesn't zero it first. Construct with PackedSfenValue{}
+    // where the entry has to start out zeroed.
+    template <typename T>
+    struct DefaultInitAllocator : std::allocator<T>
+    {
+        template <typename U>
+        struct rebind { using other = DefaultInitAllocator<U>; };
+
+        using std::allocator<T>::allocator;
+
+        template <typename U>
+        void construct(U* p) noexcept
+        {
+            ::new (static_cast<void*>(p)) U;
+        }
+
+        template <typename U, typename... Args>
+        void construct(U* p, Args&&... args)
+        {
+            ::new (static_cast<void*>(p)) U(std::forward<Args>(args)...);
+        }
+    };
+
     // Phase array: PSVector stands for packed sfen vector.
-    using PSVector = std::vector<PackedSfenValue>;
+    using PSVector = std::vector<PackedSfenValue, DefaultInitAllocator<PackedSfenValue>>;
 }
 #endif
@@ -0,0 +1,139 @@
+#include "packer_bench.h"
+
+#include "sfen_packer.h"
+#include "packed_sfen.h"
+
+#include "misc.h"
+#include "movegen.h"
+#include "position.h"
+#include "thread.h"
+#include "uci.h"
+#include "variant.h"
+
+#include <cstdint>
+#include <deque>
+#include <iostream>
+#include <string>
+#include <vector>
+
+namespace Stockfish::Tools
+{
+    struct PackerBenchParams
+    {
+        std::uint64_t num_positions = 10000;
+        std::uint64_t num_iterations = 20;
+        int max_ply = 100;
+        std::string seed = "packer_bench";
+    };
+
+    // Collects positions of random games from the start position of the current variant.
+    static std::vector<PackedSfen> random_positions(const PackerBenchParams& params)
+    {
+        const Variant* variant = variants.find(Options["UCI_Variant"])->second;
+        PRNG prng(params.seed);
+
+        std::vector<PackedSfen> sfens;
+        sfens.reserve(params.num_positions);
+
+        while (sfens.size() < params.num_positions)
+        {
+            std::deque<StateInfo> states(1);
+            Position pos;
+            pos.set(variant, variant->startFen, false, &states.back(), Threads.main());
+
+            for (int ply = 0; ply < params.max_ply && sfens.size() < params.num_positions; ++ply)
+            {
+                const MoveList<LEGAL> moves(pos);
+                if (moves.size() == 0)
+                    break;
+
+                sfens.emplace_back(sfen_pack(pos));
+
+                states.emplace_back();
+                pos.do_move(moves.begin()[prng.rand(moves.size())].move, states.back());
+            }
+        }
+
+        return sfens;
+    }
+
+    // Measures the speed of packing and unpacking positions.
+    void packer_bench(std::istringstream& is)
+    {
+        PackerBenchParams params{};
+
+        while(true)
+        {
+            std::string token;
+            is >> token;
+
+            if (token == "")
+                break;
+
+            if (token == "positions")
+                is >> params.num_positions;
+            else if (token == "iterations")
+                is >> params.num_iterations;
+            else if (token == "max_ply")
+                is >> params.max_ply;
+            else if (token == "seed")
+                is >> params.seed;
+            else
+            {
+                std::cout << "ERROR: Unknown option " << token << ". Exiting...\n";
+                return;
+            }
+        }
+
+        const auto sfens = random_positions(params);
+
+        Position pos;
+        StateInfo si;
+        std::uint64_t checksum = 0;
+
+        // Every position is processed multiple times in a row, so that
+        // the time is not dominated by cache misses on the positions.
+        const auto unpack_start = now();
+        for (const auto& sfen : sfens)
+            for (std::uint64_t i = 0; i < params.num_iterations; ++i)
+            {
+                set_from_packed_sfen(pos, sfen, &si, Threads.main());
+                checksum += pos.key();
+            }
+        const auto unpack_time = std::max<TimePoint>(now() - unpack_start, 1);
+
+        // Decoding without setting up a Position, as done by gather_statistics.
+        const Variant* variant = variants.find(Options["UCI_Variant"])->second;
+        CompactBoard board;
+        const auto decode_start = now();
+        for (const auto& sfen : sfens)
+            for (std::uint64_t i = 0; i < params.num_iterations; ++i)
+            {
+                decode_packed_sfen(sfen, variant, board);
+                checksum += board.num_pieces;
+            }
+        const auto decode_time = std::max<TimePoint>(now() - decode_start, 1);
+
+        // The positions are set up in advance, only packing is measured.
+        std::deque<Position> positions;
+        std::deque<StateInfo> states;
+        for (const auto& sfen : sfens)
+            set_from_packed_sfen(positions.emplace_back(), sfen, &states.emplace_back(), Threads.main());
+
+        const auto pack_start = now();
+        for (auto& p : positions)
+            for (std::uint64_t i = 0; i < params.num_iterations; ++i)
+                checksum += sfen_pack(p).data[i % sizeof(PackedSfen)];
+        const auto pack_time = std::max<TimePoint>(now() - pack_start, 1);
+
+        const std::uint64_t num_ops = params.num_iterations * sfens.size();
+
+        std::cout << "Variant          : " << std::string(Options["UCI_Variant"]) << '\n'
+                  << "Positions        : " << sfens.size() << '\n'
+                  << "Iterations       : " << params.num_iterations << '\n'
+                  << "Unpack (pos/s)   : " << num_ops * 1000 / unpack_time << '\n'
+                  << "Decode (pos/s)   : " << num_ops * 1000 / decode_time << '\n'
+                  << "Pack (pos/s)     : " << num_ops * 1000 / pack_time << '\n'
+                  << "Checksum         : " << checksum << '\n';
+    }
+}
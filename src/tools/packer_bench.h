@@ -0,0 +1,12 @@
+#ifndef _PACKER_BENCH_H_
+#define _PACKER_BENCH_H_
+
+#include <sstream>
+
+namespace Stockfish::Tools {
+
+    void packer_bench(std::istringstream& is);
+
+}
+
+#endif
@@ -7,9 +7,12 @@
 
 #include "uci.h"
 
+#include "nnue/nnue_architecture.h"
+
 #include <sstream>
 #include <fstream>
 #include <cstring> // std::memset()
+#include <type_traits>
 
 using namespace std;
 
@@ -17,8 +20,17 @@ namespace Stockfish::Tools {
 
     // Class that handles bitstream
     // useful when doing aspect encoding
+    //
+    // Bits are stored from the lowest to the highest of each byte.
+    // Reads load a 64-bit word at a time, except at the end of the data
+    // where it is done byte by byte. Writes are collected in a 64-bit
+    // buffer and stored 32 bits at a time, flush() must be called after
+    // the last write. A stream is used either for reading or for writing.
     struct BitStream
     {
+        // Size of the data in bytes.
+        static constexpr int size = DATA_SIZE / 8;
+
         // Set the memory to store the data in advance.
         // Assume that memory is cleared to 0.
         void set_data(std::uint8_t* data_) { data = data_; reset(); }
@@ -30,17 +42,11 @@ namespace Stockfish::Tools {
         int get_cursor() const { return bit_cursor; }
 
         // reset the cursor
-        void reset() { bit_cursor = 0; }
+        void reset() { bit_cursor = 0; write_buffer = 0; write_buffer_bits = 0; }
 
         // Write 1bit to the stream.
         // If b is non-zero, write out 1. If 0, write 0.
-        void write_one_bit(int b)
-        {
-            if (b)
-                data[bit_cursor / 8] |= 1 << (bit_cursor & 7);
-
-            ++bit_cursor;
-        }
+        void write_one_bit(int b) { write_n_bit(b != 0, 1); }
 
         // Get 1 bit from the stream.
         int read_one_bit()
@@ -51,21 +57,61 @@ namespace Stockfish::Tools {
             return b;
         }
 
-        // write n bits of data
+        // write n bits of data, n <= 32
         // Data shall be written out from the lower order of d.
         void write_n_bit(int d, int n)
         {
-            for (int i = 0; i <n; ++i)
-                write_one_bit(d & (1 << i));
+            write_buffer |= (std::uint64_t(std::uint32_t(d)) & mask(n)) << write_buffer_bits;
+            write_buffer_bits += n;
+            bit_cursor += n;
+
+            // The data size is a multiple of 4 bytes, so whole words fit.
+            if (write_buffer_bits >= 32)
+            {
+                const int byte = (bit_cursor - write_buffer_bits) / 8;
+                for (int i = 0; i < 4; ++i)
+                    data[byte + i] = std::uint8_t(write_buffer >> (8 * i));
+
+                write_buffer >>= 32;
+                write_buffer_bits -= 32;
+            }
+        }
+
+        // Stores the bits that are still buffered.
+        void flush()
+        {
+            const int byte = (bit_cursor - write_buffer_bits) / 8;
+            for (int i = 0; i * 8 < write_buffer_bits; ++i)
+                data[byte + i] = std::uint8_t(write_buffer >> (8 * i));
+
+            write_buffer = 0;
+            write_buffer_bits = 0;
         }
 
-        // read n bits of data
+        // Returns the next n bits without moving the cursor, n <= 32.
+        // Bits past the end of the data are zero.
+        int peek_n_bit(int n) const
+        {
+            const int byte = bit_cursor / 8;
+            std::uint64_t word = 0;
+
+            if (byte + 8 <= size)
+                word = load(data + byte);
+            else
+                for (int i = 0; byte + i < size; ++i)
+                    word |= std::uint64_t(data[byte + i]) << (8 * i);
+
+            return int((word >> (bit_cursor & 7)) & mask(n));
+        }
+
+        void skip_n_bit(int n) { bit_cursor += n; }
+
+        // read n bits of data, n <= 32
         // Reverse conversion of write_n_bit().
         int read_n_bit(int n)
         {
-            int result = 0;
-            for (int i = 0; i < n; ++i)
-                result |= read_one_bit() ? (1 << i) : 0;
+            const int result = peek_n_bit(n);
+            bit_cursor += n;
 
             return result;
         }
@@ -74,10 +120,26 @@ namespace Stockfish::Tools {
         // Next bit position to read/write.
         int bit_cursor;
 
+        // Bits written after the last stored word, starting at a 32-bit boundary.
+        std::uint64_t write_buffer;
+        int write_buffer_bits;
+
         // data entity
         std::uint8_t* data;
+
+        static constexpr std::uint64_t mask(int n) { return (std::uint64_t(1) << n) - 1; }
+
+        // Little endian load, compiles to a single instruction where possible.
+        static std::uint64_t load(const std::uint8_t* p)
+        {
+            using u64 = std::uint64_t;
+            return u64(p[0])       | u64(p[1]) << 8  | u64(p[2]) << 16 | u64(p[3]) << 24
+                 | u64(p[4]) << 32 | u64(p[5]) << 40 | u64(p[6]) << 48 | u64(p[7]) << 56;
+        }
     };
 
+    struct PieceCodes;
+
     // Class for compressing/decompressing sfen
     // sfen can be packed to 256bit (32bytes) by Huffman coding.
     // This is proven by mini. The above is Huffman coding.
@@ -104,14 +166,14 @@ namespace Stockfish::Tools {
 
         BitStream stream;
 
-        // Used to determine how many bits per piece to write/read.
-        int pieceTypeCount;
+        // Huffman codes of the pieces of the variant.
+        const PieceCodes* codes;
 
         // Output the board pieces to stream.
-        void write_board_piece_to_stream(const Position& pos, Piece pc);
+        void write_board_piece_to_stream(Piece pc);
 
         // Read one board piece from stream
-        Piece read_board_piece_from_stream(const Position& pos);
+        Piece read_board_piece_from_stream();
     };
 
 
@@ -202,18 +264,86 @@ namespace Stockfish::Tools {
         {0b111111,6}, //
     };
 
-    inline Square to_variant_square(Square s, const Position& pos) {
-        return Square(s - rank_of(s) * (FILE_MAX - pos.max_file()));
+    // Huffman codes of the pieces of a variant, including the color bit.
+    // The tables depend on the piece types of the variant, so they are
+    // built once per thread when the variant changes.
+    struct PieceCodes
+    {
+        // Longest code: 6 bits for the piece type + 1 bit for the color.
+        static constexpr int max_bits = 7;
+
+        struct DecodedPiece
+        {
+            Piece piece;
+            int bits; // 0 for invalid codes
+        };
+
+        // Indexed by the next max_bits bits of the stream.
+        DecodedPiece decode[1 << max_bits];
+
+        HuffmanedPiece encode[PIECE_NB];
+
+        const Variant* variant = nullptr;
+        PieceSet piece_types = NO_PIECE_SET;
+
+        void init(const Variant* v)
+        {
+            variant = v;
+            piece_types = v->pieceTypes;
+
+            const bool large = popcount(v->pieceTypes) > 16;
+
+            for (auto& d : decode)
+                d = { NO_PIECE, 0 };
+            for (auto& e : encode)
+                e = { 0, 0 };
+
+            add(NO_PIECE, large ? huffman_table6[0] : huffman_table5[0]);
+
+            for (PieceSet ps = v->pieceTypes; ps;)
+            {
+                const PieceType pt = pop_lsb(ps);
+                const int pr = v->pieceIndex[pt] + 1;
+                const HuffmanedPiece hp = large ? huffman_table6[pr] : huffman_table5[pr];
+
+                for (Color c : { WHITE, BLACK })
+                    add(make_piece(c, pt), { hp.code | (c << hp.bits), hp.bits + 1 });
+            }
+        }
+
+    private:
+        void add(Piece pc, HuffmanedPiece hp)
+        {
+            encode[pc] = hp;
+
+            // All entries that start with the code.
+            for (int rest = 0; rest < (1 << (max_bits - hp.bits)); ++rest)
+                decode[hp.code | (rest << hp.bits)] = { pc, hp.bits };
+        }
+    };
+
+    static const PieceCodes& piece_codes(const Variant* v)
+    {
+        thread_local PieceCodes codes;
+
+        if (codes.variant != v || codes.piece_types != v->pieceTypes)
+            codes.init(v);
+
+        return codes;
     }
 
-    inline Square from_variant_square(Square s, const Position& pos) {
-        return Square(s + s / pos.files() * (FILE_MAX - pos.max_file()));
+    inline Square to_variant_square(Square s, const Variant* v) {
+        return Square(s - rank_of(s) * (FILE_MAX - v->maxFile));
+    }
+
+    inline Square from_variant_square(Square s, const Variant* v) {
+        return Square(s + s / (v->maxFile + 1) * (FILE_MAX - v->maxFile));
     }
 
     // Pack sfen and store in data[64].
     void SfenPacker::pack(const Position& pos)
     {
-        pieceTypeCount = popcount(pos.variant()->pieceTypes);
+        codes = &piece_codes(pos.variant());
 
         memset(data, 0, DATA_SIZE / 8 /* 512bit */);
         stream.set_data(data);
@@ -225,7 +355,7 @@ namespace Stockfish::Tools {
         // 7-bit positions for leading and trailing balls
         // White king and black king, 6 bits for each.
         for(auto c: Colors)
-            stream.write_n_bit(pos.nnue_king() ? to_variant_square(pos.king_square(c), pos) : (pos.max_file() + 1) * (pos.max_rank() + 1), 7);
+            stream.write_n_bit(pos.nnue_king() ? to_variant_square(pos.king_square(c), pos.variant()) : (pos.max_file() + 1) * (pos.max_rank() + 1), 7);
 
         // Write the pieces on the board other than the kings.
         for (Rank r = pos.max_rank(); r >= RANK_1; --r)
@@ -235,7 +365,7 @@ namespace Stockfish::Tools {
                 Piece pc = pos.piece_on(make_square(f, r));
                 if (pos.nnue_king() && type_of(pc) == pos.nnue_king())
                     continue;
-                write_board_piece_to_stream(pos, pc);
+                write_board_piece_to_stream(pc);
             }
         }
 
@@ -255,7 +385,7 @@ namespace Stockfish::Tools {
         else {
             stream.write_one_bit(1);
             // Additional ep squares (e.g., for berolina) are not encoded
-            stream.write_n_bit(static_cast<int>(to_variant_square(lsb(pos.ep_squares()), pos)), 7);
+            stream.write_n_bit(static_cast<int>(to_variant_square(lsb(pos.ep_squares()), pos.variant())), 7);
         }
 
         stream.write_n_bit(pos.state()->rule50, 6);
@@ -273,62 +403,29 @@ namespace Stockfish::Tools {
         // This bit is just ignored by the old parsers.
         stream.write_n_bit(pos.state()->rule50 >> 6, 1);
 
+        stream.flush();
+
         assert(stream.get_cursor() <= DATA_SIZE);
     }
 
     // Output the board pieces to stream.
-    void SfenPacker::write_board_piece_to_stream(const Position& pos, Piece pc)
+    void SfenPacker::write_board_piece_to_stream(Piece pc)
     {
-        // piece type
-        PieceType pr = PieceType(pc == NO_PIECE ? NO_PIECE_TYPE : pos.variant()->pieceIndex[type_of(pc)] + 1);
-        auto c = (pieceTypeCount > 16) ? huffman_table6[pr] : huffman_table5[pr];
-        stream.write_n_bit(c.code, c.bits);
-
-        if (pc == NO_PIECE)
-            return;
-
-        // first and second flag
-        stream.write_one_bit(color_of(pc));
+        const HuffmanedPiece hp = codes->encode[pc];
+        stream.write_n_bit(hp.code, hp.bits);
     }
 
     // Read one board piece from stream
-    Piece SfenPacker::read_board_piece_from_stream(const Position& pos)
+    Piece SfenPacker::read_board_piece_from_stream()
     {
-        PieceType pr = NO_PIECE_TYPE;
-        HuffmanedPiece hp;
-        int code = 0, bits = 0;
-        while (true)
-        {
-            code |= stream.read_one_bit() << bits;
-            ++bits;
-
-            assert(bits <= ((pieceTypeCount > 16) ? 7 : 6 ));
-
-            for (pr = NO_PIECE_TYPE; pr <= 26; ++pr)
-            {
-                hp = (pieceTypeCount > 16) ? huffman_table6[pr] : huffman_table5[pr];
-                if (hp.code == code && hp.bits == bits)
-                    goto Found;
-            }
-        }
-    Found:;
-        if (pr == NO_PIECE_TYPE)
-            return NO_PIECE;
-
-        // first and second flag
-        Color c = (Color)stream.read_one_bit();
+        const auto d = codes->decode[stream.peek_n_bit(PieceCodes::max_bits)];
+        assert(d.bits != 0);
 
-        for(PieceSet ps = pos.piece_types(); ps;)
-        {
-            PieceType pt = pop_lsb(ps);
-            if (pos.variant()->pieceIndex[pt] + 1 == pr)
-                return make_piece(c, pt);
-        }
-        assert(false);
-        return NO_PIECE;
+        stream.skip_n_bit(std::max(d.bits, 1));
+        return d.piece;
     }
 
-    int set_from_packed_sfen(Position& pos, const PackedSfen& sfen, StateInfo* si, Thread* th)
+    int decode_packed_sfen(const PackedSfen& sfen, const Variant* variant, CompactBoard& board)
     {
         SfenPacker packer;
         auto& stream = packer.stream;
@@ -337,108 +434,181 @@ namespace Stockfish::Tools {
         // const_cast which is not safe in the long run.
         stream.set_data(const_cast<uint8_t*>(reinterpret_cast<const uint8_t*>(&sfen)));
 
-        pos.clear();
-        std::memset(si, 0, sizeof(StateInfo));
-        si->accumulator.computed[WHITE] = false;
-        si->accumulator.computed[BLACK] = false;
-        pos.st = si;
-        pos.var = variants.find(Options["UCI_Variant"])->second;
+        packer.codes = &piece_codes(variant);
 
+        std::memset(board.board, 0, sizeof(board.board));
+        std::memset(board.hand, 0, sizeof(board.hand));
+        std::memset(board.piece_count, 0, sizeof(board.piece_count));
 
         // Active color
-        pos.sideToMove = (Color)stream.read_one_bit();
+        board.side_to_move = (Color)stream.read_one_bit();
 
         // First the position of the ball
+        // Variants without a king store a placeholder square.
+        const PieceType king = variant->nnueKing;
         for (auto c : Colors)
-            pos.board[from_variant_square(Square(stream.read_n_bit(7)), pos)] = make_piece(c, pos.nnue_king());
+        {
+            const Square ksq = from_variant_square(Square(stream.read_n_bit(7)), variant);
+            if (!king)
+                board.king_squares[c] = SQ_NONE;
+            else if (ksq < SQUARE_NB)
+            {
+                board.king_squares[c] = ksq;
+                board.board[ksq] = make_piece(c, king);
+            }
+            else
+                return 1;
+        }
 
-        // Piece placement
-        for (Rank r = pos.max_rank(); r >= RANK_1; --r)
+        // Piece placement, the kings are already on the board.
+        board.num_pieces = 0;
+        for (Rank r = variant->maxRank; r >= RANK_1; --r)
         {
-            for (File f = FILE_A; f <= pos.max_file(); ++f)
+            for (File f = FILE_A; f <= variant->maxFile; ++f)
             {
-                auto sq = make_square(f, r);
-
-                // it seems there are already balls
-                Piece pc;
-                if (type_of(pos.board[sq]) != pos.nnue_king())
-                {
-                    assert(pos.board[sq] == NO_PIECE);
-                    pc = packer.read_board_piece_from_stream(pos);
-                }
-                else
-                {
-                    pc = pos.board[sq];
-                    // put_piece() will catch ASSERT unless you remove it all.
-                    pos.board[sq] = NO_PIECE;
-                }
+                const Square sq = make_square(f, r);
+
+                Piece pc = board.board[sq];
+                if (pc == NO_PIECE)
+                    pc = board.board[sq] = packer.read_board_piece_from_stream();
 
                 // There may be no pieces, so skip in that case.
                 if (pc == NO_PIECE)
                     continue;
 
-                pos.put_piece(Piece(pc), sq);
+                board.squares[board.num_pieces] = sq;
+                board.pieces[board.num_pieces] = pc;
+                board.num_pieces += 1;
+                board.piece_count[color_of(pc)][type_of(pc)] += 1;
 
-                if (stream.get_cursor()> 512)
+                if (stream.get_cursor() > DATA_SIZE)
                     return 1;
             }
         }
 
+        // Pieces in hand, in the same order as written by pack().
+        for (auto c : Colors)
+            for (PieceSet ps = variant->pieceTypes; ps;)
+                board.hand[c][pop_lsb(ps)] = stream.read_n_bit(DATA_SIZE > 512 ? 7 : 5);
+
         // Castling availability.
         // TODO(someone): Support chess960.
-        pos.st->castlingRights = 0;
-        if (stream.read_one_bit()) {
-            Square rsq;
-            for (rsq = relative_square(WHITE, SQ_H1); pos.piece_on(rsq) != W_ROOK; --rsq) {}
-            pos.set_castling_right(WHITE, rsq);
-        }
-        if (stream.read_one_bit()) {
-            Square rsq;
-            for (rsq = relative_square(WHITE, SQ_A1); pos.piece_on(rsq) != W_ROOK; ++rsq) {}
-            pos.set_castling_right(WHITE, rsq);
-        }
-        if (stream.read_one_bit()) {
-            Square rsq;
-            for (rsq = relative_square(BLACK, SQ_H1); pos.piece_on(rsq) != B_ROOK; --rsq) {}
-            pos.set_castling_right(BLACK, rsq);
-        }
-        if (stream.read_one_bit()) {
-            Square rsq;
-            for (rsq = relative_square(BLACK, SQ_A1); pos.piece_on(rsq) != B_ROOK; ++rsq) {}
-            pos.set_castling_right(BLACK, rsq);
-        }
+        board.castling_rights = 0;
+        for (CastlingRights cr : { WHITE_OO, WHITE_OOO, BLACK_OO, BLACK_OOO })
+            if (stream.read_one_bit())
+                board.castling_rights |= cr;
 
         // En passant square.
-        if (stream.read_one_bit()) {
-            Square ep_square = static_cast<Square>(stream.read_n_bit(7));
-            pos.st->epSquares = square_bb(ep_square);
-        }
-        else {
-            pos.st->epSquares = 0;
-        }
+        board.ep_square = stream.read_one_bit() ? from_variant_square(static_cast<Square>(stream.read_n_bit(7)), variant)
+                                                : SQ_NONE;
 
         // Halfmove clock
-        pos.st->rule50 = stream.read_n_bit(6);
+        board.rule50 = stream.read_n_bit(6);
 
         // Fullmove number
-        pos.gamePly = stream.read_n_bit(8);
+        int fm = stream.read_n_bit(8);
 
-        // Read the highest bit of rule50. This was added as a fix for rule50
-        // counter having only 6 bits stored.
-        // In older entries this will just be a zero bit.
-        pos.gamePly |= stream.read_n_bit(8) << 8;
+        // Read the high bits of the fullmove number. This was added as a fix
+        // for the limited range of the counter.
+        // In older entries this will just be zero.
+        fm |= stream.read_n_bit(8) << 8;
 
         // Read the highest bit of rule50. This was added as a fix for rule50
         // counter having only 6 bits stored.
         // In older entries this will just be a zero bit.
-        pos.st->rule50 |= stream.read_n_bit(1) << 6;
+        board.rule50 |= stream.read_n_bit(1) << 6;
 
         // Convert from fullmove starting from 1 to gamePly starting from 0,
         // handle also common incorrect FEN with fullmove = 0.
-        pos.gamePly = std::max(2 * (pos.gamePly - 1), 0) + (pos.sideToMove == BLACK);
+        board.game_ply = std::max(2 * (fm - 1), 0) + (board.side_to_move == BLACK);
 
         assert(stream.get_cursor() <= DATA_SIZE);
 
+        return 0;
+    }
+
+    void append_active_indices(
+        const CompactBoard& board,
+        const Variant* variant,
+        Color perspective,
+        ValueListInserter<std::uint32_t> active)
+    {
+        static_assert(std::is_same_v<Eval::NNUE::IndexType, std::uint32_t>);
+
+        Eval::NNUE::FeatureSet::append_active_indices(
+            variant,
+            perspective,
+            board.king_squares[perspective],
+            board.squares,
+            board.pieces,
+            board.num_pieces,
+            board.hand,
+            active);
+    }
+
+    int set_from_packed_sfen(Position& pos, const PackedSfen& sfen, StateInfo* si, Thread* th)
+    {
+        const Variant* variant = variants.find(Options["UCI_Variant"])->second;
+
+        CompactBoard board;
+        if (decode_packed_sfen(sfen, variant, board) != 0)
+            return 1;
+
+        pos.clear();
+        std::memset(si, 0, sizeof(StateInfo));
+        si->accumulator.computed[WHITE] = false;
+        si->accumulator.computed[BLACK] = false;
+        pos.st = si;
+        pos.var = variant;
+
+        pos.sideToMove = board.side_to_move;
+
+        for (int i = 0; i < board.num_pieces; ++i)
+            pos.put_piece(board.pieces[i], board.squares[i]);
+
+        for (auto c : Colors)
+            for (PieceSet ps = pos.piece_types(); ps;)
+            {
+                const PieceType pt = pop_lsb(ps);
+                for (int n = board.hand[c][pt]; n > 0; --n)
+                    pos.add_to_hand(make_piece(c, pt));
+            }
+
+        // Castling availability.
+        // The rooks and the castling king are located the same way
+        // as for the K/Q flags in Position::set().
+        // TODO(someone): Support chess960.
+        pos.st->castlingRights = 0;
+        pos.st->castlingKingSquare[WHITE] = pos.st->castlingKingSquare[BLACK] = SQ_NONE;
+        auto set_castling_right = [&](Color c, bool kingSide) {
+            Square rsq;
+            if (kingSide)
+                for (rsq = make_square(pos.var->castlingRookKingsideFile, pos.castling_rank(c)); !(pos.castling_rook_pieces(c) & type_of(pos.piece_on(rsq))) || color_of(pos.piece_on(rsq)) != c; --rsq) {}
+            else
+                for (rsq = make_square(pos.var->castlingRookQueensideFile, pos.castling_rank(c)); !(pos.castling_rook_pieces(c) & type_of(pos.piece_on(rsq))) || color_of(pos.piece_on(rsq)) != c; ++rsq) {}
+
+            if (pos.st->castlingKingSquare[c] == SQ_NONE)
+            {
+                Bitboard castlingKings = pos.pieces(c, pos.castling_king_piece(c)) & rank_bb(pos.castling_rank(c));
+                pos.st->castlingKingSquare[c] = castlingKings && !more_than_one(castlingKings) ? lsb(castlingKings)
+                                              : make_square(pos.castling_king_file(), pos.castling_rank(c));
+            }
+
+            pos.set_castling_right(c, rsq);
+        };
+        if (board.castling_rights & WHITE_OO)
+            set_castling_right(WHITE, true);
+        if (board.castling_rights & WHITE_OOO)
+            set_castling_right(WHITE, false);
+        if (board.castling_rights & BLACK_OO)
+            set_castling_right(BLACK, true);
+        if (board.castling_rights & BLACK_OOO)
+            set_castling_right(BLACK, false);
+
+        pos.st->epSquares = board.ep_square != SQ_NONE ? square_bb(board.ep_square) : Bitboard(0);
+        pos.st->rule50 = board.rule50;
+        pos.gamePly = board.game_ply;
+
         pos.chess960 = false;
         pos.thisThread = th;
         pos.set_state(pos.st);
@@ -448,7 +618,7 @@ namespace Stockfish::Tools {
         return 0;
     }
 
-    PackedSfen sfen_pack(Position& pos)
+    PackedSfen sfen_pack(const Position& pos)
     {
         PackedSfen sfen;
 
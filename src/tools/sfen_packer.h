@@ -1,6 +1,7 @@
 #ifndef _SFEN_PACKER_H_
 #define _SFEN_PACKER_H_
 
+#include "misc.h"
 #include "types.h"
 
 #include "packed_sfen.h"
@@ -11,12 +12,57 @@ namespace Stockfish {
     class Position;
     struct StateInfo;
     class Thread;
+    struct Variant;
 }
 
 namespace Stockfish::Tools {
 
+    // A position decoded from a PackedSfen without setting up a Position.
+    // It holds what is stored in the packed sfen, so it is much cheaper
+    // to get, but there are no bitboards, keys or check information.
+    struct CompactBoard
+    {
+        Color side_to_move;
+
+        // Pieces on the board, including the kings, in the order they are
+        // stored: from the highest rank down, each rank from file A up.
+        int num_pieces;
+        Square squares[SQUARE_NB];
+        Piece pieces[SQUARE_NB];
+
+        Piece board[SQUARE_NB];
+
+        // Number of pieces in hand, and on the board.
+        int hand[COLOR_NB][PIECE_TYPE_NB];
+        int piece_count[COLOR_NB][PIECE_TYPE_NB];
+
+        // Squares of the nnue kings, SQ_NONE if the variant has none.
+        Square king_squares[COLOR_NB];
+
+        // WHITE_OO | WHITE_OOO | BLACK_OO | BLACK_OOO flags.
+        int castling_rights;
+        Square ep_square;
+        int rule50;
+        int game_ply;
+
+        Piece piece_on(Square sq) const { return board[sq]; }
+        int count(Color c, PieceType pt) const { return piece_count[c][pt]; }
+        int count_in_hand(Color c, PieceType pt) const { return hand[c][pt]; }
+    };
+
+    // Returns 0 on success, 1 if the data is malformed.
+    int decode_packed_sfen(const PackedSfen& sfen, const Variant* variant, CompactBoard& board);
+
+    // Appends the HalfKAv2Variants feature indices of the board
+    // from the given perspective, the same as for a Position.
+    void append_active_indices(
+        const CompactBoard& board,
+        const Variant* variant,
+        Color perspective,
+        ValueListInserter<std::uint32_t> active);
+
     int set_from_packed_sfen(Position& pos, const PackedSfen& sfen, StateInfo* si, Thread* th);
-    PackedSfen sfen_pack(Position& pos);
+    PackedSfen sfen_pack(const Position& pos);
 }
 
-#endif
\ No newline at end of file
+#endif
@@ -1,19 +1,21 @@
 #include "sfen_stream.h"
 
 #include "packed_sfen.h"
+#include "blocking_queue.h"
 
 #include "misc.h"
 
+#include <algorithm>
 #include <string>
 #include <vector>
 #include <deque>
 #include <memory>
-#include <mutex>
-#include <list>
 #include <atomic>
+#include <mutex>
 #include <optional>
 #include <iostream>
 #include <cstdint>
+#include <cstring>
 #include <thread>
 #include <functional>
 
@@ -22,7 +24,12 @@ namespace Stockfish::Tools{
     enum struct SfenReaderMode
     {
         Sequential,
-        Cyclic
+        Cyclic,
+
+        // Reads whole chunks picked at random from all files, endlessly.
+        // Every chunk has the same probability. Requires formats
+        // with random chunk access, see BasicSfenInputStream::num_chunks().
+        RandomChunks
     };
 
     // Sfen reader
@@ -46,7 +53,8 @@ namespace Stockfish::Tools{
             int thread_num,
             const std::string& seed,
             size_t read_size = DEFAULT_SFEN_READ_SIZE,
-            size_t buffer_size = DEFAULT_THREAD_BUFFER_SIZE
+            size_t buffer_size = DEFAULT_THREAD_BUFFER_SIZE,
+            int num_decode_threads = 1
         ) :
             filenames(filenames_.begin(), filenames_.end()),
             mode(mode_),
@@ -54,26 +62,58 @@ namespace Stockfish::Tools{
             // the read size must be at least twice the buffer size.
             sfen_read_size(std::max(read_size, buffer_size * 2)),
             thread_buffer_size(buffer_size),
-            prng(seed)
+            prng(seed),
+            // One read chunk can be buffered while the next one is being
+            // read from the file, same as the old polling scheme.
+            packed_sfens_pool((sfen_read_size + thread_buffer_size - 1) / thread_buffer_size)
         {
             packed_sfens.resize(thread_num);
             total_read = 0;
             end_of_files = false;
             shuffle = do_shuffle;
             stop_flag = false;
-            num_buffers_in_pool.store(0);
 
-            file_worker_thread = std::thread([&] {
-                this->file_read_worker();
-            });
+            // Each decode thread works on its own file, so there is
+            // no point in having more threads than files,
+            // unless the chunks are sampled at random.
+            if (mode == SfenReaderMode::RandomChunks)
+            {
+                num_decode_threads = std::max(num_decode_threads, 1);
+                init_chunk_table();
+            }
+            else
+                num_decode_threads = std::clamp(num_decode_threads, 1, std::max(1, (int)filenames.size()));
+
+            num_active_decoders = num_decode_threads;
+
+            // The read size is split between the decode threads
+            // so that the memory usage does not depend on their number.
+            decode_read_size = std::max(sfen_read_size / num_decode_threads, thread_buffer_size);
+
+            for (int i = 0; i < num_decode_threads; ++i)
+            {
+                // Every decode thread shuffles with its own generator.
+                PRNG decoder_prng(prng.next_random_seed());
+
+                file_worker_threads.emplace_back([this, decoder_prng]() mutable {
+                    if (mode == SfenReaderMode::RandomChunks)
+                        this->random_chunk_worker(decoder_prng);
+                    else
+                        this->file_read_worker(decoder_prng);
+                });
+            }
         }
 
         ~SfenReader()
         {
             stop_flag = true;
 
-            if (file_worker_thread.joinable())
-                file_worker_thread.join();
+            // Wakes up the file workers if they're waiting for free space.
+            packed_sfens_pool.close();
+
+            for (auto& th : file_worker_threads)
+                if (th.joinable())
+                    th.join();
         }
 
         // Load the phase for calculation such as mse.
@@ -135,43 +175,41 @@ namespace Stockfish::Tools{
         }
 
         // [ASYNC] Read some aspects into thread buffer.
+        // Blocks until the file worker provides a buffer.
+        // Returns false only when all files have been read
+        // and the pool is drained.
         bool read_to_thread_buffer_impl(size_t thread_id)
         {
-            while (true)
-            {
-                {
-                    std::unique_lock<std::mutex> lk(mutex);
-                    // If you can fill from the file buffer, that's fine.
-                    if (packed_sfens_pool.size() != 0)
-                    {
-                        // It seems that filling is possible, so fill and finish.
-
-                        packed_sfens[thread_id] = std::move(packed_sfens_pool.front());
-                        packed_sfens_pool.pop_front();
-                        num_buffers_in_pool.fetch_sub(1);
-
-                        total_read += thread_buffer_size;
+            auto buf = packed_sfens_pool.pop();
+            if (!buf.has_value())
+                return false;
 
-                        return true;
-                    }
-                }
+            total_read += (*buf)->size();
+            packed_sfens[thread_id] = std::move(*buf);
 
-                // The file to read is already gone. No more use.
-                if (end_of_files)
-                    return false;
+            return true;
+        }
 
-                // Waiting for file worker to fill packed_sfens_pool.
-                // The mutex isn't locked, so it should fill up soon.
-                // Poor man's condition variable.
-                sleep(1);
-            }
+        // Time the consumers spent waiting for the file worker.
+        BoundedBlockingQueue<std::unique_ptr<PSVector>>::WaitStats get_consumer_wait_stats() const
+        {
+            return packed_sfens_pool.get_pop_wait_stats();
+        }
 
+        // Time the file workers spent waiting for the consumers.
+        BoundedBlockingQueue<std::unique_ptr<PSVector>>::WaitStats get_producer_wait_stats() const
+        {
+            return packed_sfens_pool.get_push_wait_stats();
         }
 
-        void file_read_worker()
+        // Decodes the files one after another and adds the positions
+        // to the pool. Multiple workers can run concurrently, each
+        // taking the next file from the shared queue of filenames.
+        void file_read_worker(PRNG& local_prng)
         {
             std::string currentFilename;
             uint64_t numEntriesReadFromCurrentFile = 0;
+            std::unique_ptr<BasicSfenInputStream> sfen_input_stream;
 
             auto open_next_file = [&]() {
                 // no more
@@ -179,12 +217,16 @@ namespace Stockfish::Tools{
                 {
                     sfen_input_stream.reset();
 
-                    if (filenames.empty())
-                        return false;
+                    {
+                        std::unique_lock<std::mutex> lk(filenames_mutex);
 
-                    // Get the next file name.
-                    currentFilename = filenames.front();
-                    filenames.pop_front();
+                        if (filenames.empty())
+                            return false;
+
+                        // Get the next file name.
+                        currentFilename = filenames.front();
+                        filenames.pop_front();
+                    }
 
                     numEntriesReadFromCurrentFile = 0;
 
@@ -212,52 +254,53 @@ namespace Stockfish::Tools{
                 }
             };
 
-            if (sfen_input_stream == nullptr && !open_next_file())
+            // The last worker to finish closes the pool so that the consumers
+            // can drain it and get notified about the end of files.
+            auto finish = [&]() {
+                if (num_active_decoders.fetch_sub(1) == 1)
+                {
+                    auto out = sync_region_cout.new_region();
+                    out << "INFO (sfen_reader): End of files." << std::endl;
+                    end_of_files = true;
+                    packed_sfens_pool.close();
+                }
+            };
+
+            if (!open_next_file())
             {
-                auto out = sync_region_cout.new_region();
-                out << "INFO (sfen_reader): End of files." << std::endl;
-                end_of_files = true;
+                finish();
                 return;
             }
 
-            // We want to set the `end_of_files` only after we read everything AND copy to the buffer pool.
             bool local_end_of_files = false;
             while (!local_end_of_files)
             {
-                // Wait for the buffer to run out.
-                // This size() is read only, so you don't need to lock it.
-                while (!stop_flag && num_buffers_in_pool.load() >= sfen_read_size / thread_buffer_size)
-                    sleep(100);
-
                 if (stop_flag)
                     return;
 
                 PSVector sfens;
-                sfens.reserve(sfen_read_size);
+                sfens.reserve(decode_read_size);
 
                 // Read from the file into the file buffer.
-                while (sfens.size() < sfen_read_size)
+                while (sfens.size() < decode_read_size)
                 {
-                    std::optional<PackedSfenValue> p = sfen_input_stream->next();
-                    if (p.has_value())
-                    {
-                        sfens.push_back(*p);
-                        ++numEntriesReadFromCurrentFile;
-                    }
-                    else
+                    const size_t num_requested = decode_read_size - sfens.size();
+                    const size_t num_read = sfen_input_stream->next_n(sfens, num_requested);
+                    numEntriesReadFromCurrentFile += num_read;
+
+                    if (num_read < num_requested)
                     {
                         if (mode == SfenReaderMode::Cyclic
                             && numEntriesReadFromCurrentFile > 0)
                         {
                             // The file contained data so we add it again to the end of the queue.
+                            std::unique_lock<std::mutex> lk(filenames_mutex);
                             filenames.emplace_back(currentFilename);
                         }
 
                         if(!open_next_file())
                         {
                             // There was no next file. Abort.
-                            auto out = sync_region_cout.new_region();
-                            out << "INFO (sfen_reader): End of files." << std::endl;
                             local_end_of_files = true;
                             break;
                         }
@@ -267,10 +310,9 @@ namespace Stockfish::Tools{
                 // Shuffle the read phase data.
                 if (shuffle)
                 {
-                    Algo::shuffle(sfens, prng);
+                    Algo::shuffle(sfens, local_prng);
                 }
 
-                std::vector<std::unique_ptr<PSVector>> buffers;
                 for (size_t offset = 0; offset < sfens.size(); offset += thread_buffer_size)
                 {
                     const size_t count =
@@ -286,33 +328,130 @@ namespace Stockfish::Tools{
                         &sfens[offset],
                         sizeof(PackedSfenValue) * count);
 
-                    buffers.emplace_back(std::move(buf));
+                    // Blocks while the pool is full.
+                    // Fails only when the reader is being destroyed.
+                    if (!packed_sfens_pool.push(std::move(buf)))
+                        return;
                 }
+            }
+
+            finish();
+        }
 
+        // Finds the number of chunks in every file, for RandomChunks mode.
+        void init_chunk_table()
+        {
+            size_t total = 0;
+            for (const auto& filename : filenames)
+            {
+                auto in = open_sfen_input_file(filename);
+                const size_t n = in != nullptr ? in->num_chunks() : 0;
+
+                auto out = sync_region_cout.new_region();
+                if (n == 0)
+                {
+                    out << "INFO (sfen_reader): No chunks to sample from in " << filename << '\n';
+                    continue;
+                }
+
+                out << "INFO (sfen_reader): " << n << " chunks in " << filename << '\n';
+
+                total += n;
+                chunk_filenames.emplace_back(filename);
+                chunk_count_prefix_sums.emplace_back(total);
+            }
+        }
+
+        // Decodes chunks picked at random until the reader is destroyed.
+        // Each worker has its own streams, so they can seek independently.
+        void random_chunk_worker(PRNG& local_prng)
+        {
+            auto finish = [&]() {
+                if (num_active_decoders.fetch_sub(1) == 1)
+                {
+                    end_of_files = true;
+                    packed_sfens_pool.close();
+                }
+            };
+
+            const size_t total_chunks = chunk_count_prefix_sums.empty() ? 0 : chunk_count_prefix_sums.back();
+            if (total_chunks == 0)
+            {
+                finish();
+                return;
+            }
+
+            std::vector<std::unique_ptr<BasicSfenInputStream>> streams(chunk_filenames.size());
+
+            while (!stop_flag)
+            {
+                PSVector sfens;
+                sfens.reserve(decode_read_size + BIN_CHUNK_NUM_ENTRIES);
+
+                while (sfens.size() < decode_read_size)
                 {
-                    std::unique_lock<std::mutex> lk(mutex);
+                    const size_t chunk = local_prng.rand(total_chunks);
+                    const size_t file_id = std::upper_bound(
+                        chunk_count_prefix_sums.begin(), chunk_count_prefix_sums.end(), chunk)
+                        - chunk_count_prefix_sums.begin();
+                    const size_t first_chunk = file_id == 0 ? 0 : chunk_count_prefix_sums[file_id - 1];
+
+                    auto& stream = streams[file_id];
+                    if (stream == nullptr)
+                    {
+                        stream = open_sfen_input_file(chunk_filenames[file_id]);
 
-                    // The mutex lock is required because the%
-                    // contents of packed_sfens_pool are changed.
+                        // The file was readable when the chunks were counted.
+                        if (stream == nullptr)
+                        {
+                            auto out = sync_region_cout.new_region();
+                            out << "ERROR (sfen_reader): Could not open " << chunk_filenames[file_id] << '\n';
+                            finish();
+                            return;
+                        }
+                    }
+
+                    const size_t num_before = sfens.size();
+                    stream->read_chunk(chunk - first_chunk, sfens);
 
-                    for (auto& buf : buffers)
+                    // Should not happen for a valid file, don't spin forever on it.
+                    if (sfens.size() == num_before)
                     {
-                        num_buffers_in_pool.fetch_add(1);
-                        packed_sfens_pool.emplace_back(std::move(buf));
+                        auto out = sync_region_cout.new_region();
+                        out << "ERROR (sfen_reader): Could not read chunk " << chunk - first_chunk
+                            << " of " << chunk_filenames[file_id] << '\n';
+                        finish();
+                        return;
                     }
                 }
-            }
 
-            end_of_files = true;
+                // Entries of a chunk are consecutive, mix the chunks.
+                if (shuffle)
+                {
+                    Algo::shuffle(sfens, local_prng);
+                }
+
+                for (size_t offset = 0; offset < sfens.size(); offset += thread_buffer_size)
+                {
+                    const size_t count = std::min(thread_buffer_size, sfens.size() - offset);
+
+                    auto buf = std::make_unique<PSVector>(sfens.begin() + offset, sfens.begin() + offset + count);
+
+                    if (!packed_sfens_pool.push(std::move(buf)))
+                        return;
+                }
+            }
         }
 
     protected:
 
-        // worker thread reading file in background
-        std::thread file_worker_thread;
+        // worker threads reading and decoding files in background
+        std::vector<std::thread> file_worker_threads;
 
         // sfen files
+        // * Lock filenames_mutex when accessing, the file workers share it.
         std::deque<std::string> filenames;
+        std::mutex filenames_mutex;
 
         std::atomic<bool> stop_flag;
 
@@ -327,26 +466,30 @@ namespace Stockfish::Tools{
         size_t sfen_read_size;
         size_t thread_buffer_size;
 
-        // Random number to shuffle when reading the phase
+        // Number of positions read at once by each file worker.
+        size_t decode_read_size;
+
+        // Random number used to seed the generators of the file workers.
         PRNG prng;
 
         // Did you read the files and reached the end?
         std::atomic<bool> end_of_files;
 
-        // handle of sfen file
-        std::unique_ptr<BasicSfenInputStream> sfen_input_stream;
+        // Number of file workers that did not reach the end of files yet.
+        std::atomic<int> num_active_decoders;
+
+        // Files with random chunk access and the running total of their
+        // number of chunks, for RandomChunks mode.
+        std::vector<std::string> chunk_filenames;
+        std::vector<size_t> chunk_count_prefix_sums;
 
         // sfen for each thread
         // (When the thread is used up, the thread should call delete to release it.)
         std::vector<std::unique_ptr<PSVector>> packed_sfens;
 
-        // Mutex when accessing packed_sfens_pool
-        std::mutex mutex;
-
         // pool of sfen. The worker thread read from the file is added here.
         // Each worker thread fills its own packed_sfens[thread_id] from here.
-        // * Lock and access the mutex.
-        std::list<std::unique_ptr<PSVector>> packed_sfens_pool;
-        std::atomic<size_t> num_buffers_in_pool;
+        // Closed by the file worker after the last buffer was added.
+        BoundedBlockingQueue<std::unique_ptr<PSVector>> packed_sfens_pool;
     };
 }
@@ -2,13 +2,26 @@
 #define _SFEN_STREAM_H_
 
 #include "packed_sfen.h"
+#include "variant_binpack.h"
 
 #include "extra/nnue_data_binpack_format.h"
 
+#include <algorithm>
+#include <cassert>
 #include <optional>
 #include <fstream>
 #include <string>
 #include <memory>
+#include <vector>
+#include <cstddef>
+#include <cstring>
+
+#if !defined(_WIN32)
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
 
 namespace Stockfish::Tools {
 
@@ -17,6 +30,7 @@ namespace Stockfish::Tools {
         Bin,
         Binpack,
         Bin2,
+        VBinpack,
     };
 
     static bool ends_with(const std::string& lhs, const std::string& end)
@@ -33,7 +47,7 @@ namespace Stockfish::Tools {
 
     static std::string filename_with_extension(const std::string& filename, const std::string& ext)
     {
-        if (ends_with(filename, ext))
+        if (ends_with(filename, "." + ext))
         {
             return filename;
         }
@@ -46,10 +60,61 @@ namespace Stockfish::Tools {
     struct BasicSfenInputStream
     {
         virtual std::optional<PackedSfenValue> next() = 0;
+
+        // Reads up to n entries into out. Returns the number of entries read,
+        // less than n only when the end of the stream was reached.
+        // Each format implements it natively to avoid a virtual
+        // call and a copy per entry.
+        virtual std::size_t read_batch(PackedSfenValue* out, std::size_t n) = 0;
+
+        // Appends up to n entries to sfens. Returns the number of entries read.
+        // PSVector doesn't initialize the new entries, they are read into directly.
+        std::size_t next_n(PSVector& sfens, std::size_t n)
+        {
+            const std::size_t old_size = sfens.size();
+            sfens.resize(old_size + n);
+            const std::size_t num_read = read_batch(sfens.data() + old_size, n);
+            sfens.resize(old_size + num_read);
+            return num_read;
+        }
+
+        // Formats made of independently decodable chunks allow random access to them.
+        // Returns the number of chunks, 0 if random access is not supported.
+        virtual std::size_t num_chunks() { return 0; }
+
+        // Appends all entries of the i-th chunk to sfens.
+        // Reading continues with the following chunk afterwards.
+        virtual bool read_chunk(std::size_t /* i */, PSVector& /* sfens */) { return false; }
+
         virtual bool eof() const = 0;
         virtual ~BasicSfenInputStream() {}
     };
 
+    // Contiguous range of entries that is not owned.
+    struct PackedSfenSpan
+    {
+        const PackedSfenValue* ptr = nullptr;
+        std::size_t count = 0;
+
+        const PackedSfenValue* data() const { return ptr; }
+        std::size_t size() const { return count; }
+        bool empty() const { return count == 0; }
+
+        const PackedSfenValue* begin() const { return ptr; }
+        const PackedSfenValue* end() const { return ptr + count; }
+
+        const PackedSfenValue& operator[](std::size_t i) const { return ptr[i]; }
+    };
+
+    // .bin files have no chunks, they are split into blocks of this many entries.
+    constexpr std::size_t BIN_CHUNK_NUM_ENTRIES = 16 * 1024;
+
+    enum struct SfenAccessPattern
+    {
+        Sequential,
+        Random
+    };
+
     struct BinSfenInputStream : BasicSfenInputStream
     {
         static constexpr auto openmode = std::ios::in | std::ios::binary;
@@ -61,6 +126,27 @@ namespace Stockfish::Tools {
         {
         }
 
+        std::size_t num_chunks() override
+        {
+            m_stream.clear();
+            const auto pos = m_stream.tellg();
+            m_stream.seekg(0, std::ios::end);
+            const std::size_t num_entries = static_cast<std::size_t>(m_stream.tellg()) / sizeof(PackedSfenValue);
+            m_stream.seekg(pos);
+
+            return (num_entries + BIN_CHUNK_NUM_ENTRIES - 1) / BIN_CHUNK_NUM_ENTRIES;
+        }
+
+        bool read_chunk(std::size_t i, PSVector& sfens) override
+        {
+            m_stream.clear();
+            m_stream.seekg(i * BIN_CHUNK_NUM_ENTRIES * sizeof(PackedSfenValue));
+            m_eof = !m_stream;
+
+            next_n(sfens, BIN_CHUNK_NUM_ENTRIES);
+            return true;
+        }
+
         std::optional<PackedSfenValue> next() override
         {
             PackedSfenValue e;
@@ -75,6 +161,19 @@ namespace Stockfish::Tools {
             }
         }
 
+        std::size_t read_batch(PackedSfenValue* out, std::size_t n) override
+        {
+            if (m_eof)
+                return 0;
+
+            m_stream.read(reinterpret_cast<char*>(out), sizeof(PackedSfenValue) * n);
+            const std::size_t num_read = m_stream.gcount() / sizeof(PackedSfenValue);
+            if (num_read < n)
+                m_eof = true;
+
+            return num_read;
+        }
+
         bool eof() const override
         {
             return m_eof;
@@ -87,17 +186,165 @@ namespace Stockfish::Tools {
         bool m_eof;
     };
 
+#if !defined(_WIN32)
+
+    // .bin reader that maps the whole file into memory.
+    // The entries can be accessed directly with next_span() and at()
+    // without going through the stream buffers. A trailing partial
+    // entry is ignored, like with BinSfenInputStream.
+    struct MmapBinSfenInputStream : BasicSfenInputStream
+    {
+        static inline const std::string extension = "bin";
+
+        MmapBinSfenInputStream(std::string filename, SfenAccessPattern pattern = SfenAccessPattern::Sequential) :
+            m_data(nullptr),
+            m_mapped_size(0),
+            m_size(0),
+            m_pos(0)
+        {
+            const int fd = ::open(filename.c_str(), O_RDONLY);
+            if (fd == -1)
+                return;
+
+            struct stat st;
+            if (::fstat(fd, &st) == 0 && st.st_size > 0)
+            {
+                void* addr = ::mmap(nullptr, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+                if (addr != MAP_FAILED)
+                {
+                    m_data = static_cast<const PackedSfenValue*>(addr);
+                    m_mapped_size = st.st_size;
+                    m_size = m_mapped_size / sizeof(PackedSfenValue);
+                    advise(pattern);
+                }
+            }
+
+            // The mapping stays valid after the descriptor is closed.
+            ::close(fd);
+        }
+
+        MmapBinSfenInputStream(const MmapBinSfenInputStream&) = delete;
+        MmapBinSfenInputStream& operator=(const MmapBinSfenInputStream&) = delete;
+
+        // Tells the kernel how the entries are going to be accessed,
+        // so that it can read ahead or not.
+        void advise(SfenAccessPattern pattern)
+        {
+            if (m_data == nullptr)
+                return;
+
+            ::madvise(
+                const_cast<PackedSfenValue*>(m_data),
+                m_mapped_size,
+                pattern == SfenAccessPattern::Sequential ? MADV_SEQUENTIAL : MADV_RANDOM);
+        }
+
+        std::optional<PackedSfenValue> next() override
+        {
+            if (m_pos >= m_size)
+                return std::nullopt;
+
+            return m_data[m_pos++];
+        }
+
+        std::size_t read_batch(PackedSfenValue* out, std::size_t n) override
+        {
+            const auto span = next_span(n);
+            if (!span.empty())
+                std::memcpy(out, span.data(), sizeof(PackedSfenValue) * span.size());
+            return span.size();
+        }
+
+        // Returns up to n next entries without copying them.
+        // The span is valid as long as the stream is alive.
+        PackedSfenSpan next_span(std::size_t n)
+        {
+            const std::size_t count = std::min(n, m_size - m_pos);
+            PackedSfenSpan span{ m_data + m_pos, count };
+            m_pos += count;
+            return span;
+        }
+
+        std::size_t num_chunks() override
+        {
+            return (m_size + BIN_CHUNK_NUM_ENTRIES - 1) / BIN_CHUNK_NUM_ENTRIES;
+        }
+
+        bool read_chunk(std::size_t i, PSVector& sfens) override
+        {
+            m_pos = std::min(i * BIN_CHUNK_NUM_ENTRIES, m_size);
+            next_n(sfens, BIN_CHUNK_NUM_ENTRIES);
+            return true;
+        }
+
+        // Random access to all entries in the file.
+        const PackedSfenValue& at(std::size_t i) const
+        {
+            assert(i < m_size);
+            return m_data[i];
+        }
+
+        std::size_t size() const
+        {
+            return m_size;
+        }
+
+        bool eof() const override
+        {
+            return m_pos >= m_size;
+        }
+
+        ~MmapBinSfenInputStream() override
+        {
+            if (m_data != nullptr)
+                ::munmap(const_cast<PackedSfenValue*>(m_data), m_mapped_size);
+        }
+
+    private:
+        const PackedSfenValue* m_data;
+        std::size_t m_mapped_size;
+        std::size_t m_size;
+        std::size_t m_pos;
+    };
+
+#endif
+
     struct BinpackSfenInputStream : BasicSfenInputStream
     {
         static constexpr auto openmode = std::ios::in | std::ios::binary;
         static inline const std::string extension = "binpack";
 
         BinpackSfenInputStream(std::string filename) :
+            m_filename(filename),
             m_stream(filename, openmode),
             m_eof(!m_stream.hasNext())
         {
         }
 
+        std::size_t num_chunks() override
+        {
+            return chunks().size();
+        }
+
+        bool read_chunk(std::size_t i, PSVector& sfens) override
+        {
+            static_assert(sizeof(binpack::nodchip::PackedSfenValue) == sizeof(PackedSfenValue));
+
+            m_stream.seekToChunk(chunks()[i].offset);
+
+            // The reader moves on to the next chunk after returning the last entry.
+            const auto chunk_id = m_stream.numChunksRead();
+            while (m_stream.hasNext() && m_stream.numChunksRead() == chunk_id)
+            {
+                const auto v = binpack::trainingDataEntryToPackedSfenValue(m_stream.next());
+                sfens.emplace_back();
+                std::memcpy(&sfens.back(), &v, sizeof(PackedSfenValue));
+            }
+
+            m_eof = !m_stream.hasNext();
+            return true;
+        }
+
         std::optional<PackedSfenValue> next() override
         {
             static_assert(sizeof(binpack::nodchip::PackedSfenValue) == sizeof(PackedSfenValue));
@@ -117,6 +364,29 @@ namespace Stockfish::Tools {
             return psv;
         }
 
+        std::size_t read_batch(PackedSfenValue* out, std::size_t n) override
+        {
+            static_assert(sizeof(binpack::nodchip::PackedSfenValue) == sizeof(PackedSfenValue));
+
+            // same layout, different types. The build uses -fno-strict-aliasing
+            // so the entries can be written in place.
+            auto* dst = reinterpret_cast<binpack::nodchip::PackedSfenValue*>(out);
+
+            std::size_t num_read = 0;
+            for (; num_read < n; ++num_read)
+            {
+                if (!m_stream.hasNext())
+                {
+                    m_eof = true;
+                    break;
+                }
+
+                dst[num_read] = binpack::trainingDataEntryToPackedSfenValue(m_stream.next());
+            }
+
+            return num_read;
+        }
+
         bool eof() const override
         {
             return m_eof;
@@ -125,13 +395,113 @@ namespace Stockfish::Tools {
         ~BinpackSfenInputStream() override {}
 
     private:
+        std::string m_filename;
         binpack::CompressedTrainingDataEntryReader m_stream;
         bool m_eof;
+        std::optional<std::vector<binpack::CompressedTrainingDataChunkInfo>> m_chunks;
+
+        const std::vector<binpack::CompressedTrainingDataChunkInfo>& chunks()
+        {
+            if (!m_chunks.has_value())
+                m_chunks = binpack::loadCompressedTrainingDataChunks(m_filename);
+
+            return *m_chunks;
+        }
+    };
+
+    struct VBinpackSfenInputStream : BasicSfenInputStream
+    {
+        static inline const std::string extension = "vbinpack";
+
+        VBinpackSfenInputStream(std::string filename) :
+            m_filename(filename),
+            m_stream(filename),
+            m_eof(!m_stream.has_next())
+        {
+        }
+
+        std::size_t num_chunks() override
+        {
+            return chunks().size();
+        }
+
+        bool read_chunk(std::size_t i, PSVector& sfens) override
+        {
+            m_stream.seek_to_chunk(chunks()[i].offset);
+
+            // has_next() reads the chunk, and the following one
+            // once all entries of the chunk were returned.
+            const auto chunk_id = m_stream.num_chunks_read() + 1;
+            while (m_stream.has_next() && m_stream.num_chunks_read() == chunk_id)
+                sfens.emplace_back(m_stream.next());
+
+            m_eof = !m_stream.has_next();
+            return true;
+        }
+
+        std::optional<PackedSfenValue> next() override
+        {
+            if (!m_stream.has_next())
+            {
+                m_eof = true;
+                return std::nullopt;
+            }
+
+            return m_stream.next();
+        }
+
+        std::size_t read_batch(PackedSfenValue* out, std::size_t n) override
+        {
+            std::size_t num_read = 0;
+            for (; num_read < n; ++num_read)
+            {
+                if (!m_stream.has_next())
+                {
+                    m_eof = true;
+                    break;
+                }
+
+                out[num_read] = m_stream.next();
+            }
+
+            return num_read;
+        }
+
+        bool eof() const override
+        {
+            return m_eof;
+        }
+
+        ~VBinpackSfenInputStream() override {}
+
+    private:
+        std::string m_filename;
+        VariantBinpackReader m_stream;
+        bool m_eof;
+        std::optional<std::vector<binpack::CompressedTrainingDataChunkInfo>> m_chunks;
+
+        const std::vector<binpack::CompressedTrainingDataChunkInfo>& chunks()
+        {
+            if (!m_chunks.has_value())
+                m_chunks = binpack::loadCompressedTrainingDataChunks(m_filename);
+
+            return *m_chunks;
+        }
     };
 
     struct BasicSfenOutputStream
     {
-        virtual void write(const PSVector& sfens) = 0;
+        // Writes n consecutive entries. Implemented natively by each format.
+        virtual void write_batch(const PackedSfenValue* sfens, std::size_t n) = 0;
+
+        void write(const PSVector& sfens)
+        {
+            write_batch(sfens.data(), sfens.size());
+        }
+
+        // Writes chunks made by encode_sfens() for the same format.
+        virtual void write_encoded(const std::vector<binpack::EncodedChunk>& chunks) = 0;
+
         virtual ~BasicSfenOutputStream() {}
     };
 
@@ -145,9 +515,15 @@ namespace Stockfish::Tools {
         {
         }
 
-        void write(const PSVector& sfens) override
+        void write_batch(const PackedSfenValue* sfens, std::size_t n) override
+        {
+            m_stream.write(reinterpret_cast<const char*>(sfens), sizeof(PackedSfenValue) * n);
+        }
+
+        void write_encoded(const std::vector<binpack::EncodedChunk>& chunks) override
         {
-            m_stream.write(reinterpret_cast<const char*>(sfens.data()), sizeof(PackedSfenValue) * sfens.size());
+            for (const auto& chunk : chunks)
+                m_stream.write(chunk.data.data(), chunk.data.size());
         }
 
         ~BinSfenOutputStream() override {}
@@ -162,21 +538,26 @@ namespace Stockfish::Tools {
         static inline const std::string extension = "binpack";
 
         BinpackSfenOutputStream(std::string filename) :
-            m_stream(filename_with_extension(filename, extension), openmode)
+            m_stream(filename_with_extension(filename, extension), openmode, true)
         {
         }
 
-        void write(const PSVector& sfens) override
+        void write_batch(const PackedSfenValue* sfens, std::size_t n) override
         {
             static_assert(sizeof(binpack::nodchip::PackedSfenValue) == sizeof(PackedSfenValue));
 
-            for(auto& sfen : sfens)
-            {
-                // The library uses a type that's different but layout-compatible.
-                binpack::nodchip::PackedSfenValue e;
-                std::memcpy(&e, &sfen, sizeof(binpack::nodchip::PackedSfenValue));
-                m_stream.addTrainingDataEntry(binpack::packedSfenValueToTrainingDataEntry(e));
-            }
+            // The library uses a type that's different but layout-compatible.
+            // The build uses -fno-strict-aliasing so no copy is needed.
+            const auto* src = reinterpret_cast<const binpack::nodchip::PackedSfenValue*>(sfens);
+
+            for (std::size_t i = 0; i < n; ++i)
+                m_stream.addTrainingDataEntry(binpack::packedSfenValueToTrainingDataEntry(src[i]));
+        }
+
+        void write_encoded(const std::vector<binpack::EncodedChunk>& chunks) override
+        {
+            for (const auto& chunk : chunks)
+                m_stream.addEncodedChunk(chunk);
         }
 
         ~BinpackSfenOutputStream() override {}
@@ -185,16 +566,111 @@ namespace Stockfish::Tools {
         binpack::CompressedTrainingDataEntryWriter m_stream;
     };
 
+    struct VBinpackSfenOutputStream : BasicSfenOutputStream
+    {
+        static constexpr auto openmode = std::ios::out | std::ios::binary | std::ios::app;
+        static inline const std::string extension = "vbinpack";
+
+        VBinpackSfenOutputStream(std::string filename) :
+            m_stream(filename_with_extension(filename, extension), openmode, true)
+        {
+        }
+
+        void write_batch(const PackedSfenValue* sfens, std::size_t n) override
+        {
+            for (std::size_t i = 0; i < n; ++i)
+                m_stream.add_entry(sfens[i]);
+        }
+
+        void write_encoded(const std::vector<binpack::EncodedChunk>& chunks) override
+        {
+            for (const auto& chunk : chunks)
+                m_stream.add_encoded_chunk(chunk);
+        }
+
+        ~VBinpackSfenOutputStream() override {}
+
+    private:
+        VariantBinpackWriter m_stream;
+    };
+
+    // Encodes entries in the given format in memory, independently of any
+    // output stream, so that it can be done on many threads at once.
+    // The chunks are written with BasicSfenOutputStream::write_encoded().
+    // Games are not chained across calls.
+    inline void encode_sfens(
+        SfenOutputType sfen_output_type,
+        const PackedSfenValue* sfens,
+        std::size_t n,
+        std::vector<binpack::EncodedChunk>& out)
+    {
+        switch(sfen_output_type)
+        {
+            case SfenOutputType::Bin:
+            {
+                const auto* bytes = reinterpret_cast<const char*>(sfens);
+                out.push_back({
+                    std::vector<char>(bytes, bytes + sizeof(PackedSfenValue) * n),
+                    static_cast<std::uint32_t>(n),
+                    n ? sfens[0].gamePly : std::uint16_t(0) });
+                break;
+            }
+            case SfenOutputType::Binpack:
+            {
+                const auto* src = reinterpret_cast<const binpack::nodchip::PackedSfenValue*>(sfens);
+
+                binpack::CompressedTrainingDataEntryWriter writer(out);
+                for (std::size_t i = 0; i < n; ++i)
+                    writer.addTrainingDataEntry(binpack::packedSfenValueToTrainingDataEntry(src[i]));
+                break;
+            }
+            case SfenOutputType::VBinpack:
+            {
+                VariantBinpackWriter writer(out);
+                for (std::size_t i = 0; i < n; ++i)
+                    writer.add_entry(sfens[i]);
+                break;
+            }
+            default:
+                assert(false);
+                break;
+        }
+    }
+
     inline std::unique_ptr<BasicSfenInputStream> open_sfen_input_file(const std::string& filename)
     {
         if (has_extension(filename, BinSfenInputStream::extension))
+#if !defined(_WIN32)
+            return std::make_unique<MmapBinSfenInputStream>(filename);
+#else
             return std::make_unique<BinSfenInputStream>(filename);
+#endif
         else if (has_extension(filename, BinpackSfenInputStream::extension))
             return std::make_unique<BinpackSfenInputStream>(filename);
+        else if (has_extension(filename, VBinpackSfenInputStream::extension))
+            return std::make_unique<VBinpackSfenInputStream>(filename);
 
         return nullptr;
     }
 
+    // The name of the file create_new_sfen_output() writes to.
+    inline std::string sfen_output_file_name(const std::string& filename, SfenOutputType sfen_output_type)
+    {
+        switch(sfen_output_type)
+        {
+            case SfenOutputType::Bin:
+                return filename_with_extension(filename, BinSfenOutputStream::extension);
+            case SfenOutputType::Binpack:
+                return filename_with_extension(filename, BinpackSfenOutputStream::extension);
+            case SfenOutputType::VBinpack:
+                return filename_with_extension(filename, VBinpackSfenOutputStream::extension);
+            default:
+                break;
+        }
+
+        return filename;
+    }
+
     inline std::unique_ptr<BasicSfenOutputStream> create_new_sfen_output(const std::string& filename, SfenOutputType sfen_output_type)
     {
         switch(sfen_output_type)
@@ -203,6 +679,10 @@ namespace Stockfish::Tools {
                 return std::make_unique<BinSfenOutputStream>(filename);
             case SfenOutputType::Binpack:
                 return std::make_unique<BinpackSfenOutputStream>(filename);
+            case SfenOutputType::VBinpack:
+                return std::make_unique<VBinpackSfenOutputStream>(filename);
+            default:
+                break;
         }
 
         assert(false);
@@ -215,6 +695,8 @@ namespace Stockfish::Tools {
             return std::make_unique<BinSfenOutputStream>(filename);
         else if (has_extension(filename, BinpackSfenOutputStream::extension))
             return std::make_unique<BinpackSfenOutputStream>(filename);
+        else if (has_extension(filename, VBinpackSfenOutputStream::extension))
+            return std::make_unique<VBinpackSfenOutputStream>(filename);
 
         return nullptr;
     }
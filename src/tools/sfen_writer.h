@@ -7,11 +7,17 @@
 
 #include "syzygy/tbprobe.h"
 
+#include <algorithm>
+#include <condition_variable>
 #include <cstring>
+#include <deque>
+#include <filesystem>
 #include <fstream>
 #include <limits>
 #include <list>
+#include <map>
 #include <memory>
+#include <mutex>
 #include <optional>
 #include <shared_mutex>
 #include <thread>
@@ -19,45 +25,129 @@
 
 namespace Stockfish::Tools {
 
+    // The state of the output of a SfenWriter, with everything handed
+    // over to it written. See SfenWriter::checkpoint().
+    struct SfenWriterCheckpoint
+    {
+        uint64_t write_count = 0;
+        uint64_t write_count_current_file = 0;
+
+        // Number of the current file, see save_count. 0 is the first file.
+        uint64_t file_number = 0;
+
+        // Sizes of the current file and its index, 0 if there is no index.
+        uint64_t file_size = 0;
+        uint64_t index_size = 0;
+    };
+
+    struct SfenWriterParams
+    {
+        // Number of threads encoding the buffers. 0 means one per
+        // 8 producing threads, but at least 1.
+        int num_encoder_threads = 0;
+
+        // Upper bound on the memory used by the buffers that were handed
+        // over but not written yet, in MiB. Producers wait when it is reached.
+        std::uint64_t max_pending_mb = 1024;
+
+        // Write the buffers in the order they were handed over. Otherwise
+        // they are written as soon as they are encoded.
+        bool ordered = true;
+
+        // Continue after a checkpoint. The output must have been restored
+        // with SfenWriter::restore_output() first.
+        std::optional<SfenWriterCheckpoint> resume_from;
+    };
+
     // Helper class for exporting Sfen
+    //
+    // Every producing thread fills its own buffer. Full buffers are handed
+    // over to a pool of encoder threads, each of which encodes the buffer
+    // on its own into chunks of the output format. A single flusher thread
+    // then appends the chunks to the file. The number of buffers between
+    // the hand over and the file is limited, see SfenWriterParams.
     struct SfenWriter
     {
         // Amount of sfens required to flush the buffer.
         static constexpr size_t SFEN_WRITE_SIZE = 5000;
 
         // File name to write and number of threads to create
-        SfenWriter(std::string filename_, int thread_num, uint64_t save_count, SfenOutputType sfen_output_type)
+        SfenWriter(
+            std::string filename_,
+            int thread_num,
+            uint64_t save_count,
+            SfenOutputType sfen_output_type,
+            const SfenWriterParams& params = SfenWriterParams{})
         {
-            sfen_buffers_pool.reserve((size_t)thread_num * 10);
             sfen_buffers.resize(thread_num);
 
+            const int num_encoders =
+                params.num_encoder_threads > 0 ? params.num_encoder_threads
+                                               : std::max(1, thread_num / 8);
+
+            // Every encoder must be able to hold a buffer for the pipeline to run.
+            const uint64_t buffer_bytes = SFEN_WRITE_SIZE * sizeof(PackedSfenValue);
+            max_pending_buffers = std::max<uint64_t>(params.max_pending_mb * 1024 * 1024 / buffer_bytes, num_encoders + 1);
+            ordered = params.ordered;
+
             auto out = sync_region_cout.new_region();
-            out << "INFO (sfen_writer): Creating new data file at " << filename_ << std::endl;
+            out << "INFO (sfen_writer): Creating new data file at " << file_name(filename_, current_file_number) << std::endl;
+            out << "INFO (sfen_writer): Using " << num_encoders << " encoder thread(s), at most "
+                << max_pending_buffers << " pending buffers, "
+                << (ordered ? "ordered" : "unordered") << " output" << std::endl;
 
             sfen_format = sfen_output_type;
-            output_file_stream = create_new_sfen_output(filename_, sfen_format);
             filename = filename_;
             save_every = save_count;
 
+            if (params.resume_from.has_value())
+            {
+                sfen_write_count = params.resume_from->write_count;
+                sfen_write_count_current_file = params.resume_from->write_count_current_file;
+                current_file_number = params.resume_from->file_number;
+            }
+
+            output_file_stream = create_new_sfen_output(file_name(filename, current_file_number), sfen_format);
+
             finished = false;
 
-            file_worker_thread = std::thread([&] { this->file_write_worker(); });
+            for (int i = 0; i < num_encoders; ++i)
+                encoder_threads.emplace_back([this] { this->encode_worker(); });
+
+            file_worker_thread = std::thread([this] { this->file_write_worker(); });
         }
 
         ~SfenWriter()
         {
             flush();
 
-            finished = true;
+            {
+                std::unique_lock<std::mutex> lk(mutex);
+                finished = true;
+            }
+            buffers_handed_over.notify_all();
+
+            for (auto& th : encoder_threads)
+                th.join();
+
+            blocks_encoded.notify_all();
             file_worker_thread.join();
             output_file_stream.reset();
 
+            auto out = sync_region_cout.new_region();
+            out << "INFO (sfen_writer): Wrote " << sfen_write_count << " sfens. "
+                << "Producers waited " << num_stalls << " times for "
+                << stall_time << " ms in total, at most "
+                << peak_pending_buffers << " buffers were pending." << std::endl;
+
 #if !defined(NDEBUG)
             {
                 // All buffers should be empty since file_worker_thread
                 // should have written everything before exiting.
                 for (const auto& p : sfen_buffers) { assert(p == nullptr); (void)p ; }
-                assert(sfen_buffers_pool.empty());
+                assert(pending_buffers.empty());
+                assert(encoded_blocks.empty());
+                assert(num_pending_buffers == 0);
             }
 #endif
         }
@@ -84,11 +174,8 @@ namespace Stockfish::Tools {
 
             if (buf->size() >= SFEN_WRITE_SIZE)
             {
-                // If you load it in sfen_buffers_pool, the worker will do the rest.
-
-                // Critical section since sfen_buffers_pool is shared among threads.
-                std::unique_lock<std::mutex> lk(mutex);
-                sfen_buffers_pool.emplace_back(std::move(buf));
+                // The encoders and the flusher do the rest.
+                hand_over(std::move(buf));
             }
         }
 
@@ -103,71 +190,228 @@ namespace Stockfish::Tools {
         // Move what remains in the buffer for your thread to a buffer for writing to a file.
         void flush(size_t thread_id)
         {
-            std::unique_lock<std::mutex> lk(mutex);
-
             auto& buf = sfen_buffers[thread_id];
 
             // There is a case that buf==nullptr, so that check is necessary.
             if (buf && buf->size() != 0)
             {
-                sfen_buffers_pool.emplace_back(std::move(buf));
+                hand_over(std::move(buf));
+            }
+
+            buf.reset();
+        }
+
+        // Waits until everything that was handed over is written, and returns
+        // the state of the output. The producers must not write meanwhile.
+        SfenWriterCheckpoint checkpoint()
+        {
+            flush();
+
+            SfenWriterCheckpoint cp;
+            {
+                std::unique_lock<std::mutex> lk(mutex);
+                buffer_written.wait(lk, [this] { return num_pending_buffers == 0; });
+
+                cp.write_count = sfen_write_count;
+                cp.write_count_current_file = sfen_write_count_current_file;
+                cp.file_number = current_file_number;
+            }
+
+            // The flusher is idle now. Reopen the file, so that all
+            // buffered data is passed on to the OS.
+            output_file_stream.reset();
+
+            const auto path = sfen_output_file_name(file_name(filename, current_file_number), sfen_format);
+            std::error_code ec;
+            cp.file_size = std::filesystem::file_size(path, ec);
+            cp.index_size = std::filesystem::exists(binpack::compressedTrainingDataIndexPath(path))
+                ? std::filesystem::file_size(binpack::compressedTrainingDataIndexPath(path), ec) : 0;
+
+            output_file_stream = create_new_sfen_output(file_name(filename, current_file_number), sfen_format);
+
+            return cp;
+        }
+
+        // Removes everything that was written after the checkpoint: the end
+        // of the current file and of its index, and all later files.
+        // Returns false if the output doesn't match the checkpoint.
+        static bool restore_output(
+            const std::string& filename,
+            SfenOutputType sfen_format,
+            const SfenWriterCheckpoint& cp)
+        {
+            namespace sys = std::filesystem;
+
+            std::error_code ec;
+
+            const auto path = sfen_output_file_name(file_name(filename, cp.file_number), sfen_format);
+            const auto index_path = binpack::compressedTrainingDataIndexPath(path);
+
+            const auto size = sys::file_size(path, ec);
+            if (ec || size < cp.file_size)
+            {
+                std::cerr << "ERROR (sfen_writer): " << path << " is missing or shorter than at the checkpoint.\n";
+                return false;
+            }
+
+            sys::resize_file(path, cp.file_size, ec);
+            if (ec)
+            {
+                std::cerr << "ERROR (sfen_writer): Failed to truncate " << path << ".\n";
+                return false;
+            }
+
+            if (sys::exists(index_path))
+            {
+                if (cp.index_size > 0)
+                    sys::resize_file(index_path, cp.index_size, ec);
+                else
+                    sys::remove(index_path, ec);
+            }
+
+            for (uint64_t n = cp.file_number + 1; ; ++n)
+            {
+                const auto later_path = sfen_output_file_name(file_name(filename, n), sfen_format);
+                if (!sys::exists(later_path))
+                    break;
+
+                sys::remove(later_path, ec);
+                sys::remove(binpack::compressedTrainingDataIndexPath(later_path), ec);
+            }
+
+            return true;
+        }
+
+    private:
+
+        // Files after the first one get a sequential number attached.
+        static std::string file_name(const std::string& filename, uint64_t file_number)
+        {
+            return file_number == 0 ? filename : filename + "_" + std::to_string(file_number);
+        }
+
+        struct EncodedBlock
+        {
+            std::vector<binpack::EncodedChunk> chunks;
+            uint64_t num_sfens;
+        };
+
+        // Queues a full buffer for encoding. Waits while too many
+        // buffers are pending.
+        void hand_over(std::unique_ptr<PSVector>&& buf)
+        {
+            std::unique_lock<std::mutex> lk(mutex);
+
+            if (num_pending_buffers >= max_pending_buffers)
+            {
+                const auto start = now();
+                buffer_written.wait(lk, [this] { return num_pending_buffers < max_pending_buffers; });
+                stall_time += now() - start;
+                num_stalls += 1;
+            }
+
+            pending_buffers.emplace_back(next_sequence_number++, std::move(buf));
+            num_pending_buffers += 1;
+            peak_pending_buffers = std::max(peak_pending_buffers, num_pending_buffers);
+
+            lk.unlock();
+            buffers_handed_over.notify_one();
+        }
+
+        // Encoder thread. Buffers are independent, so they are encoded
+        // in parallel, and only the writing is sequential.
+        void encode_worker()
+        {
+            while (true)
+            {
+                uint64_t sequence_number;
+                std::unique_ptr<PSVector> buf;
+                {
+                    std::unique_lock<std::mutex> lk(mutex);
+                    buffers_handed_over.wait(lk, [this] { return finished || !pending_buffers.empty(); });
+
+                    if (pending_buffers.empty())
+                        break;
+
+                    sequence_number = pending_buffers.front().first;
+                    buf = std::move(pending_buffers.front().second);
+                    pending_buffers.pop_front();
+                }
+
+                EncodedBlock block;
+                block.num_sfens = buf->size();
+                encode_sfens(sfen_format, buf->data(), buf->size(), block.chunks);
+                buf.reset();
+
+                {
+                    std::unique_lock<std::mutex> lk(mutex);
+
+                    // Without ordering the blocks are simply written in the
+                    // order they are encoded.
+                    encoded_blocks.emplace(ordered ? sequence_number : next_encoded_number++, std::move(block));
+                }
+                blocks_encoded.notify_one();
             }
         }
 
         // Dedicated thread to write to file
         void file_write_worker()
         {
-            while (!finished || sfen_buffers_pool.size())
+            uint64_t next_to_write = 0;
+
+            while (true)
             {
-                std::vector<std::unique_ptr<PSVector>> buffers;
+                EncodedBlock block;
                 {
                     std::unique_lock<std::mutex> lk(mutex);
+                    blocks_encoded.wait(lk, [&] {
+                        return (!encoded_blocks.empty() && encoded_blocks.begin()->first == next_to_write)
+                            || (finished && num_pending_buffers == 0);
+                    });
+
+                    if (encoded_blocks.empty())
+                        break;
 
-                    // Atomically swap take the filled buffers and
-                    // create a new buffer pool for threads to fill.
-                    buffers = std::move(sfen_buffers_pool);
-                    sfen_buffers_pool = std::vector<std::unique_ptr<PSVector>>();
+                    block = std::move(encoded_blocks.begin()->second);
+                    encoded_blocks.erase(encoded_blocks.begin());
                 }
 
-                if (!buffers.size())
+                next_to_write += 1;
+
+                output_file_stream->write_encoded(block.chunks);
+
+                sfen_write_count += block.num_sfens;
+
+                // Add the processed number here, and if it exceeds save_every,
+                // change the file name and reset this counter.
+                sfen_write_count_current_file += block.num_sfens;
+                if (sfen_write_count_current_file >= save_every)
                 {
-                    // Poor man's condition variable.
-                    sleep(100);
+                    sfen_write_count_current_file = 0;
+
+                    // Sequential number attached to the file
+                    current_file_number = sfen_write_count / save_every;
+
+                    // Rename the file and open it again.
+                    // Add ios::app in consideration of overwriting.
+                    // (Depending on the operation, it may not be necessary.)
+                    std::string new_filename = file_name(filename, current_file_number);
+                    output_file_stream = create_new_sfen_output(new_filename, sfen_format);
+
+                    auto out = sync_region_cout.new_region();
+                    out << "INFO (sfen_writer): Creating new data file at " << new_filename << std::endl;
                 }
-                else
+
+                // The block is released only when the counters and the file
+                // are final, checkpoint() relies on that.
                 {
-                    for (auto& buf : buffers)
-                    {
-                        output_file_stream->write(*buf);
-
-                        sfen_write_count += buf->size();
-
-                        // Add the processed number here, and if it exceeds save_every,
-                        // change the file name and reset this counter.
-                        sfen_write_count_current_file += buf->size();
-                        if (sfen_write_count_current_file >= save_every)
-                        {
-                            sfen_write_count_current_file = 0;
-
-                            // Sequential number attached to the file
-                            int n = (int)(sfen_write_count / save_every);
-
-                            // Rename the file and open it again.
-                            // Add ios::app in consideration of overwriting.
-                            // (Depending on the operation, it may not be necessary.)
-                            std::string new_filename = filename + "_" + std::to_string(n);
-                            output_file_stream = create_new_sfen_output(new_filename, sfen_format);
-
-                            auto out = sync_region_cout.new_region();
-                            out << "INFO (sfen_writer): Creating new data file at " << new_filename << std::endl;
-                        }
-                    }
+                    std::unique_lock<std::mutex> lk(mutex);
+                    num_pending_buffers -= 1;
                 }
+                buffer_written.notify_all();
             }
         }
 
-    private:
-
         std::unique_ptr<BasicSfenOutputStream> output_file_stream;
 
         // A new net is saved after every save_every sfens are processed.
@@ -175,25 +419,44 @@ namespace Stockfish::Tools {
 
         // File name passed in the constructor
         std::string filename;
+        uint64_t current_file_number = 0;
 
-        // Thread to write to the file
+        // Threads to encode the buffers and to write to the file
+        std::vector<std::thread> encoder_threads;
         std::thread file_worker_thread;
 
         // Flag that all threads have finished
-        std::atomic<bool> finished;
+        bool finished;
 
         SfenOutputType sfen_format;
 
-        // buffer before writing to file
-        // sfen_buffers is the buffer for each thread
-        // sfen_buffers_pool is a buffer for writing.
-        // After loading the phase in the former buffer by SFEN_WRITE_SIZE,
-        // transfer it to the latter.
+        bool ordered;
+
+        // sfen_buffers is the buffer for each thread. After loading the
+        // phase in it by SFEN_WRITE_SIZE, it is handed over to the encoders
+        // through pending_buffers, with a sequence number. The encoded
+        // buffers wait in encoded_blocks until they are written.
         std::vector<std::unique_ptr<PSVector>> sfen_buffers;
-        std::vector<std::unique_ptr<PSVector>> sfen_buffers_pool;
+        std::deque<std::pair<uint64_t, std::unique_ptr<PSVector>>> pending_buffers;
+        std::map<uint64_t, EncodedBlock> encoded_blocks;
+
+        uint64_t next_sequence_number = 0;
+        uint64_t next_encoded_number = 0;
+
+        // Buffers handed over and not written yet.
+        uint64_t num_pending_buffers = 0;
+        uint64_t max_pending_buffers;
 
-        // Mutex required to access sfen_buffers_pool
+        // Mutex required to access the shared state of the pipeline
         std::mutex mutex;
+        std::condition_variable buffers_handed_over;
+        std::condition_variable blocks_encoded;
+        std::condition_variable buffer_written;
+
+        // How often and for how long producers waited for the pipeline.
+        uint64_t num_stalls = 0;
+        TimePoint stall_time = 0;
+        uint64_t peak_pending_buffers = 0;
 
         // Number of sfens written in total, and the
         // number of sfens written in the current file.
@@ -0,0 +1,462 @@
+#include "shuffle.h"
+
+#include "sfen_stream.h"
+#include "packed_sfen.h"
+
+#include "misc.h"
+#include "thread.h"
+
+#include "extra/nnue_data_binpack_format.h"
+
+#include <algorithm>
+#include <atomic>
+#include <cstdint>
+#include <filesystem>
+#include <fstream>
+#include <iostream>
+#include <limits>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <string>
+#include <vector>
+
+namespace sys = std::filesystem;
+
+namespace Stockfish::Tools
+{
+    struct ShuffleParams
+    {
+        std::vector<std::string> input_filenames;
+        std::string output_filename = "shuffled.binpack";
+        std::string tmp_dir = ".";
+        std::uint64_t memory_mb = 1024;
+        std::uint64_t num_buckets = 0;
+        std::string seed;
+
+        void enforce_constraints()
+        {
+            memory_mb = std::max<std::uint64_t>(memory_mb, 16);
+        }
+    };
+
+    // A part of an input file that can be read on its own.
+    struct ShuffleWorkItem
+    {
+        std::size_t file_index;
+
+        // The chunk to read, or the whole file for formats without chunks.
+        std::optional<std::size_t> chunk;
+    };
+
+    // Estimates the number of entries in a file without decoding it.
+    // The estimate for chunked files without a usable index is generous,
+    // more buckets than needed only cost some file operations.
+    static std::uint64_t estimate_num_entries(const std::string& filename)
+    {
+        std::error_code ec;
+        const std::uint64_t file_size = sys::file_size(filename, ec);
+        if (ec)
+            return 0;
+
+        if (has_extension(filename, BinSfenInputStream::extension))
+            return file_size / sizeof(PackedSfenValue);
+
+        auto chunks = binpack::tryLoadCompressedTrainingDataIndex(filename);
+        if (chunks.has_value())
+        {
+            std::uint64_t num_entries = 0;
+            bool all_known = true;
+            for (const auto& chunk : *chunks)
+            {
+                num_entries += chunk.numEntries;
+                all_known = all_known && chunk.numEntries != 0;
+            }
+
+            if (all_known)
+                return num_entries;
+        }
+
+        // Chained .binpack data takes around 2.5 bytes per entry.
+        return file_size / 2;
+    }
+
+    static std::string bucket_filename(const ShuffleParams& params, const std::string& name)
+    {
+        const auto stem = sys::path(params.output_filename).filename().string();
+        return (sys::path(params.tmp_dir) / (stem + ".shuffle." + name + ".bin")).string();
+    }
+
+    // Entries are buffered per bucket and appended to the bucket file
+    // when the buffer is full. The files are opened for every write,
+    // so there is no limit on the number of buckets from open handles.
+    struct BucketSet
+    {
+        BucketSet(std::vector<std::string> filenames, std::size_t buffer_size) :
+            m_filenames(std::move(filenames)),
+            m_mutexes(std::make_unique<std::mutex[]>(m_filenames.size())),
+            m_buffer_size(buffer_size)
+        {
+            for (const auto& filename : m_filenames)
+                std::ofstream(filename, std::ios::out | std::ios::binary | std::ios::trunc);
+        }
+
+        std::size_t size() const { return m_filenames.size(); }
+
+        const std::string& filename(std::size_t i) const { return m_filenames[i]; }
+
+        std::size_t buffer_size() const { return m_buffer_size; }
+
+        void append(std::size_t i, const PSVector& sfens)
+        {
+            if (sfens.empty())
+                return;
+
+            std::lock_guard lock(m_mutexes[i]);
+            std::ofstream out(m_filenames[i], std::ios::out | std::ios::binary | std::ios::app);
+            out.write(reinterpret_cast<const char*>(sfens.data()), sizeof(PackedSfenValue) * sfens.size());
+        }
+
+    private:
+        std::vector<std::string> m_filenames;
+        std::unique_ptr<std::mutex[]> m_mutexes;
+        std::size_t m_buffer_size;
+    };
+
+    // Per thread buffers that distribute entries to random buckets.
+    struct BucketScatter
+    {
+        BucketScatter(BucketSet& buckets, PRNG& prng) :
+            m_buckets(buckets),
+            m_prng(prng),
+            m_buffers(buckets.size())
+        {
+        }
+
+        void add(const PackedSfenValue* sfens, std::size_t n)
+        {
+            for (std::size_t i = 0; i < n; ++i)
+            {
+                const std::size_t b = m_prng.rand(m_buckets.size());
+                auto& buffer = m_buffers[b];
+                buffer.emplace_back(sfens[i]);
+
+                if (buffer.size() >= m_buckets.buffer_size())
+                {
+                    m_buckets.append(b, buffer);
+                    buffer.clear();
+                }
+            }
+        }
+
+        void flush()
+        {
+            for (std::size_t b = 0; b < m_buffers.size(); ++b)
+            {
+                m_buckets.append(b, m_buffers[b]);
+                m_buffers[b].clear();
+                m_buffers[b].shrink_to_fit();
+            }
+        }
+
+    private:
+        BucketSet& m_buckets;
+        PRNG& m_prng;
+        std::vector<PSVector> m_buffers;
+    };
+
+    static std::size_t scatter_buffer_size(std::uint64_t memory_bytes, std::size_t num_threads, std::size_t num_buckets)
+    {
+        // Use at most a quarter of the memory for the buffers of all threads.
+        const std::uint64_t entries = memory_bytes / 4 / (num_threads * num_buckets * sizeof(PackedSfenValue));
+        return static_cast<std::size_t>(std::clamp<std::uint64_t>(entries, 64, 4096));
+    }
+
+    struct Shuffler
+    {
+        Shuffler(const ShuffleParams& params) :
+            m_params(params),
+            m_memory_bytes(params.memory_mb * 1024 * 1024),
+            m_num_threads(Threads.size())
+        {
+            PRNG prng(params.seed);
+            for (std::size_t i = 0; i < m_num_threads; ++i)
+                m_prngs.emplace_back(prng.next_random_seed());
+
+            std::cout << "PRNG seed : " << prng.get_seed() << '\n';
+        }
+
+        void run()
+        {
+            std::uint64_t estimated_num_entries = 0;
+            for (const auto& filename : m_params.input_filenames)
+                estimated_num_entries += estimate_num_entries(filename);
+
+            const std::size_t num_buckets = m_params.num_buckets != 0
+                ? m_params.num_buckets
+                : std::max<std::uint64_t>(1, (estimated_num_entries * sizeof(PackedSfenValue) + bucket_budget() - 1) / bucket_budget());
+
+            std::cout << "Estimated number of entries : " << estimated_num_entries << '\n';
+            std::cout << "Number of buckets           : " << num_buckets << '\n';
+            std::cout << "Memory per bucket           : " << bucket_budget() / (1024 * 1024) << " MiB\n";
+            std::cout << '\n';
+
+            std::vector<std::string> filenames;
+            for (std::size_t i = 0; i < num_buckets; ++i)
+                filenames.emplace_back(bucket_filename(m_params, std::to_string(i)));
+
+            BucketSet buckets(std::move(filenames), scatter_buffer_size(m_memory_bytes, m_num_threads, num_buckets));
+
+            const auto scatter_start = now();
+            const std::uint64_t num_scattered = scatter_inputs(buckets);
+            std::cout << "Scattered " << num_scattered << " entries in "
+                      << (now() - scatter_start) / 1000.0 << "s.\n";
+
+            if (num_scattered == 0)
+            {
+                std::cerr << "ERROR: No entries were read. Exiting...\n";
+                remove_buckets(buckets);
+                return;
+            }
+
+            // Every file write is done before the output is truncated, so the
+            // output may be one of the inputs.
+            std::ofstream(m_params.output_filename, std::ios::out | std::ios::binary | std::ios::trunc);
+            std::error_code ec;
+            sys::remove(binpack::compressedTrainingDataIndexPath(m_params.output_filename), ec);
+
+            m_out = create_new_sfen_output(m_params.output_filename);
+
+            const auto gather_start = now();
+            gather_buckets(buckets);
+            m_out.reset();
+
+            std::cout << "Wrote " << m_num_written << " entries in "
+                      << (now() - gather_start) / 1000.0 << "s.\n";
+
+            if (m_num_written != num_scattered)
+                std::cerr << "ERROR: Expected " << num_scattered << " entries.\n";
+        }
+
+    private:
+        const ShuffleParams& m_params;
+        std::uint64_t m_memory_bytes;
+        std::size_t m_num_threads;
+        std::vector<PRNG> m_prngs;
+
+        std::unique_ptr<BasicSfenOutputStream> m_out;
+        std::mutex m_out_mutex;
+        std::uint64_t m_num_written = 0;
+
+        // Every thread holds one bucket at a time. Leave some room for
+        // the variance of the bucket sizes and the output buffers.
+        std::uint64_t bucket_budget() const
+        {
+            return std::max<std::uint64_t>(m_memory_bytes / 2 / m_num_threads, sizeof(PackedSfenValue));
+        }
+
+        std::uint64_t scatter_inputs(BucketSet& buckets)
+        {
+            std::vector<ShuffleWorkItem> work;
+            for (std::size_t i = 0; i < m_params.input_filenames.size(); ++i)
+            {
+                auto in = open_sfen_input_file(m_params.input_filenames[i]);
+                if (in == nullptr)
+                {
+                    std::cerr << "ERROR: Cannot open " << m_params.input_filenames[i] << ". Skipping...\n";
+                    continue;
+                }
+
+                const std::size_t num_chunks = in->num_chunks();
+                if (num_chunks == 0)
+                    work.push_back({ i, std::nullopt });
+                else
+                    for (std::size_t c = 0; c < num_chunks; ++c)
+                        work.push_back({ i, c });
+            }
+
+            std::atomic<std::size_t> next_item = 0;
+            std::atomic<std::uint64_t> num_read = 0;
+
+            Threads.execute_with_workers([&](Thread& th) {
+                BucketScatter scatter(buckets, m_prngs[th.id()]);
+
+                // Consecutive items usually belong to the same file.
+                std::size_t file_index = std::numeric_limits<std::size_t>::max();
+                std::unique_ptr<BasicSfenInputStream> in;
+                PSVector sfens;
+
+                for (std::size_t i = next_item++; i < work.size(); i = next_item++)
+                {
+                    const auto& item = work[i];
+                    if (item.file_index != file_index)
+                    {
+                        file_index = item.file_index;
+                        in = open_sfen_input_file(m_params.input_filenames[file_index]);
+                    }
+
+                    sfens.clear();
+                    if (item.chunk.has_value())
+                    {
+                        in->read_chunk(*item.chunk, sfens);
+                        scatter.add(sfens.data(), sfens.size());
+                        num_read += sfens.size();
+                    }
+                    else
+                    {
+                        sfens.resize(64 * 1024);
+                        for (std::size_t n; (n = in->read_batch(sfens.data(), sfens.size())) != 0; )
+                        {
+                            scatter.add(sfens.data(), n);
+                            num_read += n;
+                        }
+                    }
+                }
+
+                scatter.flush();
+            });
+            Threads.wait_for_workers_finished();
+
+            return num_read;
+        }
+
+        void gather_buckets(BucketSet& buckets)
+        {
+            std::atomic<std::size_t> next_bucket = 0;
+
+            Threads.execute_with_workers([&](Thread& th) {
+                PRNG& prng = m_prngs[th.id()];
+
+                for (std::size_t i = next_bucket++; i < buckets.size(); i = next_bucket++)
+                {
+                    shuffle_bucket(buckets.filename(i), prng);
+
+                    sync_region_cout.new_region() << "Shuffled bucket " << i + 1 << '/' << buckets.size() << '\n';
+                }
+            });
+            Threads.wait_for_workers_finished();
+        }
+
+        // Shuffles the bucket in memory and writes it to the output.
+        // Buckets that got larger than the budget are split further,
+        // this only happens if the number of entries was underestimated.
+        void shuffle_bucket(const std::string& filename, PRNG& prng)
+        {
+            std::error_code ec;
+            const std::uint64_t file_size = sys::file_size(filename, ec);
+            if (ec)
+                return;
+
+            if (file_size > 2 * bucket_budget())
+            {
+                const std::size_t num_parts = (file_size + bucket_budget() - 1) / bucket_budget();
+
+                std::vector<std::string> filenames;
+                for (std::size_t i = 0; i < num_parts; ++i)
+                    filenames.emplace_back(filename + "." + std::to_string(i));
+
+                BucketSet parts(std::move(filenames), 4096);
+                {
+                    BucketScatter scatter(parts, prng);
+                    BinSfenInputStream in(filename);
+                    PSVector sfens(64 * 1024);
+                    for (std::size_t n; (n = in.read_batch(sfens.data(), sfens.size())) != 0; )
+                        scatter.add(sfens.data(), n);
+
+                    scatter.flush();
+                }
+                sys::remove(filename, ec);
+
+                for (std::size_t i = 0; i < parts.size(); ++i)
+                    shuffle_bucket(parts.filename(i), prng);
+
+                return;
+            }
+
+            PSVector sfens(file_size / sizeof(PackedSfenValue));
+            {
+                std::ifstream in(filename, std::ios::in | std::ios::binary);
+                in.read(reinterpret_cast<char*>(sfens.data()), sizeof(PackedSfenValue) * sfens.size());
+                sfens.resize(in.gcount() / sizeof(PackedSfenValue));
+            }
+            sys::remove(filename, ec);
+
+            Algo::shuffle(sfens, prng);
+
+            std::lock_guard lock(m_out_mutex);
+            m_out->write(sfens);
+            m_num_written += sfens.size();
+        }
+
+        void remove_buckets(const BucketSet& buckets)
+        {
+            std::error_code ec;
+            for (std::size_t i = 0; i < buckets.size(); ++i)
+                sys::remove(buckets.filename(i), ec);
+        }
+    };
+
+    void shuffle(std::istringstream& is)
+    {
+        ShuffleParams params{};
+
+        while(true)
+        {
+            std::string token;
+            is >> token;
+
+            if (token == "")
+                break;
+
+            if (token == "input_file")
+            {
+                std::string filename;
+                is >> filename;
+                params.input_filenames.emplace_back(filename);
+            }
+            else if (token == "output_file")
+                is >> params.output_filename;
+            else if (token == "tmp_dir")
+                is >> params.tmp_dir;
+            else if (token == "memory")
+                is >> params.memory_mb;
+            else if (token == "buckets")
+                is >> params.num_buckets;
+            else if (token == "seed")
+                is >> params.seed;
+            else
+            {
+                std::cout << "ERROR: Unknown option " << token << ". Exiting...\n";
+                return;
+            }
+        }
+
+        params.enforce_constraints();
+
+        std::cout << "Performing shuffle with parameters:\n";
+        for (const auto& filename : params.input_filenames)
+            std::cout << "input_file          : " << filename << '\n';
+        std::cout << "output_file         : " << params.output_filename << '\n';
+        std::cout << "tmp_dir             : " << params.tmp_dir << '\n';
+        std::cout << "memory              : " << params.memory_mb << " MiB\n";
+        std::cout << "buckets             : " << (params.num_buckets ? std::to_string(params.num_buckets) : "auto") << '\n';
+        std::cout << "threads             : " << Threads.size() << '\n';
+        std::cout << '\n';
+
+        if (params.input_filenames.empty())
+        {
+            std::cout << "ERROR: No input files. Exiting...\n";
+            return;
+        }
+
+        if (   !has_extension(params.output_filename, BinSfenOutputStream::extension)
+            && !has_extension(params.output_filename, BinpackSfenOutputStream::extension)
+            && !has_extension(params.output_filename, VBinpackSfenOutputStream::extension))
+        {
+            std::cout << "ERROR: Unknown output file type " << params.output_filename << ". Exiting...\n";
+            return;
+        }
+
+        Shuffler(params).run();
+    }
+}
@@ -0,0 +1,12 @@
+#ifndef _SHUFFLE_H_
+#define _SHUFFLE_H_
+
+#include <sstream>
+
+namespace Stockfish::Tools {
+
+    void shuffle(std::istringstream& is);
+
+}
+
+#endif
@@ -3,11 +3,14 @@
 #include "sfen_stream.h"
 #include "packed_sfen.h"
 #include "sfen_writer.h"
+#include "sfen_packer.h"
 
 #include "thread.h"
 #include "position.h"
 #include "evaluate.h"
 #include "search.h"
+#include "uci.h"
+#include "variant.h"
 
 #include "nnue/evaluate_nnue.h"
 
@@ -284,7 +287,14 @@ namespace Stockfish::Tools::Stats
 
     struct StatisticGathererBase
     {
-        virtual void on_entry(const Position&, const Move&, const PackedSfenValue&) {}
+        // Called for every entry with the board decoded from the packed sfen.
+        virtual void on_entry(const CompactBoard&, const Move&, const PackedSfenValue&) {}
+
+        // Called for every entry with a fully set up position, but only
+        // if requires_position() returns true, as that is much slower.
+        virtual void on_position_entry(const Position&, const Move&, const PackedSfenValue&) {}
+        [[nodiscard]] virtual bool requires_position() const { return false; }
+
         virtual void reset() = 0;
         [[nodiscard]] virtual const std::string& get_name() const = 0;
         [[nodiscard]] virtual StatisticOutput get_output() const = 0;
@@ -334,14 +344,29 @@ namespace Stockfish::Tools::Stats
             }
         }
 
-        void on_entry(const Position& pos, const Move& move, const PackedSfenValue& psv) override
+        void on_entry(const CompactBoard& board, const Move& move, const PackedSfenValue& psv) override
         {
             for (auto& g : m_gatherers)
             {
-                g->on_entry(pos, move, psv);
+                g->on_entry(board, move, psv);
             }
         }
 
+        void on_position_entry(const Position& pos, const Move& move, const PackedSfenValue& psv) override
+        {
+            for (auto& g : m_gatherers)
+            {
+                if (g->requires_position())
+                    g->on_position_entry(pos, move, psv);
+            }
+        }
+
+        [[nodiscard]] bool requires_position() const override
+        {
+            return std::any_of(m_gatherers.begin(), m_gatherers.end(),
+                [](const auto& g) { return g->requires_position(); });
+        }
+
         void reset() override
         {
             for (auto& g : m_gatherers)
@@ -475,7 +500,7 @@ namespace Stockfish::Tools::Stats
         {
         }
 
-        void on_entry(const Position&, const Move&, const PackedSfenValue&) override
+        void on_entry(const CompactBoard&, const Move&, const PackedSfenValue&) override
         {
             m_num_positions += 1;
         }
@@ -512,10 +537,15 @@ namespace Stockfish::Tools::Stats
 
         }
 
-        void on_entry(const Position& pos, const Move&, const PackedSfenValue&) override
+        void on_entry(const CompactBoard& board, const Move&, const PackedSfenValue&) override
         {
-            m_white[pos.square<KING>(WHITE)] += 1;
-            m_black[pos.square<KING>(BLACK)] += 1;
+            // Variants may have no king, or more than one.
+            for (int i = 0; i < board.num_pieces; ++i)
+            {
+                const Piece pc = board.pieces[i];
+                if (type_of(pc) == KING)
+                    (color_of(pc) == WHITE ? m_white : m_black)[board.squares[i]] += 1;
+            }
         }
 
         void reset() override
@@ -554,12 +584,17 @@ namespace Stockfish::Tools::Stats
 
         }
 
-        void on_entry(const Position& pos, const Move& move, const PackedSfenValue&) override
+        void on_entry(const CompactBoard& board, const Move& move, const PackedSfenValue&) override
         {
-            if (pos.side_to_move() == WHITE)
-                m_white[from_sq(move)] += 1;
+            // Drops have no from square.
+            const Square from = from_sq(move);
+            if (!is_ok(from))
+                return;
+
+            if (board.side_to_move == WHITE)
+                m_white[from] += 1;
             else
-                m_black[from_sq(move)] += 1;
+                m_black[from] += 1;
         }
 
         void reset() override
@@ -598,9 +633,9 @@ namespace Stockfish::Tools::Stats
 
         }
 
-        void on_entry(const Position& pos, const Move& move, const PackedSfenValue&) override
+        void on_entry(const CompactBoard& board, const Move& move, const PackedSfenValue&) override
         {
-            if (pos.side_to_move() == WHITE)
+            if (board.side_to_move == WHITE)
                 m_white[to_sq(move)] += 1;
             else
                 m_black[to_sq(move)] += 1;
@@ -646,11 +681,11 @@ namespace Stockfish::Tools::Stats
 
         }
 
-        void on_entry(const Position& pos, const Move& move, const PackedSfenValue&) override
+        void on_entry(const CompactBoard& board, const Move& move, const PackedSfenValue&) override
         {
             m_total += 1;
 
-            if (!pos.empty(to_sq(move)))
+            if (board.piece_on(to_sq(move)) != NO_PIECE)
                 m_capture += 1;
 
             if (type_of(move) == CASTLING)
@@ -709,9 +744,9 @@ namespace Stockfish::Tools::Stats
             reset();
         }
 
-        void on_entry(const Position& pos, const Move&, const PackedSfenValue&) override
+        void on_entry(const CompactBoard& board, const Move&, const PackedSfenValue&) override
         {
-            m_piece_count_hist[popcount(pos.pieces())] += 1;
+            m_piece_count_hist[board.num_pieces] += 1;
         }
 
         void reset() override
@@ -757,9 +792,12 @@ namespace Stockfish::Tools::Stats
             reset();
         }
 
-        void on_entry(const Position& pos, const Move& move, const PackedSfenValue&) override
+        void on_entry(const CompactBoard& board, const Move& move, const PackedSfenValue&) override
         {
-            m_moved_piece_type_hist[type_of(pos.piece_on(from_sq(move)))] += 1;
+            // Drops have no from square.
+            const Square from = from_sq(move);
+            if (is_ok(from))
+                m_moved_piece_type_hist[type_of(board.piece_on(from))] += 1;
         }
 
         void reset() override
@@ -799,9 +837,9 @@ namespace Stockfish::Tools::Stats
             reset();
         }
 
-        void on_entry(const Position& pos, const Move&, const PackedSfenValue&) override
+        void on_entry(const CompactBoard& board, const Move&, const PackedSfenValue&) override
         {
-            const int current_ply = pos.game_ply();
+            const int current_ply = board.game_ply;
             if (m_prev_ply != -1)
             {
                 const bool is_discontinuity = (current_ply != (m_prev_ply + 1));
@@ -846,9 +884,9 @@ namespace Stockfish::Tools::Stats
             reset();
         }
 
-        void on_entry(const Position& pos, const Move&, const PackedSfenValue&) override
+        void on_entry(const CompactBoard& board, const Move&, const PackedSfenValue&) override
         {
-            const int imbalance = get_simple_material(pos, WHITE) - get_simple_material(pos, BLACK);
+            const int imbalance = get_simple_material(board, WHITE) - get_simple_material(board, BLACK);
             const int imbalance_idx = std::clamp(imbalance, -max_imbalance, max_imbalance) + max_imbalance;
             m_num_imbalances[imbalance_idx] += 1;
         }
@@ -893,14 +931,14 @@ namespace Stockfish::Tools::Stats
     private:
         std::uint64_t m_num_imbalances[max_imbalance + 1 + max_imbalance];
 
-        [[nodiscard]] int get_simple_material(const Position& pos, Color c)
+        [[nodiscard]] int get_simple_material(const CompactBoard& board, Color c)
         {
             return
-                  9 * pos.count<QUEEN>(c)
-                + 5 * pos.count<ROOK>(c)
-                + 3 * pos.count<BISHOP>(c)
-                + 3 * pos.count<KNIGHT>(c)
-                +     pos.count<PAWN>(c);
+                  9 * board.count(c, QUEEN)
+                + 5 * board.count(c, ROOK)
+                + 3 * board.count(c, BISHOP)
+                + 3 * board.count(c, KNIGHT)
+                +     board.count(c, PAWN);
         }
     };
 
@@ -913,9 +951,9 @@ namespace Stockfish::Tools::Stats
             reset();
         }
 
-        void on_entry(const Position& pos, const Move&, const PackedSfenValue& psv) override
+        void on_entry(const CompactBoard& board, const Move&, const PackedSfenValue& psv) override
         {
-            const Color stm = pos.side_to_move();
+            const Color stm = board.side_to_move;
             if (psv.game_result == 0)
             {
                 m_draws += 1;
@@ -980,15 +1018,15 @@ namespace Stockfish::Tools::Stats
             reset();
         }
 
-        void on_entry(const Position& pos, const Move&, const PackedSfenValue& psv) override
+        void on_entry(const CompactBoard& board, const Move&, const PackedSfenValue& psv) override
         {
-            const int piece_count = pos.count<ALL_PIECES>();
+            const int piece_count = board.num_pieces;
             if (piece_count > MaxManCount)
             {
                 return;
             }
 
-            const auto index = get_material_key_for_position(pos);
+            const auto index = get_material_key_for_position(board);
             auto& entry = m_entries[index];
             entry.count += 1;
             if (psv.game_result == 0)
@@ -997,7 +1035,7 @@ namespace Stockfish::Tools::Stats
             }
             else
             {
-                const Color winner_side = psv.game_result == 1 ? pos.side_to_move() : ~pos.side_to_move();
+                const Color winner_side = psv.game_result == 1 ? board.side_to_move : ~board.side_to_move;
                 if (winner_side == WHITE)
                 {
                     entry.white_wins += 1;
@@ -1066,27 +1104,27 @@ namespace Stockfish::Tools::Stats
         // v=1, P=2, N=3, B=4, R=5, Q=6, K=7. 0 indicates end
         std::map<MaterialKey, Entry> m_entries;
 
-        [[nodiscard]] MaterialKey get_material_key_for_position(const Position& pos) const
+        [[nodiscard]] MaterialKey get_material_key_for_position(const CompactBoard& board) const
         {
             MaterialKey index = 0;
             std::uint64_t shift = 0;
 
             index += 7 << shift; shift += 3;
 
-            for (int i = 0; i < pos.count<PAWN>(WHITE); ++i) { index += 2 << shift; shift += 3; }
-            for (int i = 0; i < pos.count<BISHOP>(WHITE); ++i) { index += 3 << shift; shift += 3; }
-            for (int i = 0; i < pos.count<KNIGHT>(WHITE); ++i) { index += 4 << shift; shift += 3; }
-            for (int i = 0; i < pos.count<ROOK>(WHITE); ++i) { index += 5 << shift; shift += 3; }
-            for (int i = 0; i < pos.count<QUEEN>(WHITE); ++i) { index += 6 << shift; shift += 3; }
+            for (int i = 0; i < board.count(WHITE, PAWN); ++i) { index += 2 << shift; shift += 3; }
+            for (int i = 0; i < board.count(WHITE, BISHOP); ++i) { index += 3 << shift; shift += 3; }
+            for (int i = 0; i < board.count(WHITE, KNIGHT); ++i) { index += 4 << shift; shift += 3; }
+            for (int i = 0; i < board.count(WHITE, ROOK); ++i) { index += 5 << shift; shift += 3; }
+            for (int i = 0; i < board.count(WHITE, QUEEN); ++i) { index += 6 << shift; shift += 3; }
 
             index += 1 << shift; shift += 3;
             index += 7 << shift; shift += 3;
 
-            for (int i = 0; i < pos.count<PAWN>(BLACK); ++i) { index += 2 << shift; shift += 3; }
-            for (int i = 0; i < pos.count<BISHOP>(BLACK); ++i) { index += 3 << shift; shift += 3; }
-            for (int i = 0; i < pos.count<KNIGHT>(BLACK); ++i) { index += 4 << shift; shift += 3; }
-            for (int i = 0; i < pos.count<ROOK>(BLACK); ++i) { index += 5 << shift; shift += 3; }
-            for (int i = 0; i < pos.count<QUEEN>(BLACK); ++i) { index += 6 << shift; shift += 3; }
+            for (int i = 0; i < board.count(BLACK, PAWN); ++i) { index += 2 << shift; shift += 3; }
+            for (int i = 0; i < board.count(BLACK, BISHOP); ++i) { index += 3 << shift; shift += 3; }
+            for (int i = 0; i < board.count(BLACK, KNIGHT); ++i) { index += 4 << shift; shift += 3; }
+            for (int i = 0; i < board.count(BLACK, ROOK); ++i) { index += 5 << shift; shift += 3; }
+            for (int i = 0; i < board.count(BLACK, QUEEN); ++i) { index += 6 << shift; shift += 3; }
 
             return index;
         }
@@ -1193,11 +1231,12 @@ namespace Stockfish::Tools::Stats
         Position& pos = th->rootPos;
         StateInfo si;
 
-        auto in = Tools::open_sfen_input_file(filename);
+        // Setting up a Position is only needed for some gatherers.
+        const Variant* variant = variants.find(Options["UCI_Variant"])->second;
+        const bool requires_position = statistic_gatherers.requires_position();
+        CompactBoard board;
 
-        auto on_entry = [&](const Position& position, const Move& move, const PackedSfenValue& psv) {
-            statistic_gatherers.on_entry(position, move, psv);
-        };
+        auto in = Tools::open_sfen_input_file(filename);
 
         if (in == nullptr)
         {
@@ -1205,23 +1244,38 @@ namespace Stockfish::Tools::Stats
             return;
         }
 
+        constexpr std::uint64_t batch_size = 64 * 1024;
+
+        PSVector batch(batch_size);
+
         uint64_t num_processed = 0;
         while (num_processed < max_count)
         {
-            auto v = in->next();
-            if (!v.has_value())
+            const auto num_read = in->read_batch(batch.data(), std::min(batch_size, max_count - num_processed));
+            if (num_read == 0)
                 break;
 
-            auto& psv = v.value();
+            for (std::size_t i = 0; i < num_read; ++i)
+            {
+                const auto& psv = batch[i];
 
-            pos.set_from_packed_sfen(psv.sfen, &si, th);
+                // Malformed entries are skipped.
+                if (decode_packed_sfen(psv.sfen, variant, board) == 0)
+                {
+                    statistic_gatherers.on_entry(board, (Move)psv.move, psv);
 
-            on_entry(pos, (Move)psv.move, psv);
+                    if (requires_position)
+                    {
+                        pos.set_from_packed_sfen(psv.sfen, &si, th);
+                        statistic_gatherers.on_position_entry(pos, (Move)psv.move, psv);
+                    }
+                }
 
-            num_processed += 1;
-            if (num_processed % 1'000'000 == 0)
-            {
-                std::cout << "Processed " << num_processed << " positions.\n";
+                num_processed += 1;
+                if (num_processed % 1'000'000 == 0)
+                {
+                    std::cout << "Processed " << num_processed << " positions.\n";
+                }
             }
         }
 
@@ -3,6 +3,7 @@
 #include "sfen_writer.h"
 #include "packed_sfen.h"
 #include "opening_book.h"
+#include "dedup_filter.h"
 
 #include "misc.h"
 #include "position.h"
@@ -23,6 +24,7 @@
 #include <climits>
 #include <cmath>
 #include <cstring>
+#include <filesystem>
 #include <fstream>
 #include <iomanip>
 #include <limits>
@@ -36,8 +38,122 @@
 
 using namespace std;
 
+namespace sys = std::filesystem;
+
 namespace Stockfish::Tools
 {
+    // Everything needed to continue an interrupted generate_training_data
+    // run as if it was never interrupted. Stored as "key value" lines
+    // next to the output file.
+    struct TrainingDataCheckpoint
+    {
+        static constexpr int VERSION = 1;
+
+        // Number of sfens written.
+        uint64_t count = 0;
+
+        uint64_t num_threads = 0;
+        SfenOutputType data_format = SfenOutputType::Binpack;
+
+        // State of the first PRNG when the opening book was shuffled.
+        uint64_t initial_prng = 0;
+        std::vector<uint64_t> prngs;
+
+        uint64_t book_index = 0;
+
+        SfenWriterCheckpoint writer;
+
+        static std::string path_for(const std::string& output_file_name)
+        {
+            return output_file_name + ".checkpoint";
+        }
+
+        // Writes to a temporary file first and renames it, so that
+        // a crash never leaves a partially written checkpoint behind.
+        bool save(const std::string& path) const
+        {
+            const std::string tmp_path = path + ".tmp";
+
+            {
+                std::ofstream out(tmp_path, std::ios::out | std::ios::trunc);
+
+                out << "version " << VERSION << '\n'
+                    << "count " << count << '\n'
+                    << "num_threads " << num_threads << '\n'
+                    << "data_format " << static_cast<int>(data_format) << '\n'
+                    << "initial_prng " << initial_prng << '\n';
+
+                for (auto s : prngs)
+                    out << "prng " << s << '\n';
+
+                out << "book_index " << book_index << '\n'
+                    << "write_count " << writer.write_count << '\n'
+                    << "write_count_current_file " << writer.write_count_current_file << '\n'
+                    << "file_number " << writer.file_number << '\n'
+                    << "file_size " << writer.file_size << '\n'
+                    << "index_size " << writer.index_size << '\n';
+
+                out.flush();
+                if (!out)
+                    return false;
+            }
+
+            std::error_code ec;
+            sys::rename(tmp_path, path, ec);
+            return !ec;
+        }
+
+        static std::optional<TrainingDataCheckpoint> load(const std::string& path)
+        {
+            std::ifstream in(path);
+            if (!in)
+                return std::nullopt;
+
+            TrainingDataCheckpoint cp;
+            int version = 0;
+
+            std::string key;
+            while (in >> key)
+            {
+                if (key == "version")
+                    in >> version;
+                else if (key == "count")
+                    in >> cp.count;
+                else if (key == "num_threads")
+                    in >> cp.num_threads;
+                else if (key == "data_format")
+                {
+                    int format;
+                    in >> format;
+                    cp.data_format = static_cast<SfenOutputType>(format);
+                }
+                else if (key == "initial_prng")
+                    in >> cp.initial_prng;
+                else if (key == "prng")
+                    in >> cp.prngs.emplace_back();
+                else if (key == "book_index")
+                    in >> cp.book_index;
+                else if (key == "write_count")
+                    in >> cp.writer.write_count;
+                else if (key == "write_count_current_file")
+                    in >> cp.writer.write_count_current_file;
+                else if (key == "file_number")
+                    in >> cp.writer.file_number;
+                else if (key == "file_size")
+                    in >> cp.writer.file_size;
+                else if (key == "index_size")
+                    in >> cp.writer.index_size;
+                else
+                    return std::nullopt;
+            }
+
+            if (version != VERSION || cp.prngs.size() != cp.num_threads)
+                return std::nullopt;
+
+            return cp;
+        }
+    };
+
     // Class to generate sfen with multiple threads
     struct TrainingDataGenerator
     {
@@ -90,6 +206,10 @@ namespace Stockfish::Tools
 
             SfenOutputType sfen_format = SfenOutputType::Binpack;
 
+            SfenWriterParams writer_params;
+
+            DedupFilterParams dedup_params;
+
             std::string seed;
 
             bool write_out_draw_game_in_training_data_generation = true;
@@ -100,6 +220,12 @@ namespace Stockfish::Tools
 
             std::string book;
 
+            // Save a checkpoint every this many sfens. 0 disables checkpoints.
+            uint64_t checkpoint_every = 0;
+
+            // Continue from this checkpoint instead of starting anew.
+            std::optional<TrainingDataCheckpoint> resume_from;
+
             void enforce_constraints()
             {
                 search_depth_max = std::max(search_depth_min, search_depth_max);
@@ -115,22 +241,18 @@ namespace Stockfish::Tools
             }
         };
 
-        // Hash to limit the export of identical sfens
-        static constexpr uint64_t GENSFEN_HASH_SIZE = 64 * 1024 * 1024;
-        // It must be 2**N because it will be used as the mask to calculate hash_index.
-        static_assert((GENSFEN_HASH_SIZE& (GENSFEN_HASH_SIZE - 1)) == 0);
-
         static constexpr uint64_t REPORT_DOT_EVERY = 5000;
         static constexpr uint64_t REPORT_STATS_EVERY = 200000;
         static_assert(REPORT_STATS_EVERY % REPORT_DOT_EVERY == 0);
 
         TrainingDataGenerator(
-            const Params& prm
+            const Params& prm,
+            std::unique_ptr<DedupFilter> filter
         ) :
             params(prm),
-            sfen_writer(prm.output_file_name, prm.num_threads, prm.save_every, prm.sfen_format)
+            sfen_writer(prm.output_file_name, prm.num_threads, prm.save_every, prm.sfen_format, prm.writer_params),
+            dedup_filter(std::move(filter))
         {
-            hash.resize(GENSFEN_HASH_SIZE);
             prngs.reserve(prm.num_threads);
             auto seed = prm.seed;
             for (uint64_t i = 0; i < prm.num_threads; ++i)
@@ -139,6 +261,12 @@ namespace Stockfish::Tools
                 seed = prngs.back().next_random_seed();
             }
 
+            // The book has to be shuffled the same way as in the interrupted run.
+            if (prm.resume_from.has_value())
+                prngs[0].set_seed(prm.resume_from->initial_prng);
+
+            initial_prng = prngs[0].get_seed();
+
             if (!prm.book.empty())
             {
                 opening_book = open_opening_book(prm.book, prngs[0]);
@@ -148,6 +276,15 @@ namespace Stockfish::Tools
                 }
             }
 
+            if (prm.resume_from.has_value())
+            {
+                for (uint64_t i = 0; i < prm.num_threads; ++i)
+                    prngs[i].set_seed(prm.resume_from->prngs[i]);
+
+                if (opening_book != nullptr)
+                    opening_book->set_current_index(prm.resume_from->book_index);
+            }
+
             // Output seed to verify by the user if it's not identical by chance.
             std::cout << prngs[0] << std::endl;
         }
@@ -158,6 +295,7 @@ namespace Stockfish::Tools
         Params params;
 
         std::vector<PRNG> prngs;
+        uint64_t initial_prng;
 
         std::mutex stats_mutex;
         TimePoint last_stats_report_time;
@@ -167,12 +305,15 @@ namespace Stockfish::Tools
 
         SynchronizedRegionLogger::Region out;
 
-        vector<Key> hash; // 64MB*sizeof(HASH_KEY) = 512MB
+        // Limits the export of identical sfens
+        std::unique_ptr<DedupFilter> dedup_filter;
 
         std::unique_ptr<OpeningBook> opening_book;
 
         static void set_gensfen_search_limits();
 
+        void save_checkpoint(uint64_t done);
+
         void generate_worker(
             Thread& th,
             std::atomic<uint64_t>& counter,
@@ -231,13 +372,35 @@ namespace Stockfish::Tools
 
         set_gensfen_search_limits();
 
-        std::atomic<uint64_t> counter{0};
-        Threads.execute_with_workers([&counter, limit, this](Thread& th) {
-            generate_worker(th, counter, limit);
-        });
-        Threads.wait_for_workers_finished();
+        uint64_t done = params.resume_from.has_value() ? params.resume_from->count : 0;
+
+        // Without checkpoints everything is generated in one go. Otherwise
+        // the work is split into epochs with a checkpoint after each one.
+        // Every epoch starts from a clean search state so that a resumed
+        // run searches like the uninterrupted one would. The dedup filter
+        // is not part of the checkpoint and keeps its keys across epochs.
+        while (done < limit)
+        {
+            const uint64_t epoch_limit = params.checkpoint_every == 0
+                ? limit
+                : std::min(limit, done + params.checkpoint_every);
+
+            if (params.checkpoint_every != 0)
+                Search::clear();
+
+            std::atomic<uint64_t> counter{done};
+            Threads.execute_with_workers([&counter, epoch_limit, this](Thread& th) {
+                generate_worker(th, counter, epoch_limit);
+            });
+            Threads.wait_for_workers_finished();
+
+            sfen_writer.flush();
 
-        sfen_writer.flush();
+            done = epoch_limit;
+
+            if (params.checkpoint_every != 0)
+                save_checkpoint(done);
+        }
 
         if (limit % REPORT_STATS_EVERY != 0)
         {
@@ -245,6 +408,28 @@ namespace Stockfish::Tools
         }
 
         std::cout << std::endl;
+
+        const uint64_t queries = dedup_filter->get_num_queries();
+        const uint64_t rejected = dedup_filter->get_num_rejected();
+        std::cout << "INFO: The dedup filter rejected " << rejected << " of " << queries << " positions ("
+                  << std::fixed << std::setprecision(2) << (queries ? 100.0 * rejected / queries : 0.0) << "%).\n"
+                  << std::defaultfloat;
+    }
+
+    void TrainingDataGenerator::save_checkpoint(uint64_t done)
+    {
+        TrainingDataCheckpoint cp;
+        cp.count = done;
+        cp.num_threads = params.num_threads;
+        cp.data_format = params.sfen_format;
+        cp.initial_prng = initial_prng;
+        for (auto& prng : prngs)
+            cp.prngs.emplace_back(prng.get_seed());
+        cp.book_index = opening_book != nullptr ? opening_book->get_current_index() : 0;
+        cp.writer = sfen_writer.checkpoint();
+
+        if (!cp.save(TrainingDataCheckpoint::path_for(params.output_file_name)))
+            std::cout << "WARNING: Failed to save the checkpoint after " << done << " sfens.\n";
     }
 
     void TrainingDataGenerator::generate_worker(
@@ -274,7 +459,7 @@ namespace Stockfish::Tools
             auto& pos = th.rootPos;
             if (opening_book != nullptr)
             {
-                auto& fen = opening_book->next_fen();
+                const auto fen = opening_book->next_fen();
                 pos.set(variants.find(Options["UCI_Variant"])->second, fen, false, &si, &th);
             }
             else
@@ -358,7 +543,7 @@ namespace Stockfish::Tools
                 if (ply >= params.write_minply && !was_seen_before(pos)
                     && !pos.checkers() && pos.nnue_applicable() && std::abs(qsearch_value - eval_value) <= params.eval_diff_limit)
                 {
-                    auto& psv = packed_sfens.emplace_back();
+                    auto& psv = packed_sfens.emplace_back(PackedSfenValue{});
 
                     // Here we only write the position data.
                     // Result is added after the whole game is done.
@@ -404,23 +589,11 @@ namespace Stockfish::Tools
 
     bool TrainingDataGenerator::was_seen_before(const Position& pos)
     {
-        // Look into the position hashtable to see if the same
+        // Look into the dedup filter to see if the same
         // position was seen before.
         // This is a good heuristic to exclude already seen
         // positions without many false positives.
-        auto key = pos.key();
-        auto hash_index = (size_t)(key & (GENSFEN_HASH_SIZE - 1));
-        auto old_key = hash[hash_index];
-        if (key == old_key)
-        {
-            return true;
-        }
-        else
-        {
-            // Replace with the current key.
-            hash[hash_index] = key;
-            return false;
-        }
+        return dedup_filter->test_and_insert(pos.key());
     }
 
     optional<int8_t> TrainingDataGenerator::get_current_game_result(
@@ -740,6 +913,11 @@ namespace Stockfish::Tools
         bool random_file_name = false;
         std::string sfen_format = "binpack";
 
+        // Continue from the checkpoint of an interrupted run.
+        bool resume = false;
+
+        std::string dedup_filter_type = "table";
+
         string token;
         while (true)
         {
@@ -789,6 +967,18 @@ namespace Stockfish::Tools
                 is >> params.save_every;
             else if (token == "book")
                 is >> params.book;
+            else if (token == "checkpoint_every")
+                is >> params.checkpoint_every;
+            else if (token == "resume")
+                is >> resume;
+            else if (token == "dedup_filter")
+                is >> dedup_filter_type;
+            else if (token == "dedup_capacity")
+                is >> params.dedup_params.capacity;
+            else if (token == "dedup_fp_rate")
+                is >> params.dedup_params.fp_rate;
+            else if (token == "dedup_file")
+                is >> params.dedup_params.file;
             else if (token == "random_file_name")
                 is >> random_file_name;
             else if (token == "keep_draws")
@@ -801,6 +991,12 @@ namespace Stockfish::Tools
                 is >> sfen_format;
             else if (token == "seed")
                 is >> params.seed;
+            else if (token == "writer_threads")
+                is >> params.writer_params.num_encoder_threads;
+            else if (token == "writer_memory")
+                is >> params.writer_params.max_pending_mb;
+            else if (token == "writer_ordered")
+                is >> params.writer_params.ordered;
             else if (token == "set_recommended_uci_options")
             {
                 UCI::setoption("Skill Level", "20");
@@ -825,10 +1021,17 @@ namespace Stockfish::Tools
                 params.sfen_format = SfenOutputType::Bin2;
             else if (sfen_format == "binpack")
                 params.sfen_format = SfenOutputType::Binpack;
+            else if (sfen_format == "vbinpack")
+                params.sfen_format = SfenOutputType::VBinpack;
             else
                 cout << "WARNING: Unknown sfen format `" << sfen_format << "`. Using bin\n";
         }
 
+        if (const auto type = dedup_filter_type_from_string(dedup_filter_type); type.has_value())
+            params.dedup_params.type = *type;
+        else
+            cout << "WARNING: Unknown dedup filter `" << dedup_filter_type << "`. Using table\n";
+
         if (random_file_name)
         {
             // Give a random number to output_file_name at this point.
@@ -877,14 +1080,61 @@ namespace Stockfish::Tools
             << "  - random_file_name       = " << random_file_name << endl
             << "  - write_drawn_games      = " << params.write_out_draw_game_in_training_data_generation << endl
             << "  - draw by low score      = " << params.detect_draw_by_consecutive_low_score << endl
-            << "  - draw by insuff. mat.   = " << params.detect_draw_by_insufficient_mating_material << endl;
+            << "  - draw by insuff. mat.   = " << params.detect_draw_by_insufficient_mating_material << endl
+            << "  - writer_threads         = " << params.writer_params.num_encoder_threads << endl
+            << "  - writer_memory          = " << params.writer_params.max_pending_mb << endl
+            << "  - writer_ordered         = " << params.writer_params.ordered << endl
+            << "  - checkpoint_every       = " << params.checkpoint_every << endl
+            << "  - resume                 = " << resume << endl
+            << "  - dedup_filter           = " << dedup_filter_type << endl
+            << "  - dedup_capacity         = " << params.dedup_params.capacity << endl
+            << "  - dedup_fp_rate          = " << params.dedup_params.fp_rate << endl
+            << "  - dedup_file             = " << params.dedup_params.file << endl;
+
+        if (resume)
+        {
+            const auto checkpoint_path = TrainingDataCheckpoint::path_for(params.output_file_name);
+            params.resume_from = TrainingDataCheckpoint::load(checkpoint_path);
+
+            if (!params.resume_from.has_value())
+            {
+                cout << "ERROR: Failed to read the checkpoint " << checkpoint_path << ". Exiting...\n";
+                return;
+            }
+
+            if (params.resume_from->num_threads != params.num_threads
+                || params.resume_from->data_format != params.sfen_format)
+            {
+                cout << "ERROR: The checkpoint was made with a different number of threads or data format. Exiting...\n";
+                return;
+            }
+
+            if (!SfenWriter::restore_output(params.output_file_name, params.sfen_format, params.resume_from->writer))
+            {
+                cout << "ERROR: The output doesn't match the checkpoint. Exiting...\n";
+                return;
+            }
+
+            params.writer_params.resume_from = params.resume_from->writer;
+
+            cout << "INFO: Resuming after " << params.resume_from->count << " sfens.\n";
+        }
 
         // Show if the training data generator uses NNUE.
         Eval::NNUE::verify();
 
         Threads.main()->ponder = false;
 
-        TrainingDataGenerator gensfen(params);
+        auto dedup_filter = create_dedup_filter(params.dedup_params);
+        if (dedup_filter == nullptr)
+        {
+            cout << "ERROR: Failed to create the dedup filter. Exiting...\n";
+            return;
+        }
+
+        cout << "INFO: Dedup filter: " << dedup_filter->describe() << endl;
+
+        TrainingDataGenerator gensfen(params, std::move(dedup_filter));
         gensfen.generate(loop_max);
 
         std::cout << "INFO: generate_training_data finished." << endl;
@@ -1,6 +1,7 @@
 ﻿#include "training_data_generator_nonpv.h"
 
 #include "sfen_writer.h"
+#include "blocking_queue.h"
 #include "packed_sfen.h"
 #include "opening_book.h"
 
@@ -16,6 +17,7 @@
 
 #include "syzygy/tbprobe.h"
 
+#include <algorithm>
 #include <atomic>
 #include <chrono>
 #include <climits>
@@ -61,6 +63,18 @@ namespace Stockfish::Tools
 
             int exploration_min_pieces = 8;
 
+            // The number of exploration games played before the positions
+            // saved from them are rescored
+            int exploration_batch_size = 1;
+
+            // The number of threads that only explore and hand the saved
+            // positions to the remaining threads, which only rescore them.
+            // With 0 every thread does both.
+            int exploration_threads = 0;
+
+            // The maximum number of explored batches waiting to be rescored
+            int exploration_queue_size = 16;
+
             std::string output_file_name = "training_data_nonpv";
 
             SfenOutputType sfen_format = SfenOutputType::Binpack;
@@ -80,8 +94,14 @@ namespace Stockfish::Tools
                 exploration_eval_limit = std::min(eval_limit, (int)mate_in(2));
                 exploration_min_nodes = std::max(100, exploration_min_nodes);
                 exploration_max_nodes = std::max(exploration_min_nodes, exploration_max_nodes);
+                exploration_max_ply = std::max(1, exploration_max_ply);
+                exploration_batch_size = std::max(1, exploration_batch_size);
+                exploration_queue_size = std::max(1, exploration_queue_size);
 
                 num_threads = Options["Threads"];
+
+                // At least one thread must be left for rescoring.
+                exploration_threads = std::clamp(exploration_threads, 0, num_threads - 1);
             }
         };
 
@@ -93,12 +113,18 @@ namespace Stockfish::Tools
             const Params& prm
         ) :
             params(prm),
-            prng(prm.seed),
             sfen_writer(prm.output_file_name, prm.num_threads, std::numeric_limits<uint64_t>::max(), prm.sfen_format)
         {
+            // Every thread draws from its own stream, so the threads don't
+            // contend for a shared generator.
+            prngs.reserve(prm.num_threads);
+            prngs.emplace_back(prm.seed);
+            for (int i = 1; i < prm.num_threads; ++i)
+                prngs.emplace_back(prngs.back().next_random_seed());
+
             if (!prm.book.empty())
             {
-                opening_book = open_opening_book(prm.book, prng);
+                opening_book = open_opening_book(prm.book, prngs[0]);
                 if (opening_book == nullptr)
                 {
                     std::cout << "WARNING: Failed to open opening book " << prm.book << ". Falling back to startpos.\n";
@@ -106,7 +132,7 @@ namespace Stockfish::Tools
             }
 
             // Output seed to verify by the user if it's not identical by chance.
-            std::cout << prng << std::endl;
+            std::cout << prngs[0] << std::endl;
         }
 
         void generate(uint64_t limit);
@@ -114,7 +140,7 @@ namespace Stockfish::Tools
     private:
         Params params;
 
-        PRNG prng;
+        std::vector<PRNG> prngs;
 
         std::mutex stats_mutex;
         TimePoint last_stats_report_time;
@@ -133,16 +159,45 @@ namespace Stockfish::Tools
             std::atomic<uint64_t>& counter,
             uint64_t limit);
 
+        void exploration_worker(
+            Thread& th,
+            BoundedBlockingQueue<PSVector>& explored,
+            BoundedBlockingQueue<PSVector>& recycled);
+
+        void rescoring_worker(
+            Thread& th,
+            BoundedBlockingQueue<PSVector>& explored,
+            BoundedBlockingQueue<PSVector>& recycled,
+            std::atomic<uint64_t>& counter,
+            uint64_t limit);
+
         bool commit_psv(
             Thread& th,
             PSVector& sfens,
             std::atomic<uint64_t>& counter,
             uint64_t limit);
 
-        PSVector do_exploration(
+        // Buffers of a worker, reused for all of its batches. With
+        // exploration_threads the explored buffers are passed on to the
+        // rescoring threads, which return them when they are done.
+        struct WorkerBuffers
+        {
+            std::vector<StateInfo, AlignedAllocator<StateInfo>> states;
+            StateInfo si;
+            PSVector explored;
+            PSVector scored;
+        };
+
+        void do_exploration(
             Thread& th,
+            WorkerBuffers& buffers,
             int count);
 
+        void rescore(
+            Thread& th,
+            WorkerBuffers& buffers,
+            const PSVector& explored);
+
         void report(uint64_t done, uint64_t new_done);
 
         void maybe_report(uint64_t done);
@@ -174,10 +229,41 @@ namespace Stockfish::Tools
         set_gensfen_search_limits();
 
         std::atomic<uint64_t> counter{0};
-        Threads.execute_with_workers([&counter, limit, this](Thread& th) {
-            generate_worker(th, counter, limit);
-        });
-        Threads.wait_for_workers_finished();
+
+        if (params.exploration_threads == 0)
+        {
+            Threads.execute_with_workers([&counter, limit, this](Thread& th) {
+                generate_worker(th, counter, limit);
+            });
+            Threads.wait_for_workers_finished();
+        }
+        else
+        {
+            // The first exploration_threads threads explore, the others
+            // rescore what they find.
+            BoundedBlockingQueue<PSVector> explored(params.exploration_queue_size);
+
+            // Rescored buffers on their way back to the exploration threads.
+            // It can hold every buffer there is, so returning one never blocks.
+            BoundedBlockingQueue<PSVector> recycled(params.exploration_queue_size + params.num_threads);
+
+            Threads.execute_with_workers([&explored, &recycled, &counter, limit, this](Thread& th) {
+                if (th.id() < static_cast<size_t>(params.exploration_threads))
+                    exploration_worker(th, explored, recycled);
+                else
+                    rescoring_worker(th, explored, recycled, counter, limit);
+            });
+            Threads.wait_for_workers_finished();
+
+            // Time blocked on either side of the queue tells which stage
+            // should get more threads.
+            const auto push_stats = explored.get_push_wait_stats();
+            const auto pop_stats = explored.get_pop_wait_stats();
+            std::cout
+                << "\nINFO: Exploration waited " << push_stats.num_waits << " times for "
+                << push_stats.wait_time_us / 1000 << " ms in total, rescoring waited "
+                << pop_stats.num_waits << " times for " << pop_stats.wait_time_us / 1000 << " ms in total.";
+        }
 
         sfen_writer.flush();
 
@@ -189,38 +275,33 @@ namespace Stockfish::Tools
         std::cout << std::endl;
     }
 
-    PSVector TrainingDataGeneratorNonPv::do_exploration(
+    void TrainingDataGeneratorNonPv::do_exploration(
         Thread& th,
+        WorkerBuffers& buffers,
         int count)
     {
         constexpr int max_depth = 30;
 
-        PSVector psv;
+        auto& prng = prngs[th.id()];
 
-        std::vector<StateInfo, AlignedAllocator<StateInfo>> states(
-            max_depth + MAX_PLY /* == search_depth_min + α */);
-
-        th.set_eval_callback([this, &psv](Position& pos) {
-            if ((double)prng.rand<uint64_t>() / std::numeric_limits<uint64_t>::max() < params.exploration_save_rate)
-            {
-                psv.emplace_back();
-                pos.sfen_pack(psv.back().sfen);
-            }
-        });
+        // Positions evaluated by the exploration searches are saved at random.
+        buffers.explored.clear();
+        th.evalSampler.start(params.exploration_save_rate, prng.rand<uint64_t>(), buffers.explored);
 
         auto& pos = th.rootPos;
-        StateInfo si;
+
+        const Variant* variant = variants.find(Options["UCI_Variant"])->second;
 
         for (int i = 0; i < count; ++i)
         {
             if (opening_book != nullptr)
             {
-                auto& fen = opening_book->next_fen();
-                pos.set(pos.variant(), fen, false, &si, &th);
+                const auto fen = opening_book->next_fen();
+                pos.set(variant, fen, false, &buffers.si, &th);
             }
             else
             {
-                pos.set(pos.variant(), pos.variant()->startFen, false, &si, &th);
+                pos.set(variant, variant->startFen, false, &buffers.si, &th);
             }
 
             for(int ply = 0; ply < params.exploration_max_ply; ++ply)
@@ -239,7 +320,7 @@ namespace Stockfish::Tools
                     break;
                 }
 
-                pos.do_move(search_pv[0], states[ply]);
+                pos.do_move(search_pv[0], buffers.states[ply]);
 
                 if (popcount(pos.pieces()) < params.exploration_min_pieces)
                 {
@@ -248,9 +329,7 @@ namespace Stockfish::Tools
             }
         }
 
-        th.clear_eval_callback();
-
-        return psv;
+        th.evalSampler.stop();
     }
 
     void TrainingDataGeneratorNonPv::generate_worker(
@@ -258,11 +337,8 @@ namespace Stockfish::Tools
         std::atomic<uint64_t>& counter,
         uint64_t limit)
     {
-        constexpr int exploration_batch_size = 1;
-
-        StateInfo si;
-
-        PSVector psv;
+        WorkerBuffers buffers;
+        buffers.states.resize(params.exploration_max_ply);
 
         // end flag
         bool quit = false;
@@ -270,51 +346,114 @@ namespace Stockfish::Tools
         // repeat until the specified number of times
         while (!quit)
         {
-            // It is necessary to set a dependent thread for Position.
-            // When parallelizing, Threads (since this is a vector<Thread*>,
-            // Do the same for up to Threads[0]...Threads[thread_num-1].
-            auto& pos = th.rootPos;
+            do_exploration(th, buffers, params.exploration_batch_size);
+
+            rescore(th, buffers, buffers.explored);
+
+            quit = commit_psv(th, buffers.scored, counter, limit);
+        }
+    }
 
-            auto packed_sfens = do_exploration(th, exploration_batch_size);
-            psv.clear();
+    void TrainingDataGeneratorNonPv::exploration_worker(
+        Thread& th,
+        BoundedBlockingQueue<PSVector>& explored,
+        BoundedBlockingQueue<PSVector>& recycled)
+    {
+        WorkerBuffers buffers;
+        buffers.states.resize(params.exploration_max_ply);
+
+        // The queue is closed once enough positions have been written.
+        while (true)
+        {
+            do_exploration(th, buffers, params.exploration_batch_size);
 
-            for (auto& ps : packed_sfens)
+            if (buffers.explored.empty())
             {
-                pos.set_from_packed_sfen(ps.sfen, &si, &th);
-                pos.state()->rule50 = 0;
+                if (explored.is_closed())
+                    break;
 
-                if (params.smart_fen_skipping && pos.checkers())
-                {
-                    continue;
-                }
+                continue;
+            }
 
-                auto [search_value, search_pv] = Search::search(pos, params.search_depth, 1);
+            if (!explored.push(std::move(buffers.explored)))
+                break;
 
-                if (search_pv.empty())
-                {
-                    continue;
-                }
+            // Continue in a returned buffer instead of allocating a new one.
+            if (auto buffer = recycled.try_pop())
+                buffers.explored = std::move(*buffer);
+        }
+    }
 
-                if (std::abs(search_value) > params.eval_limit)
-                {
-                    continue;
-                }
+    void TrainingDataGeneratorNonPv::rescoring_worker(
+        Thread& th,
+        BoundedBlockingQueue<PSVector>& explored,
+        BoundedBlockingQueue<PSVector>& recycled,
+        std::atomic<uint64_t>& counter,
+        uint64_t limit)
+    {
+        WorkerBuffers buffers;
 
-                if (params.smart_fen_skipping && pos.capture_or_promotion(search_pv[0]))
-                {
-                    continue;
-                }
+        while (auto batch = explored.pop())
+        {
+            // Don't rescore the batches left in the queue after the end.
+            if (counter.load() >= limit)
+                break;
+
+            rescore(th, buffers, *batch);
+            recycled.push(std::move(*batch));
+
+            if (commit_psv(th, buffers.scored, counter, limit))
+                break;
+        }
 
-                auto& new_ps = psv.emplace_back();
-                pos.sfen_pack(new_ps.sfen);
-                new_ps.score = search_value;
-                new_ps.move = search_pv[0];
-                new_ps.gamePly = 1;
-                new_ps.game_result = 0;
-                new_ps.padding = 0;
+        // Stops the exploration and the other rescoring threads.
+        explored.close();
+    }
+
+    void TrainingDataGeneratorNonPv::rescore(
+        Thread& th,
+        WorkerBuffers& buffers,
+        const PSVector& explored)
+    {
+        auto& pos = th.rootPos;
+
+        auto& psv = buffers.scored;
+        psv.clear();
+
+        for (auto& ps : explored)
+        {
+            pos.set_from_packed_sfen(ps.sfen, &buffers.si, &th);
+            pos.state()->rule50 = 0;
+
+            if (params.smart_fen_skipping && pos.checkers())
+            {
+                continue;
+            }
+
+            auto [search_value, search_pv] = Search::search(pos, params.search_depth, 1);
+
+            if (search_pv.empty())
+            {
+                continue;
+            }
+
+            if (std::abs(search_value) > params.eval_limit)
+            {
+                continue;
+            }
+
+            if (params.smart_fen_skipping && pos.capture_or_promotion(search_pv[0]))
+            {
+                continue;
             }
 
-            quit = commit_psv(th, psv, counter, limit);
+            auto& new_ps = psv.emplace_back();
+            pos.sfen_pack(new_ps.sfen);
+            new_ps.score = search_value;
+            new_ps.move = search_pv[0];
+            new_ps.gamePly = 1;
+            new_ps.game_result = 0;
+            new_ps.padding = 0;
         }
     }
 
@@ -422,6 +561,14 @@ namespace Stockfish::Tools
                 is >> params.exploration_max_nodes;
             else if (token == "exploration_min_pieces")
                 is >> params.exploration_min_pieces;
+            else if (token == "exploration_max_ply")
+                is >> params.exploration_max_ply;
+            else if (token == "exploration_batch_size")
+                is >> params.exploration_batch_size;
+            else if (token == "exploration_threads")
+                is >> params.exploration_threads;
+            else if (token == "exploration_queue_size")
+                is >> params.exploration_queue_size;
             else if (token == "exploration_save_rate")
                 is >> params.exploration_save_rate;
             else if (token == "book")
@@ -454,6 +601,8 @@ namespace Stockfish::Tools
                 params.sfen_format = SfenOutputType::Bin;
             else if (sfen_format == "binpack")
                 params.sfen_format = SfenOutputType::Binpack;
+            else if (sfen_format == "vbinpack")
+                params.sfen_format = SfenOutputType::VBinpack;
             else
                 cout << "WARNING: Unknown sfen format `" << sfen_format << "`. Using bin\n";
         }
@@ -471,6 +620,10 @@ namespace Stockfish::Tools
             << "  - exploration_min_nodes  = " << params.exploration_min_nodes << endl
             << "  - exploration_max_nodes  = " << params.exploration_max_nodes << endl
             << "  - exploration_min_pieces = " << params.exploration_min_pieces << endl
+            << "  - exploration_max_ply    = " << params.exploration_max_ply << endl
+            << "  - exploration_batch_size = " << params.exploration_batch_size << endl
+            << "  - exploration_threads    = " << params.exploration_threads << endl
+            << "  - exploration_queue_size = " << params.exploration_queue_size << endl
             << "  - exploration_save_rate  = " << params.exploration_save_rate << endl
             << "  - book                   = " << params.book << endl
             << "  - data_format            = " << sfen_format << endl
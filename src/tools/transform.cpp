@@ -1,8 +1,10 @@
 #include "transform.h"
 
 #include "sfen_stream.h"
+#include "sfen_reader.h"
 #include "packed_sfen.h"
 #include "sfen_writer.h"
+#include "dedup_index.h"
 
 #include "thread.h"
 #include "position.h"
@@ -20,6 +22,7 @@
 #include <limits>
 #include <mutex>
 #include <optional>
+#include <vector>
 
 namespace Stockfish::Tools
 {
@@ -50,19 +53,42 @@ namespace Stockfish::Tools
 
     struct RescoreParams
     {
-        std::string input_filename = "in.epd";
+        std::vector<std::string> input_filenames;
         std::string output_filename = "out.binpack";
         int depth = 3;
         int research_count = 0;
         bool keep_moves = true;
+        int decode_threads = 1;
+        bool random_chunks = false;
+        std::uint64_t count = std::numeric_limits<std::uint64_t>::max();
 
         void enforce_constraints()
         {
             depth = std::max(1, depth);
             research_count = std::max(0, research_count);
+            decode_threads = std::max(1, decode_threads);
+
+            if (input_filenames.empty())
+                input_filenames.emplace_back("in.epd");
         }
     };
 
+    struct BuildDedupIndexParams
+    {
+        std::vector<std::string> input_filenames;
+        std::string index_filename = "corpus.dedup";
+        std::uint64_t memory_mb = 1024;
+    };
+
+    struct DedupParams
+    {
+        std::string input_filename = "in.binpack";
+        std::string output_filename = "out.binpack";
+        std::string index_filename = "corpus.dedup";
+        bool update_index = false;
+        std::uint64_t memory_mb = 1024;
+    };
+
     [[nodiscard]] std::int16_t nudge(NudgedStaticParams& params, std::int16_t static_eval_i16, std::int16_t deep_eval_i16)
     {
         auto saturate_i32_to_i16 = [](int v) {
@@ -117,8 +143,11 @@ namespace Stockfish::Tools
     void do_nudged_static(NudgedStaticParams& params)
     {
         Thread* th = Threads.main();
-        Position& pos = th->rootPos;
-        StateInfo si;
+
+        // The positions are evaluated in batches, which is faster with NNUE.
+        constexpr std::size_t eval_batch_size = 32;
+        std::vector<PackedSfen> sfens(eval_batch_size);
+        std::vector<Value> static_evals(eval_batch_size);
 
         auto in = Tools::open_sfen_input_file(params.input_filename);
         auto out = Tools::create_new_sfen_output(params.output_filename);
@@ -143,31 +172,30 @@ namespace Stockfish::Tools
         uint64_t num_processed = 0;
         for (;;)
         {
-            auto v = in->next();
-            if (!v.has_value())
+            if (in->next_n(buffer, batch_size) == 0)
                 break;
 
-            auto& ps = v.value();
+            for (std::size_t first = 0; first < buffer.size(); first += eval_batch_size)
+            {
+                const std::size_t n = std::min(eval_batch_size, buffer.size() - first);
 
-            pos.set_from_packed_sfen(ps.sfen, &si, th);
-            auto static_eval = Eval::evaluate(pos);
-            auto deep_eval = ps.score;
-            ps.score = nudge(params, static_eval, deep_eval);
+                for (std::size_t i = 0; i < n; ++i)
+                    sfens[i] = buffer[first + i].sfen;
 
-            buffer.emplace_back(ps);
-            if (buffer.size() >= batch_size)
-            {
-                num_processed += buffer.size();
+                Eval::evaluate_batch(sfens.data(), n, static_evals.data(), th);
 
-                out->write(buffer);
-                buffer.clear();
+                for (std::size_t i = 0; i < n; ++i)
+                {
+                    // Positions that can't be decoded keep their score.
+                    if (static_evals[i] == VALUE_NONE)
+                        continue;
 
-                std::cout << "Processed " << num_processed << " positions.\n";
+                    auto& ps = buffer[first + i];
+                    auto deep_eval = ps.score;
+                    ps.score = nudge(params, static_evals[i], deep_eval);
+                }
             }
-        }
 
-        if (!buffer.empty())
-        {
             num_processed += buffer.size();
 
             out->write(buffer);
@@ -244,7 +272,7 @@ namespace Stockfish::Tools
 
     void do_rescore_epd(RescoreParams& params)
     {
-        std::ifstream fens_file(params.input_filename);
+        std::ifstream fens_file(params.input_filenames[0]);
 
         auto next_fen = [&fens_file, mutex = std::mutex{}]() mutable -> std::optional<std::string>{
             std::string fen;
@@ -347,32 +375,22 @@ namespace Stockfish::Tools
 
     void do_rescore_data(RescoreParams& params)
     {
-        // TODO: Use SfenReader once it works correctly in sequential mode. See issue #271
-        auto in = Tools::open_sfen_input_file(params.input_filename);
-        auto readsome = [&in, mutex = std::mutex{}](int n) mutable -> PSVector {
-
-            PSVector psv;
-            psv.reserve(n);
-
-            std::unique_lock lock(mutex);
-
-            for (int i = 0; i < n; ++i)
-            {
-                auto ps_opt = in->next();
-                if (ps_opt.has_value())
-                {
-                    psv.emplace_back(*ps_opt);
-                }
-                else
-                {
-                    break;
-                }
-            }
-
-            return psv;
-        };
+        // The positions are rescored in any order and nothing is shuffled,
+        // so it's enough to decode one buffer ahead for every thread.
+        SfenReader reader(
+            params.input_filenames,
+            false,
+            params.random_chunks ? SfenReaderMode::RandomChunks : SfenReaderMode::Sequential,
+            Threads.size(),
+            "",
+            SfenReader::DEFAULT_THREAD_BUFFER_SIZE * Threads.size(),
+            SfenReader::DEFAULT_THREAD_BUFFER_SIZE,
+            params.decode_threads);
 
-        auto sfen_format = ends_with(params.output_filename, ".binpack") ? SfenOutputType::Binpack : SfenOutputType::Bin;
+        auto sfen_format =
+            ends_with(params.output_filename, ".vbinpack") ? SfenOutputType::VBinpack
+            : ends_with(params.output_filename, ".binpack") ? SfenOutputType::Binpack
+            : SfenOutputType::Bin;
 
         auto out = SfenWriter(
             params.output_filename,
@@ -397,58 +415,76 @@ namespace Stockfish::Tools
         limits.depth = 0;
 
         std::atomic<std::uint64_t> num_processed = 0;
+        std::atomic<std::uint64_t> num_taken = 0;
 
         Threads.execute_with_workers([&](auto& th){
             Position& pos = th.rootPos;
             StateInfo si;
+            PackedSfenValue ps;
 
-            for (;;)
+            while (reader.read_to_thread_buffer(th.id(), ps))
             {
-                PSVector psv = readsome(5000);
-                if (psv.empty())
+                if (num_taken.fetch_add(1) >= params.count)
                     break;
 
-                for(auto& ps : psv)
-                {
-                    pos.set_from_packed_sfen(ps.sfen, &si, &th);
+                pos.set_from_packed_sfen(ps.sfen, &si, &th);
 
-                    for (int cnt = 0; cnt < params.research_count; ++cnt)
-                        Search::search(pos, params.depth, 1);
+                for (int cnt = 0; cnt < params.research_count; ++cnt)
+                    Search::search(pos, params.depth, 1);
 
-                    auto [search_value, search_pv] = Search::search(pos, params.depth, 1);
+                auto [search_value, search_pv] = Search::search(pos, params.depth, 1);
 
-                    if (search_pv.empty())
-                        continue;
+                if (search_pv.empty())
+                    continue;
 
-                    pos.sfen_pack(ps.sfen);
-                    ps.score = search_value;
-                    if (!params.keep_moves)
-                        ps.move = search_pv[0];
-                    ps.padding = 0;
+                pos.sfen_pack(ps.sfen);
+                ps.score = search_value;
+                if (!params.keep_moves)
+                    ps.move = search_pv[0];
+                ps.padding = 0;
 
-                    out.write(th.id(), ps);
+                out.write(th.id(), ps);
 
-                    auto p = num_processed.fetch_add(1) + 1;
-                    if (p % 10000 == 0)
-                    {
-                        std::cout << "Processed " << p << " positions.\n";
-                    }
+                auto p = num_processed.fetch_add(1) + 1;
+                if (p % 10000 == 0)
+                {
+                    std::cout << "Processed " << p << " positions.\n";
                 }
             }
         });
         Threads.wait_for_workers_finished();
 
+        // Time blocked on either side tells whether reading or searching
+        // is the bottleneck.
+        const auto consumer_stats = reader.get_consumer_wait_stats();
+        const auto producer_stats = reader.get_producer_wait_stats();
+        std::cout
+            << "Searching waited " << consumer_stats.num_waits << " times for "
+            << consumer_stats.wait_time_us / 1000 << " ms in total, reading waited "
+            << producer_stats.num_waits << " times for " << producer_stats.wait_time_us / 1000 << " ms in total.\n";
+
         std::cout << "Finished.\n";
     }
 
     void do_rescore(RescoreParams& params)
     {
-        if (ends_with(params.input_filename, ".epd"))
+        const auto is_data_file = [](const std::string& filename) {
+            return ends_with(filename, ".bin") || ends_with(filename, ".binpack") || ends_with(filename, ".vbinpack");
+        };
+
+        if (params.input_filenames.size() == 1 && ends_with(params.input_filenames[0], ".epd"))
         {
             do_rescore_epd(params);
         }
-        else if (ends_with(params.input_filename, ".bin") || ends_with(params.input_filename, ".binpack"))
+        else if (std::all_of(params.input_filenames.begin(), params.input_filenames.end(), is_data_file))
         {
+            // Chunks are sampled endlessly.
+            if (params.random_chunks && params.count == std::numeric_limits<std::uint64_t>::max())
+            {
+                std::cerr << "random_chunks requires count.\n";
+                return;
+            }
+
             do_rescore_data(params);
         }
         else
@@ -472,13 +508,19 @@ namespace Stockfish::Tools
             if (token == "depth")
                 is >> params.depth;
             else if (token == "input_file")
-                is >> params.input_filename;
+                is >> params.input_filenames.emplace_back();
             else if (token == "output_file")
                 is >> params.output_filename;
             else if (token == "keep_moves")
                 is >> params.keep_moves;
             else if (token == "research_count")
                 is >> params.research_count;
+            else if (token == "decode_threads")
+                is >> params.decode_threads;
+            else if (token == "random_chunks")
+                params.random_chunks = true;
+            else if (token == "count")
+                is >> params.count;
             else
             {
                 std::cout << "ERROR: Unknown option " << token << ". Exiting...\n";
@@ -490,20 +532,275 @@ namespace Stockfish::Tools
 
         std::cout << "Performing transform rescore with parameters:\n";
         std::cout << "depth               : " << params.depth << '\n';
-        std::cout << "input_file          : " << params.input_filename << '\n';
+        for (const auto& input_filename : params.input_filenames)
+            std::cout << "input_file          : " << input_filename << '\n';
         std::cout << "output_file         : " << params.output_filename << '\n';
         std::cout << "keep_moves          : " << params.keep_moves << '\n';
         std::cout << "research_count      : " << params.research_count << '\n';
+        std::cout << "decode_threads      : " << params.decode_threads << '\n';
+        std::cout << "random_chunks       : " << params.random_chunks << '\n';
+        std::cout << "count               : " << params.count << '\n';
         std::cout << '\n';
 
         do_rescore(params);
     }
 
+    void do_build_dedup_index(BuildDedupIndexParams& params)
+    {
+        Thread* th = Threads.main();
+        Position& pos = th->rootPos;
+        StateInfo si;
+
+        DedupIndexBuilder builder(params.index_filename, params.memory_mb);
+
+        PSVector buffer;
+        uint64_t batch_size = 1'000'000;
+
+        buffer.reserve(batch_size);
+
+        uint64_t num_processed = 0;
+        uint64_t num_invalid = 0;
+        for (const auto& input_filename : params.input_filenames)
+        {
+            auto in = Tools::open_sfen_input_file(input_filename);
+            if (in == nullptr)
+            {
+                std::cerr << "Invalid input file type " << input_filename << ".\n";
+                return;
+            }
+
+            for (;;)
+            {
+                if (in->next_n(buffer, batch_size) == 0)
+                    break;
+
+                for (auto& ps : buffer)
+                {
+                    if (pos.set_from_packed_sfen(ps.sfen, &si, th) != 0)
+                        num_invalid += 1;
+                    else
+                        builder.add(pos.key());
+                }
+
+                num_processed += buffer.size();
+                buffer.clear();
+
+                std::cout << "Processed " << num_processed << " positions.\n";
+            }
+        }
+
+        const auto num_keys = builder.finish();
+        if (num_keys < 0)
+            return;
+
+        std::cout << "Skipped " << num_invalid << " invalid positions.\n";
+        std::cout << "The index now holds " << num_keys << " positions.\n";
+        std::cout << "Finished.\n";
+    }
+
+    void build_dedup_index(std::istringstream& is)
+    {
+        BuildDedupIndexParams params{};
+
+        while(true)
+        {
+            std::string token;
+            is >> token;
+
+            if (token == "")
+                break;
+
+            if (token == "input_file")
+                is >> params.input_filenames.emplace_back();
+            else if (token == "index_file")
+                is >> params.index_filename;
+            else if (token == "memory")
+                is >> params.memory_mb;
+            else
+            {
+                std::cout << "ERROR: Unknown option " << token << ". Exiting...\n";
+                return;
+            }
+        }
+
+        std::cout << "Performing transform build_dedup_index with parameters:\n";
+        for (const auto& input_filename : params.input_filenames)
+            std::cout << "input_file          : " << input_filename << '\n';
+        std::cout << "index_file          : " << params.index_filename << '\n';
+        std::cout << "memory              : " << params.memory_mb << '\n';
+        std::cout << '\n';
+
+        do_build_dedup_index(params);
+    }
+
+    void do_dedup(DedupParams& params)
+    {
+        Thread* th = Threads.main();
+        Position& pos = th->rootPos;
+        StateInfo si;
+
+        DedupIndex index;
+        if (!index.open(params.index_filename))
+            return;
+
+        auto in = Tools::open_sfen_input_file(params.input_filename);
+
+        if (in == nullptr)
+        {
+            std::cerr << "Invalid input file type.\n";
+            return;
+        }
+
+        PSVector buffer;
+        uint64_t batch_size = 1'000'000;
+
+        buffer.reserve(batch_size);
+
+        // The duplicates within the input are found with an external sort
+        // of the keys, so the memory doesn't grow with the input. The first
+        // pass collects the keys that are not in the index, the second one
+        // copies the first occurrence of each.
+        FirstOccurrenceFinder finder(params.output_filename + ".positions", params.memory_mb);
+
+        uint64_t num_processed = 0;
+        uint64_t num_invalid = 0;
+        while (in->next_n(buffer, batch_size) != 0)
+        {
+            for (auto& ps : buffer)
+            {
+                const uint64_t i = num_processed++;
+
+                if (pos.set_from_packed_sfen(ps.sfen, &si, th) != 0)
+                {
+                    num_invalid += 1;
+                    continue;
+                }
+
+                const Key key = pos.key();
+                if (!index.contains(key))
+                    finder.add(key, i);
+            }
+
+            buffer.clear();
+
+            std::cout << "Collected the keys of " << num_processed << " positions.\n";
+        }
+
+        // Invalid positions have no key to compare, and dropping them would
+        // pass them off as duplicates. Nothing is written in that case.
+        if (num_invalid != 0)
+        {
+            std::cerr << "ERROR: " << num_invalid << " of " << num_processed
+                      << " positions are invalid, check UCI_Variant. Exiting...\n";
+            return;
+        }
+
+        std::optional<DedupIndexBuilder> new_keys;
+        if (params.update_index)
+            new_keys.emplace(params.index_filename, params.memory_mb / 2);
+
+        const auto num_unique = finder.finish(new_keys.has_value() ? &*new_keys : nullptr);
+        if (num_unique < 0)
+            return;
+
+        in = Tools::open_sfen_input_file(params.input_filename);
+        auto out = Tools::create_new_sfen_output(params.output_filename);
+
+        if (in == nullptr)
+        {
+            std::cerr << "Invalid input file type.\n";
+            return;
+        }
+
+        if (out == nullptr)
+        {
+            std::cerr << "Invalid output file type.\n";
+            return;
+        }
+
+        PSVector kept;
+        kept.reserve(batch_size);
+
+        uint64_t num_copied = 0;
+        uint64_t num_kept = 0;
+        while (in->next_n(buffer, batch_size) != 0)
+        {
+            for (auto& ps : buffer)
+                if (finder.is_first(num_copied++))
+                    kept.emplace_back(ps);
+
+            num_kept += kept.size();
+
+            out->write(kept);
+            buffer.clear();
+            kept.clear();
+
+            std::cout << "Processed " << num_copied << " positions, kept " << num_kept << ".\n";
+        }
+
+        out.reset();
+
+        std::cout << "Dropped " << num_copied - num_kept << " of " << num_copied << " positions.\n";
+
+        if (new_keys.has_value())
+        {
+            const auto num_keys = new_keys->finish();
+            if (num_keys < 0)
+                return;
+
+            std::cout << "The index now holds " << num_keys << " positions.\n";
+        }
+
+        std::cout << "Finished.\n";
+    }
+
+    void dedup(std::istringstream& is)
+    {
+        DedupParams params{};
+
+        while(true)
+        {
+            std::string token;
+            is >> token;
+
+            if (token == "")
+                break;
+
+            if (token == "input_file")
+                is >> params.input_filename;
+            else if (token == "output_file")
+                is >> params.output_filename;
+            else if (token == "index_file")
+                is >> params.index_filename;
+            else if (token == "update_index")
+                is >> params.update_index;
+            else if (token == "memory")
+                is >> params.memory_mb;
+            else
+            {
+                std::cout << "ERROR: Unknown option " << token << ". Exiting...\n";
+                return;
+            }
+        }
+
+        std::cout << "Performing transform dedup with parameters:\n";
+        std::cout << "input_file          : " << params.input_filename << '\n';
+        std::cout << "output_file         : " << params.output_filename << '\n';
+        std::cout << "index_file          : " << params.index_filename << '\n';
+        std::cout << "update_index        : " << params.update_index << '\n';
+        std::cout << "memory              : " << params.memory_mb << '\n';
+        std::cout << '\n';
+
+        do_dedup(params);
+    }
+
     void transform(std::istringstream& is)
     {
         const std::map<std::string, CommandFunc> subcommands = {
             { "nudged_static", &nudged_static },
-            { "rescore", &rescore }
+            { "rescore", &rescore },
+            { "build_dedup_index", &build_dedup_index },
+            { "dedup", &dedup }
         };
 
         Eval::NNUE::init();
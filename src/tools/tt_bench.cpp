@@ -0,0 +1,148 @@
+#include "tt_bench.h"
+
+#include "misc.h"
+#include "movegen.h"
+#include "position.h"
+#include "search.h"
+#include "thread.h"
+#include "uci.h"
+#include "variant.h"
+
+#include <algorithm>
+#include <atomic>
+#include <cstdint>
+#include <deque>
+#include <iostream>
+#include <string>
+#include <vector>
+
+namespace Stockfish::Tools
+{
+    struct TTBenchParams
+    {
+        std::uint64_t num_positions = 1000;
+        int depth = 8;
+        int max_ply = 100;
+        std::uint64_t thread_hash = 0;
+        std::string seed = "tt_bench";
+    };
+
+    // Collects positions of random games from the start position of the current variant.
+    static std::vector<std::string> random_fens(const TTBenchParams& params)
+    {
+        const Variant* variant = variants.find(Options["UCI_Variant"])->second;
+        PRNG prng(params.seed);
+
+        std::vector<std::string> fens;
+        fens.reserve(params.num_positions);
+
+        while (fens.size() < params.num_positions)
+        {
+            std::deque<StateInfo> states(1);
+            Position pos;
+            pos.set(variant, variant->startFen, false, &states.back(), Threads.main());
+
+            for (int ply = 0; ply < params.max_ply && fens.size() < params.num_positions; ++ply)
+            {
+                const MoveList<LEGAL> moves(pos);
+                if (moves.size() == 0)
+                    break;
+
+                fens.emplace_back(pos.fen());
+
+                states.emplace_back();
+                pos.do_move(moves.begin()[prng.rand(moves.size())].move, states.back());
+            }
+        }
+
+        return fens;
+    }
+
+    // Searches every position once with all threads, like the data
+    // generators do, and prints the speed.
+    static void run_tt_bench(const std::string& name, const std::vector<std::string>& fens, int depth)
+    {
+        const Variant* variant = variants.find(Options["UCI_Variant"])->second;
+
+        Search::clear();
+
+        std::atomic<std::uint64_t> nodes = 0;
+
+        const auto start = now();
+        Threads.for_each_index_with_workers(std::size_t(0), fens.size(),
+            [&](Thread& th, std::size_t i) {
+                StateInfo si;
+                th.rootPos.set(variant, fens[i], false, &si, &th);
+                Search::search(th.rootPos, depth, 1);
+                nodes += th.nodes.load(std::memory_order_relaxed);
+            });
+        Threads.wait_for_workers_finished();
+        const auto elapsed = std::max<TimePoint>(now() - start, 1);
+
+        std::cout << name << " (pos/hour) : " << fens.size() * 3600 * 1000 / elapsed << '\n'
+                  << name << " (nodes/s)  : " << nodes * 1000 / elapsed << '\n';
+    }
+
+    // Compares the speed of searches of independent positions on all threads
+    // with the shared transposition table and with private tables.
+    void tt_bench(std::istringstream& is)
+    {
+        TTBenchParams params{};
+
+        while(true)
+        {
+            std::string token;
+            is >> token;
+
+            if (token == "")
+                break;
+
+            if (token == "positions")
+                is >> params.num_positions;
+            else if (token == "depth")
+                is >> params.depth;
+            else if (token == "max_ply")
+                is >> params.max_ply;
+            else if (token == "thread_hash")
+                is >> params.thread_hash;
+            else if (token == "seed")
+                is >> params.seed;
+            else
+            {
+                std::cout << "ERROR: Unknown option " << token << ". Exiting...\n";
+                return;
+            }
+        }
+
+        // By default the private tables use as much memory as the shared one.
+        if (params.thread_hash == 0)
+            params.thread_hash = std::max<std::uint64_t>(std::size_t(Options["Hash"]) / Threads.size(), 1);
+
+        params.depth = std::max(params.depth, 1);
+
+        std::cout << "Performing tt_bench with parameters:\n";
+        std::cout << "positions           : " << params.num_positions << '\n';
+        std::cout << "depth               : " << params.depth << '\n';
+        std::cout << "max_ply             : " << params.max_ply << '\n';
+        std::cout << "hash                : " << std::size_t(Options["Hash"]) << '\n';
+        std::cout << "thread_hash         : " << params.thread_hash << '\n';
+        std::cout << "threads             : " << Threads.size() << '\n';
+        std::cout << '\n';
+
+        const auto fens = random_fens(params);
+
+        auto& limits = Search::Limits;
+        limits.infinite = true;
+        limits.silent = true;
+        limits.nodes = 0;
+        limits.depth = 0;
+
+        Threads.set_thread_hash(0);
+        run_tt_bench("Shared ", fens, params.depth);
+
+        Threads.set_thread_hash(params.thread_hash);
+        run_tt_bench("Private", fens, params.depth);
+
+        Threads.set_thread_hash(std::size_t(Options["Thread Hash"]));
+    }
+}
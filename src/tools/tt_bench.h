@@ -0,0 +1,12 @@
+#ifndef _TT_BENCH_H_
+#define _TT_BENCH_H_
+
+#include <sstream>
+
+namespace Stockfish::Tools {
+
+    void tt_bench(std::istringstream& is);
+
+}
+
+#endif
@@ -0,0 +1,424 @@
+#include "variant_binpack.h"
+
+#include "sfen_packer.h"
+
+#include "movegen.h"
+#include "position.h"
+#include "thread.h"
+#include "uci.h"
+
+#include <cstring>
+#include <iostream>
+#include <limits>
+
+namespace Stockfish::Tools {
+
+    namespace {
+
+        // Number of bits needed to store an index into a list of n moves.
+        int index_bits(std::size_t n)
+        {
+            int bits = 0;
+            while ((std::size_t(1) << bits) < n)
+                ++bits;
+
+            return bits;
+        }
+
+        // Thread the positions of all writers and readers are bound to.
+        // It never searches, so nothing reads the node count that do_move()
+        // increments on it, and the search threads are left alone.
+        Thread* codec_thread()
+        {
+            static Thread th(std::numeric_limits<std::size_t>::max());
+            return &th;
+        }
+
+        // The positions are always set up from the packed sfen, so that
+        // the writer and the reader generate exactly the same move lists.
+        // Returns false if the sfen is invalid.
+        bool set_position(Position& pos, StateInfo& si, const PackedSfen& sfen)
+        {
+            return pos.set_from_packed_sfen(sfen, &si, codec_thread()) == 0;
+        }
+
+        // Returns the index of the legal move that was stored as move16,
+        // or -1 if there is no such move.
+        int find_legal_move(const Position& pos, std::uint16_t move16, Move& move, std::size_t& num_moves)
+        {
+            const MoveList<LEGAL> moves(pos);
+            num_moves = moves.size();
+
+            for (std::size_t i = 0; i < num_moves; ++i)
+                if (static_cast<std::uint16_t>(moves.begin()[i].move) == move16)
+                {
+                    move = moves.begin()[i].move;
+                    return static_cast<int>(i);
+                }
+
+            return -1;
+        }
+
+        PackedSfen sfen_after_move(Position& pos, Move move)
+        {
+            StateInfo si;
+            pos.do_move(move, si);
+
+            return sfen_pack(pos);
+        }
+
+        std::string current_variant()
+        {
+            return std::string(Options["UCI_Variant"]);
+        }
+    }
+
+    VariantBinpackWriter::VariantBinpackWriter(const std::string& path, std::ios_base::openmode om, bool write_index) :
+        m_file(std::in_place, path, om),
+        m_index(write_index ? std::make_unique<binpack::CompressedTrainingDataIndexWriter>(path, om) : nullptr),
+        m_encoded_chunks(nullptr),
+        m_num_chunk_entries(0),
+        m_chunk_first_ply(0),
+        m_movetext_bits(0),
+        m_num_continuations(0),
+        m_has_chain(false),
+        m_last{},
+        m_next_sfen{},
+        m_last_move_legal(false)
+    {
+        m_chunk.reserve(chunk_size + 64 * 1024);
+    }
+
+    VariantBinpackWriter::VariantBinpackWriter(std::vector<binpack::EncodedChunk>& out) :
+        m_file(std::nullopt),
+        m_index(nullptr),
+        m_encoded_chunks(&out),
+        m_num_chunk_entries(0),
+        m_chunk_first_ply(0),
+        m_movetext_bits(0),
+        m_num_continuations(0),
+        m_has_chain(false),
+        m_last{},
+        m_next_sfen{},
+        m_last_move_legal(false)
+    {
+    }
+
+    void VariantBinpackWriter::add_encoded_chunk(const binpack::EncodedChunk& chunk)
+    {
+        assert(m_file.has_value());
+
+        flush();
+
+        const auto size = static_cast<std::uint32_t>(chunk.data.size());
+        const auto offset = m_file->append(chunk.data.data(), size);
+        if (m_index)
+            m_index->add({ offset, size, chunk.numEntries, chunk.firstPly });
+    }
+
+    void VariantBinpackWriter::add_entry(const PackedSfenValue& psv)
+    {
+        Position pos;
+        StateInfo si;
+
+        // Entries with an invalid position are stored as they are.
+        Move move = MOVE_NONE;
+        std::size_t num_moves = 0;
+        const int index = set_position(pos, si, psv.sfen) ? find_legal_move(pos, psv.move, move, num_moves) : -1;
+
+        const bool is_continuation =
+               m_has_chain
+            && m_last_move_legal
+            && index >= 0
+            && m_num_continuations < 0xFFFF
+            && psv.gamePly == static_cast<std::uint16_t>(m_last.gamePly + 1)
+            && psv.game_result == -m_last.game_result
+            && psv.padding == 0
+            && std::memcmp(&psv.sfen, &m_next_sfen, sizeof(PackedSfen)) == 0;
+
+        if (is_continuation)
+        {
+            write_bits(index, index_bits(num_moves));
+
+            // The score usually stays close to the negated score of the previous entry.
+            const auto delta = static_cast<std::int16_t>(static_cast<std::uint16_t>(psv.score + m_last.score));
+            std::uint32_t v = binpack::signedToUnsigned(delta);
+            do
+            {
+                write_bits((v & 0xF) | (v > 0xF ? 0x10 : 0), 5);
+                v >>= 4;
+            } while (v);
+
+            ++m_num_continuations;
+        }
+        else
+        {
+            if (m_has_chain)
+                end_chain();
+
+            if (m_chunk.size() >= chunk_size)
+                flush();
+
+            if (m_chunk.empty())
+            {
+                start_chunk();
+                m_chunk_first_ply = psv.gamePly;
+            }
+
+            const auto* bytes = reinterpret_cast<const unsigned char*>(&psv);
+            m_chunk.insert(m_chunk.end(), bytes, bytes + sizeof(PackedSfenValue));
+
+            m_has_chain = true;
+        }
+
+        ++m_num_chunk_entries;
+
+        m_last = psv;
+        m_last_move_legal = index >= 0;
+        if (m_last_move_legal)
+            m_next_sfen = sfen_after_move(pos, move);
+    }
+
+    void VariantBinpackWriter::flush()
+    {
+        if (m_has_chain)
+            end_chain();
+
+        if (!m_chunk.empty())
+        {
+            if (m_encoded_chunks)
+                m_encoded_chunks->push_back({ std::vector<char>(m_chunk.begin(), m_chunk.end()), m_num_chunk_entries, m_chunk_first_ply });
+            else
+            {
+                const auto offset = m_file->append(reinterpret_cast<const char*>(m_chunk.data()), static_cast<std::uint32_t>(m_chunk.size()));
+                if (m_index)
+                    m_index->add({ offset, static_cast<std::uint32_t>(m_chunk.size()), m_num_chunk_entries, m_chunk_first_ply });
+            }
+
+            m_chunk.clear();
+            m_num_chunk_entries = 0;
+        }
+    }
+
+    VariantBinpackWriter::~VariantBinpackWriter()
+    {
+        flush();
+    }
+
+    void VariantBinpackWriter::start_chunk()
+    {
+        const std::string variant = current_variant();
+
+        m_chunk.push_back(static_cast<unsigned char>(DATA_SIZE));
+        m_chunk.push_back(static_cast<unsigned char>(DATA_SIZE >> 8));
+        m_chunk.push_back(static_cast<unsigned char>(variant.size()));
+        m_chunk.insert(m_chunk.end(), variant.begin(), variant.end());
+    }
+
+    void VariantBinpackWriter::end_chain()
+    {
+        m_chunk.push_back(static_cast<unsigned char>(m_num_continuations));
+        m_chunk.push_back(static_cast<unsigned char>(m_num_continuations >> 8));
+        m_chunk.insert(m_chunk.end(), m_movetext.begin(), m_movetext.end());
+
+        m_movetext.clear();
+        m_movetext_bits = 0;
+        m_num_continuations = 0;
+        m_has_chain = false;
+    }
+
+    // Bits are stored from the lowest to the highest of each byte.
+    void VariantBinpackWriter::write_bits(std::uint32_t value, int n)
+    {
+        for (int i = 0; i < n; ++i)
+        {
+            if (m_movetext_bits % 8 == 0)
+                m_movetext.push_back(0);
+
+            if (value & (1u << i))
+                m_movetext.back() |= 1 << (m_movetext_bits % 8);
+
+            ++m_movetext_bits;
+        }
+    }
+
+    VariantBinpackReader::VariantBinpackReader(const std::string& path) :
+        m_file(path, std::ios_base::in),
+        m_offset(0),
+        m_num_chunks_read(0),
+        m_num_continuations(0),
+        m_bit_cursor(0),
+        m_last{},
+        m_next_sfen{}
+    {
+    }
+
+    bool VariantBinpackReader::has_next()
+    {
+        while (!m_pending.has_value())
+        {
+            if (m_num_continuations == 0 && m_offset >= m_chunk.size() && !read_next_chunk())
+                return false;
+
+            PackedSfenValue psv;
+            if (decode_entry(psv))
+            {
+                m_pending = psv;
+                break;
+            }
+
+            std::cerr << "ERROR (vbinpack): Invalid data, skipping the rest of the chunk.\n";
+
+            m_chunk.clear();
+            m_offset = 0;
+            m_num_continuations = 0;
+        }
+
+        return true;
+    }
+
+    PackedSfenValue VariantBinpackReader::next()
+    {
+        [[maybe_unused]] const bool ok = has_next();
+        assert(ok);
+
+        const PackedSfenValue psv = *m_pending;
+        m_pending.reset();
+        return psv;
+    }
+
+    bool VariantBinpackReader::decode_entry(PackedSfenValue& psv)
+    {
+        Position pos;
+        StateInfo si;
+
+        Move move = MOVE_NONE;
+
+        if (m_num_continuations > 0)
+        {
+            if (!set_position(pos, si, m_next_sfen))
+                return false;
+
+            const MoveList<LEGAL> moves(pos);
+            std::uint32_t index;
+            if (!read_bits(index_bits(moves.size()), index) || index >= moves.size())
+                return false;
+
+            move = moves.begin()[index].move;
+
+            // The score delta has at most 16 bits, in 4 blocks.
+            std::uint32_t v = 0;
+            for (int shift = 0; ; shift += 4)
+            {
+                std::uint32_t block;
+                if (shift >= 16 || !read_bits(5, block))
+                    return false;
+
+                v |= (block & 0xF) << shift;
+                if (!(block & 0x10))
+                    break;
+            }
+            const auto delta = static_cast<std::uint16_t>(binpack::unsignedToSigned(static_cast<std::uint16_t>(v)));
+
+            psv.sfen = m_next_sfen;
+            psv.score = static_cast<std::int16_t>(static_cast<std::uint16_t>(delta - m_last.score));
+            psv.move = static_cast<std::uint16_t>(move);
+            psv.gamePly = m_last.gamePly + 1;
+            psv.game_result = -m_last.game_result;
+            psv.padding = 0;
+
+            // The chain ends at a byte boundary.
+            if (--m_num_continuations == 0)
+                m_offset = (m_bit_cursor + 7) / 8;
+        }
+        else
+        {
+            // The stem and the number of continuations.
+            if (m_chunk.size() - m_offset < sizeof(PackedSfenValue) + 2)
+                return false;
+
+            std::memcpy(&psv, m_chunk.data() + m_offset, sizeof(PackedSfenValue));
+            m_offset += sizeof(PackedSfenValue);
+
+            m_num_continuations = m_chunk[m_offset] | (m_chunk[m_offset + 1] << 8);
+            m_offset += 2;
+            m_bit_cursor = m_offset * 8;
+
+            if (m_num_continuations > 0)
+            {
+                std::size_t num_moves;
+                if (!set_position(pos, si, psv.sfen) || find_legal_move(pos, psv.move, move, num_moves) < 0)
+                    return false;
+            }
+        }
+
+        if (m_num_continuations > 0)
+            m_next_sfen = sfen_after_move(pos, move);
+
+        m_last = psv;
+        return true;
+    }
+
+    void VariantBinpackReader::seek_to_chunk(std::uint64_t offset)
+    {
+        m_file.seekChunk(offset);
+        m_chunk.clear();
+        m_offset = 0;
+        m_num_continuations = 0;
+        m_pending.reset();
+    }
+
+    bool VariantBinpackReader::read_next_chunk()
+    {
+        while (m_file.hasNextChunk())
+        {
+            m_chunk = m_file.readNextChunk();
+            m_offset = 0;
+            m_num_continuations = 0;
+            m_num_chunks_read += 1;
+
+            const std::size_t name_length = m_chunk.size() >= 3 ? m_chunk[2] : 0;
+            if (m_chunk.size() < 3 + name_length)
+            {
+                std::cerr << "ERROR (vbinpack): Chunk too short for its header, skipping it.\n";
+                continue;
+            }
+
+            const int data_size = m_chunk[0] | (m_chunk[1] << 8);
+            const std::string variant(m_chunk.begin() + 3, m_chunk.begin() + 3 + name_length);
+
+            // Like invalid data, such a chunk is skipped, so a reader
+            // always continues with the following chunk.
+            if (data_size != DATA_SIZE || variant != current_variant())
+            {
+                std::cerr << "ERROR (vbinpack): Chunk was written for variant " << variant
+                          << " with DATA_SIZE=" << data_size << ". Expected " << current_variant()
+                          << " with DATA_SIZE=" << DATA_SIZE << ", skipping it.\n";
+                continue;
+            }
+
+            m_offset = 3 + name_length;
+            if (m_offset < m_chunk.size())
+                return true;
+        }
+
+        m_chunk.clear();
+        m_offset = 0;
+        return false;
+    }
+
+    bool VariantBinpackReader::read_bits(int n, std::uint32_t& value)
+    {
+        if (m_bit_cursor + n > m_chunk.size() * 8)
+            return false;
+
+        value = 0;
+        for (int i = 0; i < n; ++i)
+        {
+            value |= ((m_chunk[m_bit_cursor / 8] >> (m_bit_cursor % 8)) & 1) << i;
+            ++m_bit_cursor;
+        }
+
+        return true;
+    }
+}
@@ -0,0 +1,141 @@
+#ifndef _VARIANT_BINPACK_H_
+#define _VARIANT_BINPACK_H_
+
+#include "packed_sfen.h"
+
+#include "extra/nnue_data_binpack_format.h"
+
+#include <cstdint>
+#include <cstddef>
+#include <memory>
+#include <optional>
+#include <string>
+#include <vector>
+
+namespace Stockfish::Tools {
+
+    // Variant aware chained training data format (.vbinpack).
+    //
+    // The file is a sequence of chunks in the same container as .binpack
+    // ('BINP' + 32-bit size), so the existing chunk level tools work on it.
+    // Every chunk can be decoded on its own and starts with a header:
+    //   - uint16 DATA_SIZE the data was written with
+    //   - uint8 length of the variant name, followed by the name
+    // followed by chains of consecutive positions of a game:
+    //   - the stem, a raw PackedSfenValue as produced by SfenPacker
+    //   - uint16 number of continuation entries
+    //   - a bit stream with, for each continuation entry, the index of its
+    //     move in the variant's legal move list (ceil(log2(n)) bits) and
+    //     the difference between its score and the negated score of the
+    //     previous entry (zigzag, variable length in 4-bit blocks)
+    //
+    // An entry is a continuation if its position is the previous position
+    // after the previous move, its ply is one higher, its result is negated
+    // and its move is legal. The data is reproduced bit by bit.
+    //
+    // The positions are set up on a thread of their own that never searches,
+    // so the writers and readers can be used from any thread while a search
+    // is running.
+    struct VariantBinpackWriter
+    {
+        static constexpr std::size_t chunk_size = binpack::suggestedChunkSize;
+
+        // With write_index the chunks are also recorded in the sidecar index,
+        // see binpack::CompressedTrainingDataIndexWriter.
+        VariantBinpackWriter(const std::string& path, std::ios_base::openmode om = std::ios_base::app, bool write_index = false);
+
+        // Collects the chunks in memory instead of writing them to a file.
+        // They can be written later with add_encoded_chunk().
+        explicit VariantBinpackWriter(std::vector<binpack::EncodedChunk>& out);
+
+        VariantBinpackWriter(const VariantBinpackWriter&) = delete;
+        VariantBinpackWriter& operator=(const VariantBinpackWriter&) = delete;
+
+        void add_entry(const PackedSfenValue& psv);
+
+        // Appends a chunk encoded by another writer, after the current chunk.
+        void add_encoded_chunk(const binpack::EncodedChunk& chunk);
+
+        // Writes out the current chunk, if any.
+        void flush();
+
+        ~VariantBinpackWriter();
+
+    private:
+        std::optional<binpack::CompressedTrainingDataFile> m_file;
+        std::unique_ptr<binpack::CompressedTrainingDataIndexWriter> m_index;
+        std::vector<binpack::EncodedChunk>* m_encoded_chunks;
+
+        // Chunk that is being built.
+        std::vector<unsigned char> m_chunk;
+        std::uint32_t m_num_chunk_entries;
+        std::uint16_t m_chunk_first_ply;
+
+        // Continuations of the current chain.
+        std::vector<unsigned char> m_movetext;
+        std::uint64_t m_movetext_bits;
+        std::uint16_t m_num_continuations;
+
+        bool m_has_chain;
+        PackedSfenValue m_last;
+
+        // The last entry after its move, valid if m_last_move_legal.
+        PackedSfen m_next_sfen;
+        bool m_last_move_legal;
+
+        void start_chunk();
+        void end_chain();
+        void write_bits(std::uint32_t value, int n);
+    };
+
+    struct VariantBinpackReader
+    {
+        VariantBinpackReader(const std::string& path);
+
+        VariantBinpackReader(const VariantBinpackReader&) = delete;
+        VariantBinpackReader& operator=(const VariantBinpackReader&) = delete;
+
+        // Decodes the next entry. Chunks with invalid data are reported
+        // and skipped.
+        [[nodiscard]] bool has_next();
+
+        // Requires has_next().
+        [[nodiscard]] PackedSfenValue next();
+
+        // Continues reading from the chunk at the given offset,
+        // as found in the sidecar index.
+        void seek_to_chunk(std::uint64_t offset);
+
+        // Number of chunks read so far, including the one the entry
+        // decoded by has_next() comes from.
+        [[nodiscard]] std::uint64_t num_chunks_read() const { return m_num_chunks_read; }
+
+    private:
+        binpack::CompressedTrainingDataFile m_file;
+
+        std::vector<unsigned char> m_chunk;
+        std::size_t m_offset;
+        std::uint64_t m_num_chunks_read;
+
+        // Continuations of the current chain left to read.
+        std::uint16_t m_num_continuations;
+        std::uint64_t m_bit_cursor;
+
+        PackedSfenValue m_last;
+
+        // The last entry after its move, valid if m_num_continuations > 0.
+        PackedSfen m_next_sfen;
+
+        // Entry decoded by has_next() that next() returns.
+        std::optional<PackedSfenValue> m_pending;
+
+        bool read_next_chunk();
+
+        // These return false if the data is invalid
+        // or the chunk ends before it does.
+        bool decode_entry(PackedSfenValue& psv);
+        bool read_bits(int n, std::uint32_t& value);
+    };
+}
+
+#endif
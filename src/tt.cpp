@@ -54,7 +54,7 @@ void TTEntry::save(Key k, Value v, bool pv, Bound b, Depth d, Move m, Value ev)
 
       key16     = (uint16_t)k;
       depth8    = (uint8_t)(d - DEPTH_OFFSET);
-      genBound8 = (uint8_t)(TT.generation8 | uint8_t(pv) << 2 | b);
+      genBound8 = (uint8_t)(TranspositionTable::generation8 | uint8_t(pv) << 2 | b);
       value16   = (int16_t)v;
       eval16    = (int16_t)ev;
   }
@@ -69,7 +69,32 @@ void TranspositionTable::resize(size_t mbSize) {
 
   Threads.main()->wait_for_search_finished();
 
+  allocate(mbSize);
+  clear();
+}
+
+
+/// TranspositionTable::resize_local() is like resize(), but the table is
+/// zeroed by the calling thread. A size of 0 frees the table.
+
+void TranspositionTable::resize_local(size_t mbSize) {
+
+  allocate(mbSize);
+  clear_local();
+}
+
+
+/// TranspositionTable::allocate() replaces the table by an uninitialized
+/// one of the given size.
+
+void TranspositionTable::allocate(size_t mbSize) {
+
   aligned_large_pages_free(table);
+  table = nullptr;
+  clusterCount = 0;
+
+  if (mbSize == 0)
+      return;
 
   clusterCount = mbSize * 1024 * 1024 / sizeof(Cluster);
 
@@ -80,8 +105,6 @@ void TranspositionTable::resize(size_t mbSize) {
                 << "MB for transposition table." << std::endl;
       exit(EXIT_FAILURE);
   }
-
-  clear();
 }
 
 
@@ -115,6 +138,15 @@ void TranspositionTable::clear() {
 }
 
 
+/// TranspositionTable::clear_local() zeroes the table from the calling thread.
+
+void TranspositionTable::clear_local() {
+
+  if (table)
+      std::memset(table, 0, clusterCount * sizeof(Cluster));
+}
+
+
 /// TranspositionTable::probe() looks up the current position in the transposition
 /// table. It returns true and a pointer to the TTEntry if the position is found.
 /// Otherwise, it returns false and a pointer to an empty or least valuable TTEntry
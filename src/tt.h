@@ -61,7 +61,8 @@ private:
 /// cluster consists of ClusterSize number of TTEntry. Each non-empty TTEntry
 /// contains information on exactly one position. The size of a Cluster should
 /// divide the size of a cache line for best performance, as the cacheline is
-/// prefetched when possible.
+/// prefetched when possible. Searches use the global TT, unless their thread
+/// has a private table (see Thread::tt).
 
 class TranspositionTable {
 
@@ -88,6 +89,11 @@ public:
   void resize(size_t mbSize);
   void clear();
 
+  // Tables that are private to a thread are allocated and zeroed by that
+  // thread only, so that their memory is local to it.
+  void resize_local(size_t mbSize);
+  void clear_local();
+
   TTEntry* first_entry(const Key key) const {
     return &table[mul_hi64(key, clusterCount)].entry[0];
   }
@@ -97,9 +103,14 @@ public:
 private:
   friend struct TTEntry;
 
-  size_t clusterCount;
-  Cluster* table;
-  uint8_t generation8; // Size must be not bigger than TTEntry::genBound8
+  void allocate(size_t mbSize);
+
+  size_t clusterCount = 0;
+  Cluster* table = nullptr;
+
+  // Shared by all tables, so that an entry can be saved without knowing
+  // its table. Size must be not bigger than TTEntry::genBound8
+  static inline uint8_t generation8 = 0;
 };
 
 extern TranspositionTable TT;
@@ -40,7 +40,12 @@
 #include "tools/training_data_generator_nonpv.h"
 #include "tools/convert.h"
 #include "tools/transform.h"
+#include "tools/shuffle.h"
+#include "tools/interleave.h"
+#include "tools/packer_bench.h"
 #include "tools/stats.h"
+#include "tools/nnue_trace.h"
+#include "tools/tt_bench.h"
 
 using namespace std;
 
@@ -477,6 +482,14 @@ void UCI::loop(int argc, char* argv[]) {
               filename = f;
           Eval::NNUE::save_eval(filename);
       }
+      else if (token == "export_mapped_net")
+      {
+          std::string filename;
+          if (is >> skipws >> filename)
+              Eval::NNUE::save_mapped_eval(filename);
+          else
+              sync_cout << "Failed to export a mapped net. The filename is required" << sync_endl;
+      }
       else if (token == "load")     { load(is); argc = 1; } // continue reading stdin
       else if (token == "check")    load(is, true);
       // UCI-Cyclone omits the "position" keyword
@@ -493,14 +506,19 @@ void UCI::loop(int argc, char* argv[]) {
           position(pos, is, states);
       }
       else if (token == "generate_training_data") Tools::generate_training_data(is);
-      else if (token == "generate_training_data") Tools::generate_training_data_nonpv(is);
+      else if (token == "generate_training_data_nonpv") Tools::generate_training_data_nonpv(is);
       else if (token == "convert") Tools::convert(is);
       else if (token == "validate_training_data") Tools::validate_training_data(is);
       else if (token == "convert_bin") Tools::convert_bin(is);
       else if (token == "convert_plain") Tools::convert_plain(is);
       else if (token == "convert_bin_from_pgn_extract") Tools::convert_bin_from_pgn_extract(is);
       else if (token == "transform") Tools::transform(is);
+      else if (token == "shuffle") Tools::shuffle(is);
+      else if (token == "interleave") Tools::interleave(is);
+      else if (token == "packer_bench") Tools::packer_bench(is);
       else if (token == "gather_statistics") Tools::Stats::gather_statistics(is);
+      else if (token == "nnue_trace") Tools::nnue_trace(is);
+      else if (token == "tt_bench") Tools::tt_bench(is);
 
       // Command to call qsearch(),search() directly for testing
       else if (token == "qsearch") qsearch_cmd(pos);